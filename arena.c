@@ -0,0 +1,124 @@
+#include <assert.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGNMENT 16
+#define ARENA_ALIGN(x) (((x) + ARENA_ALIGNMENT - 1) & ~(uintptr_t)(ARENA_ALIGNMENT - 1))
+
+// data of block starts right after header, rounded up to alignment
+#define BLOCK_HEADER_SIZE ARENA_ALIGN(sizeof(struct ArenaBlock))
+#define BLOCK_DATA(block) ((uint8_t *)(block) + BLOCK_HEADER_SIZE)
+
+void init_arena(struct Arena *arena, size_t block_size) {
+    memset(arena, 0, sizeof(struct Arena));
+    arena->block_size = block_size;
+}
+
+void cleanup_arena(struct Arena *arena) {
+    struct ArenaBlock *block = arena->blocks;
+    while (block) {
+        struct ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->blocks = NULL;
+}
+
+/// reset_arena()
+///     Frees everything allocated from arena, one block of regular size is kept
+void reset_arena(struct Arena *arena) {
+    struct ArenaBlock *kept = NULL;
+    struct ArenaBlock *block = arena->blocks;
+    while (block) {
+        struct ArenaBlock *next = block->next;
+        if ((kept == NULL) && (block->size == arena->block_size)) {
+            kept = block;
+        } else {
+            free(block);
+        }
+        block = next;
+    }
+    if (kept != NULL) {
+        kept->next = NULL;
+        kept->used = 0;
+    }
+    arena->blocks = kept;
+    arena->allocations = 0;
+    arena->allocated_bytes = 0;
+    arena->heap_allocations = 0;
+}
+
+struct ArenaBlock *new_arena_block(struct Arena *arena, size_t size) {
+    struct ArenaBlock *block = (struct ArenaBlock *)malloc(BLOCK_HEADER_SIZE + size);
+    assert(block != NULL);
+    block->size = size;
+    block->used = 0;
+    arena->heap_allocations++;
+    return block;
+}
+
+/// arena_alloc()
+///     Returns size bytes aligned for any type. Allocations larger than a quarter of
+///     block get a block of their own, so they do not waste the rest of current one.
+void *arena_alloc(struct Arena *arena, size_t size) {
+    arena->allocations++;
+    arena->allocated_bytes += size;
+
+    struct ArenaBlock *block = arena->blocks;
+    size_t offset = (block != NULL) ? ARENA_ALIGN(block->used) : 0;
+    if ((block == NULL) || (offset + size > block->size)) {
+        if (size > arena->block_size / 4) {
+            struct ArenaBlock *large_block = new_arena_block(arena, size);
+            large_block->used = size;
+            // current block still has room for small allocations
+            if (block != NULL) {
+                large_block->next = block->next;
+                block->next = large_block;
+            } else {
+                large_block->next = NULL;
+                arena->blocks = large_block;
+            }
+            return BLOCK_DATA(large_block);
+        }
+        block = new_arena_block(arena, arena->block_size);
+        block->next = arena->blocks;
+        arena->blocks = block;
+        offset = 0;
+    }
+    block->used = offset + size;
+    return BLOCK_DATA(block) + offset;
+}
+
+void *arena_realloc(struct Arena *arena, void *ptr, size_t old_size, size_t size) {
+    struct ArenaBlock *block = arena->blocks;
+    if ((ptr != NULL) && (block != NULL) && ((uint8_t *)ptr + old_size == BLOCK_DATA(block) + block->used) &&
+            ((uint8_t *)ptr - BLOCK_DATA(block) + size <= block->size)) {
+        block->used = (uint8_t *)ptr - BLOCK_DATA(block) + size;
+        arena->allocated_bytes += size - old_size;
+        return ptr;
+    }
+    void *new_ptr = arena_alloc(arena, size);
+    if (ptr != NULL) {
+        memcpy(new_ptr, ptr, (old_size < size) ? old_size : size);
+    }
+    return new_ptr;
+}
+
+char *arena_sprintf(struct Arena *arena, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int size = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    assert(size >= 0);
+
+    char *str = (char *)arena_alloc(arena, size + 1);
+    va_start(args, format);
+    vsnprintf(str, size + 1, format, args);
+    va_end(args);
+    return str;
+}
@@ -0,0 +1,38 @@
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Bump allocator for memory that lives as long as one request. Allocations are
+// never freed one by one, reset_arena frees all of them at once and keeps one block
+// for the next request, so a request usually does not touch the heap at all.
+
+#define ARENA_BLOCK_SIZE (16 * 1024)
+
+struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size;        // usable bytes after header
+    size_t used;
+};
+
+struct Arena {
+    struct ArenaBlock *blocks;  // block that is allocated from is the first one
+    size_t block_size;
+
+    // counters since last reset
+    uint64_t allocations;
+    uint64_t allocated_bytes;
+    uint64_t heap_allocations;  // blocks allocated from heap
+};
+
+void init_arena(struct Arena *arena, size_t block_size);
+void cleanup_arena(struct Arena *arena);
+void reset_arena(struct Arena *arena);
+
+void *arena_alloc(struct Arena *arena, size_t size);
+// ptr must be allocated from arena with old_size, last allocation grows in place
+void *arena_realloc(struct Arena *arena, void *ptr, size_t old_size, size_t size);
+char *arena_sprintf(struct Arena *arena, const char *format, ...);
+
+#endif
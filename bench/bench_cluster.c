@@ -0,0 +1,203 @@
+// Microbenchmark for free cluster allocator in cluster.c at full N_CLUSTERS scale,
+// run with: make bench && ./bench/bench_cluster [lookups]
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dbfat.h"
+#include "cluster.h"
+
+extern uint32_t LAST_FREE_ENTRY;
+
+#define MAX_FILE_CLUSTERS 64
+#define MIN_FULL_WORD_RUN 127
+#define MAX_FILES         (N_CLUSTERS / 16)
+
+struct DirEntry ROOT;
+
+struct DirEntry *FILES;
+uint32_t N_FILES;
+
+// Copy of FAT used by the original linear scan, 0 for free clusters
+uint32_t *FAT_ENTRIES;
+
+uint64_t time_nsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Same as the original find_free_cluster that scanned FAT_ENTRIES
+uint32_t linear_find_free_cluster() {
+    for (uint32_t i = LAST_FREE_ENTRY; i < N_CLUSTERS; i++) {
+        if (FAT_ENTRIES[i] == FAT_FREE_ENTRY) {
+            LAST_FREE_ENTRY = i;
+            return i;
+        }
+    }
+    for (uint32_t i = 2; i < LAST_FREE_ENTRY; i++) {
+        if (FAT_ENTRIES[i] == FAT_FREE_ENTRY) {
+            LAST_FREE_ENTRY = i;
+            return i;
+        }
+    }
+    assert(0);
+}
+
+uint32_t linear_longest_run() {
+    uint32_t longest = 0;
+    uint32_t run = 0;
+    for (uint32_t i = 2; i < N_CLUSTERS; i++) {
+        run = (FAT_ENTRIES[i] == FAT_FREE_ENTRY) ? (run + 1) : 0;
+        if (run > longest) {
+            longest = run;
+        }
+    }
+    return longest;
+}
+
+/// fill_volume()
+///     Allocates files of random size until used_percent of volume is allocated,
+///     returns number of allocated clusters
+uint64_t fill_volume(uint32_t used_percent, uint64_t used) {
+    uint64_t target = (uint64_t)N_CLUSTERS * used_percent / 100;
+    uint64_t allocated = 0;
+    while (used + allocated < target) {
+        uint32_t clusters = 1 + rand() % MAX_FILE_CLUSTERS;
+        assert(N_FILES < MAX_FILES);
+        memset(&FILES[N_FILES], 0, sizeof(struct DirEntry));
+        FILES[N_FILES].first_cluster = allocate_cluster_chain(&FILES[N_FILES], clusters * BYTES_PER_CLUSTER);
+        N_FILES++;
+        allocated += clusters;
+    }
+    return allocated;
+}
+
+/// churn_volume()
+///     Frees random half of the files, leaving volume fragmented
+void churn_volume() {
+    for (uint32_t i = 0; i < N_FILES; i++) {
+        if ((FILES[i].extent_count > 0) && (rand() % 2)) {
+            free_cluster_chain(FILES[i].first_cluster);
+        }
+    }
+}
+
+uint64_t count_used() {
+    uint64_t used = 0;
+    for (uint32_t i = 2; i < N_CLUSTERS; i++) {
+        used += is_cluster_free(i) ? 0 : 1;
+    }
+    return used;
+}
+
+void snapshot_fat() {
+    for (uint32_t i = 0; i < N_CLUSTERS; i++) {
+        FAT_ENTRIES[i] = is_cluster_free(i) ? FAT_FREE_ENTRY : FAT_EOFC_ENTRY;
+    }
+}
+
+void bench_find_free_cluster(int lookups) {
+    uint32_t *starts = (uint32_t *)malloc(lookups * sizeof(uint32_t));
+    uint32_t *expected = (uint32_t *)malloc(lookups * sizeof(uint32_t));
+    uint64_t start;
+
+    for (int i = 0; i < lookups; i++) {
+        starts[i] = 2 + rand() % (N_CLUSTERS - 2);
+    }
+
+    start = time_nsec();
+    for (int i = 0; i < lookups; i++) {
+        LAST_FREE_ENTRY = starts[i];
+        expected[i] = linear_find_free_cluster();
+    }
+    printf("  %-28s %10.1f ns/lookup\n", "linear find_free_cluster", (double)(time_nsec() - start) / lookups);
+
+    start = time_nsec();
+    for (int i = 0; i < lookups; i++) {
+        LAST_FREE_ENTRY = starts[i];
+        uint32_t cluster = find_free_cluster();
+        assert(cluster == expected[i]);
+    }
+    printf("  %-28s %10.1f ns/lookup\n", "find_free_cluster", (double)(time_nsec() - start) / lookups);
+
+    free(starts);
+    free(expected);
+}
+
+void bench_find_free_run(int lookups) {
+    uint32_t longest = linear_longest_run();
+    uint32_t run_lengths[] = { 1, 16, 256, 4096 };
+    printf("  longest free run: %u clusters\n", longest);
+
+    for (int r = 0; r < (int)(sizeof(run_lengths) / sizeof(run_lengths[0])); r++) {
+        uint32_t clusters = run_lengths[r];
+        uint64_t start = time_nsec();
+        for (int i = 0; i < lookups; i++) {
+            uint32_t run;
+            LAST_FREE_ENTRY = 2 + rand() % (N_CLUSTERS - 2);
+            uint32_t cluster = find_free_run(clusters, &run);
+            // with only small fragments left run may be shorter than longest one
+            assert((run > 0) && (run <= clusters) && (run <= longest));
+            assert((clusters >= MIN_FULL_WORD_RUN) && (longest >= MIN_FULL_WORD_RUN) ?
+                (run == ((clusters < longest) ? clusters : longest)) : 1);
+            for (uint32_t k = 0; k < run; k++) {
+                assert(is_cluster_free(cluster + k));
+            }
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "find_free_run(%u)", clusters);
+        printf("  %-28s %10.1f ns/lookup\n", name, (double)(time_nsec() - start) / lookups);
+    }
+}
+
+void bench_state(const char *name, int lookups) {
+    printf("%s, %.1f%% used\n", name, 100.0 * count_used() / N_CLUSTERS);
+    snapshot_fat();
+    bench_find_free_cluster(lookups);
+    bench_find_free_run(lookups);
+}
+
+int main(int argc, char **argv) {
+    int lookups = (argc > 1) ? atoi(argv[1]) : 1000;
+    uint64_t start;
+    uint64_t allocated;
+
+    srand(1);
+    set_geometry(IMAGE_FORMAT_FAT32, DEFAULT_VOLUME_SIZE_MB, DEFAULT_CLUSTER_SIZE_KB);
+    memset(&ROOT, 0, sizeof(ROOT));
+    initialize_clusters(&ROOT);
+    FILES = (struct DirEntry *)malloc(MAX_FILES * sizeof(struct DirEntry));
+    FAT_ENTRIES = (uint32_t *)malloc(N_CLUSTERS * sizeof(uint32_t));
+    N_FILES = 0;
+    printf("N_CLUSTERS: %u\n", (uint32_t)N_CLUSTERS);
+
+    start = time_nsec();
+    allocated = fill_volume(90, 1);
+    printf("fill to 90%%: %llu clusters, %.1f ns/cluster\n",
+        (unsigned long long)allocated, (double)(time_nsec() - start) / allocated);
+
+    churn_volume();
+    bench_state("fragmented", lookups);
+
+    start = time_nsec();
+    allocated = fill_volume(99, count_used());
+    printf("refill to 99%%: %llu clusters, %.1f ns/cluster\n",
+        (unsigned long long)allocated, (double)(time_nsec() - start) / allocated);
+    bench_state("nearly full", lookups);
+
+    for (uint32_t i = 0; i < N_FILES; i++) {
+        if (FILES[i].extent_count > 0) {
+            free_cluster_chain(FILES[i].first_cluster);
+        }
+    }
+    free(FILES);
+    free(FAT_ENTRIES);
+    free(ROOT.extents);
+    cleanup_clusters();
+    return 0;
+}
@@ -0,0 +1,168 @@
+// Benchmark for parsing delta pages, compares streaming parser of delta.c with the
+// whole-page cJSON tree it replaced, run with: make bench && ./bench/bench_delta [entries]
+
+#include <assert.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cJSON.h"
+#include "dbfat.h"
+#include "delta.h"
+#include "geometry.h"
+#include "utf.h"
+
+#define CHUNK_SIZE (16 * 1024)      // typical size of curl write callback data
+
+struct ParsedEntries {
+    uint32_t count;
+    uint64_t checksum;
+};
+
+uint64_t time_nsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+size_t allocated_bytes() {
+    struct mallinfo2 info = mallinfo2();
+    return (size_t)info.uordblks + (size_t)info.hblkhd;
+}
+
+uint64_t hash_bytes(uint64_t h, const void *data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        h = (h ^ ((const uint8_t *)data)[i]) * 0x100000001B3ULL;
+    }
+    return h;
+}
+
+uint64_t hash_change(uint64_t h, struct FileEntryChange *change) {
+    h = hash_bytes(h, change->path, change->path_chars * sizeof(utf16_t));
+    h = hash_bytes(h, &change->is_removed, 1);
+    if (!change->is_removed) {
+        h = hash_bytes(h, &change->metadata.size, sizeof(change->metadata.size));
+        h = hash_bytes(h, &change->metadata.mtime, sizeof(change->metadata.mtime));
+        h = hash_bytes(h, &change->metadata.is_dir, 1);
+        h = hash_bytes(h, change->metadata.rev, strlen(change->metadata.rev));
+    }
+    return h;
+}
+
+/// generate_page()
+///     Returns delta page with entries in the format of Dropbox API, every tenth one
+///     is removed and some paths have non ASCII chars escaped as the server does
+char *generate_page(uint32_t entries, size_t *page_size) {
+    char *page;
+    FILE *f = open_memstream(&page, page_size);
+    fprintf(f, "{\"has_more\": true, \"cursor\": \"AAFDSSJ3CQ0ZpgHcP7kAZKNT1yxt\", \"entries\": [");
+    for (uint32_t i = 0; i < entries; i++) {
+        fprintf(f, "%s[\"/photos/%u/r\\u00e9sum\\u00e9 %u/img_%06u.jpg\", ", (i == 0) ? "" : ", ", i / 20000, i / 200, i);
+        if (i % 10 == 9) {
+            fprintf(f, "null]");
+            continue;
+        }
+        uint32_t size = (i * 2654435761U) % 5000000;
+        fprintf(f, "{\"size\": \"%.1f MB\", \"rev\": \"%x0b2c6f0e\", \"thumb_exists\": true, \"bytes\": %u, "
+            "\"modified\": %u, \"path\": \"/Photos/%u/R\\u00e9sum\\u00e9 %u/IMG_%06u.jpg\", \"is_dir\": false, "
+            "\"icon\": \"page_white_picture\", \"root\": \"app_folder\", \"mime_type\": \"image/jpeg\", \"revision\": %u}]",
+            size / 1e6, i % 256, size, 1300000000 + i, i / 20000, i / 200, i, i);
+    }
+    fprintf(f, "], \"reset\": false}");
+    fclose(f);
+    return page;
+}
+
+// same as the original dbapi_update loop
+void parse_with_cjson(char *page, struct ParsedEntries *parsed) {
+    cJSON *result = cJSON_Parse(page);
+    assert(result != NULL);
+    cJSON *entries = cJSON_GetObjectItem(result, "entries");
+    int nentries = cJSON_GetArraySize(entries);
+    for (int i = 0; i < nentries; i++) {
+        cJSON *entry = cJSON_GetArrayItem(entries, i);
+        char *path = cJSON_GetArrayItem(entry, 0)->valuestring;
+        cJSON *metadata = cJSON_GetArrayItem(entry, 1);
+
+        struct FileEntryChange change;
+        memset(&change, 0, sizeof(change));
+        size_t path_chars;
+        utf8_to_utf16(strlen(path), path, &path_chars, &change.path);
+        change.path_chars = path_chars;
+        if (metadata->type == cJSON_Object) {
+            change.metadata.is_dir = (uint8_t)cJSON_GetObjectItem(metadata, "is_dir")->valueint;
+            change.metadata.mtime = (uint32_t)cJSON_GetObjectItem(metadata, "modified")->valuedouble;
+            strcpy(change.metadata.rev, cJSON_GetObjectItem(metadata, "rev")->valuestring);
+            change.metadata.size = (uint64_t)cJSON_GetObjectItem(metadata, "bytes")->valuedouble;
+        } else {
+            change.is_removed = 1;
+        }
+        parsed->checksum = hash_change(parsed->checksum, &change);
+        parsed->count++;
+        free(change.path);
+    }
+    cJSON_Delete(result);
+}
+
+void count_entries(struct FileEntryChange *changes, uint32_t change_count, void *callback_data) {
+    struct ParsedEntries *parsed = (struct ParsedEntries *)callback_data;
+    for (uint32_t i = 0; i < change_count; i++) {
+        parsed->checksum = hash_change(parsed->checksum, &changes[i]);
+    }
+    parsed->count += change_count;
+}
+
+void parse_with_stream(char *page, size_t page_size, struct ParsedEntries *parsed, size_t *parser_bytes) {
+    size_t start_bytes = allocated_bytes();
+    struct DeltaParser *parser = (struct DeltaParser *)malloc(sizeof(struct DeltaParser));
+    init_delta_parser(parser, count_entries, parsed);
+    for (size_t offset = 0; offset < page_size; offset += CHUNK_SIZE) {
+        size_t size = (page_size - offset < CHUNK_SIZE) ? (page_size - offset) : CHUNK_SIZE;
+        int r = feed_delta_parser(parser, &page[offset], size);
+        assert(r == 0);
+    }
+    int r = finish_delta_parser(parser);
+    assert(r == 0);
+    assert(parser->has_more == 1);
+    assert(parser->reset == 0);
+    *parser_bytes = allocated_bytes() - start_bytes;
+    cleanup_delta_parser(parser);
+    free(parser);
+}
+
+int main(int argc, char **argv) {
+    uint32_t entries = (argc > 1) ? (uint32_t)atoi(argv[1]) : 20000;
+    initialize_geometry();
+
+    size_t page_size;
+    char *page = generate_page(entries, &page_size);
+    printf("page: %u entries, %.1f MB\n", entries, page_size / 1e6);
+
+    size_t start_bytes = allocated_bytes();
+    cJSON *tree = cJSON_Parse(page);
+    size_t tree_bytes = allocated_bytes() - start_bytes;
+    cJSON_Delete(tree);
+
+    struct ParsedEntries cjson = { 0, 0xCBF29CE484222325ULL };
+    uint64_t start = time_nsec();
+    parse_with_cjson(page, &cjson);
+    uint64_t cjson_nsec = time_nsec() - start;
+
+    struct ParsedEntries stream = { 0, 0xCBF29CE484222325ULL };
+    size_t parser_bytes;
+    start = time_nsec();
+    parse_with_stream(page, page_size, &stream, &parser_bytes);
+    uint64_t stream_nsec = time_nsec() - start;
+
+    assert(stream.count == cjson.count);
+    assert(stream.checksum == cjson.checksum);
+    printf("%-8s %10.1f ms %8.1f MB/s %10.1f MB\n", "cJSON", cjson_nsec / 1e6,
+        page_size * 1e3 / cjson_nsec, tree_bytes / 1e6);
+    printf("%-8s %10.1f ms %8.1f MB/s %10.1f MB\n", "stream", stream_nsec / 1e6,
+        page_size * 1e3 / stream_nsec, parser_bytes / 1e6);
+    free(page);
+    return 0;
+}
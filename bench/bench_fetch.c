@@ -0,0 +1,327 @@
+// Benchmark for block downloads of file cache. Files are served by mock HTTP server
+// that waits before every response and limits bytes per second sent on a connection,
+// like a distant server does. Parallel runs read blocks of many files with a few more
+// readers than transfers, so transfers always have queued blocks to download.
+// Sequential runs read one file with readahead and compare number of blocks that are
+// downloaded with one request, run with: make bench && ./bench/bench_fetch [seconds]
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dbapi.h"
+#include "dbfat.h"
+#include "dbfiles.h"
+
+#define BLOCK_SIZE          (1 << 21)           // CACHE_BLOCK_SIZE of dbfiles.c
+#define SEND_CHUNK_SIZE     (64 * 1024)
+#define EXTRA_READERS       8                   // readers waiting in queue besides transfers
+#define SEQUENTIAL_READ_SIZE (128 * 1024)       // size of reads by FUSE
+#define SEQUENTIAL_CACHE_MB 128                 // enough blocks for the largest readahead window
+
+struct BenchRun {
+    int sequential;
+    int transfer_count;
+    int coalesce_blocks;
+    int latency_msec;       // before server starts response
+    int connection_rate;    // bytes per second
+    uint64_t file_size;
+};
+
+const struct BenchRun BENCH_RUNS[] = {
+    { 0, 1,  4, 100, 2 << 20, 2 * BLOCK_SIZE },
+    { 0, 4,  4, 100, 2 << 20, 2 * BLOCK_SIZE },
+    { 0, 8,  4, 100, 2 << 20, 2 * BLOCK_SIZE },
+    { 0, 16, 4, 100, 2 << 20, 2 * BLOCK_SIZE },
+    { 0, 32, 4, 100, 2 << 20, 2 * BLOCK_SIZE },
+    { 0, 64, 4, 100, 2 << 20, 2 * BLOCK_SIZE },
+    { 1, 8,  1, 300, 16 << 20, 1ULL << 32 },
+    { 1, 8,  2, 300, 16 << 20, 1ULL << 32 },
+    { 1, 8,  4, 300, 16 << 20, 1ULL << 32 },
+    { 1, 8,  8, 300, 16 << 20, 1ULL << 32 },
+};
+
+extern char *CONSUMER_KEY;
+extern char *CONSUMER_SECRET;
+extern char *URL_FILES;
+
+const struct BenchRun *bench_run;
+volatile uint32_t next_file = 0;
+volatile uint64_t read_bytes = 0;
+volatile uint32_t failed_reads = 0;
+uint64_t stop_nsec;
+
+uint64_t time_nsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint8_t file_byte(uint32_t file_number, uint64_t offset) {
+    return (uint8_t)(offset + (offset >> 12) + file_number);
+}
+
+void sleep_until(uint64_t nsec) {
+    uint64_t now = time_nsec();
+    if (nsec > now) {
+        struct timespec ts = { (time_t)((nsec - now) / 1000000000ULL), (long)((nsec - now) % 1000000000ULL) };
+        nanosleep(&ts, NULL);
+    }
+}
+
+int send_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return -1;
+        }
+        data += sent;
+        size -= sent;
+    }
+    return 0;
+}
+
+/// serve_connection()
+///     Answers range requests of keep-alive connection until client closes it, file
+///     number is taken from path that ends with file_<number>
+void *serve_connection(void *args) {
+    int fd = (int)(intptr_t)args;
+    char request[16384];
+    size_t request_size = 0;
+    char *body = (char *)malloc(SEND_CHUNK_SIZE);
+    assert(body != NULL);
+
+    while (1) {
+        char *headers_end;
+        while ((headers_end = memmem(request, request_size, "\r\n\r\n", 4)) == NULL) {
+            ssize_t n = recv(fd, &request[request_size], sizeof(request) - 1 - request_size, 0);
+            if (n <= 0) {
+                goto done;
+            }
+            request_size += n;
+        }
+        *headers_end = 0;
+
+        uint64_t file_size = bench_run->file_size;
+        uint32_t file_number = 0;
+        unsigned long long range_start = 0;
+        unsigned long long range_end = file_size - 1;
+        char *file = strstr(request, "/file_");
+        char *range = strcasestr(request, "\r\nRange: bytes=");
+        if (file != NULL) {
+            sscanf(file, "/file_%u", &file_number);
+        }
+        if (range != NULL) {
+            sscanf(range, "\r\nRange: bytes=%llu-%llu", &range_start, &range_end);
+        }
+        if (range_end >= file_size) {
+            range_end = file_size - 1;
+        }
+
+        sleep_until(time_nsec() + bench_run->latency_msec * 1000000ULL);
+        char header[256];
+        int header_size = snprintf(header, sizeof(header),
+            "HTTP/1.1 206 Partial Content\r\nContent-Length: %llu\r\nContent-Range: bytes %llu-%llu/%llu\r\n\r\n",
+            range_end + 1 - range_start, range_start, range_end, (unsigned long long)file_size);
+        if (send_all(fd, header, header_size) < 0) {
+            goto done;
+        }
+
+        uint64_t start_nsec = time_nsec();
+        uint64_t sent = 0;
+        for (uint64_t offset = range_start; offset <= range_end; offset += SEND_CHUNK_SIZE) {
+            size_t size = (range_end + 1 - offset < SEND_CHUNK_SIZE) ? (range_end + 1 - offset) : SEND_CHUNK_SIZE;
+            for (size_t i = 0; i < size; i++) {
+                body[i] = file_byte(file_number, offset + i);
+            }
+            if (send_all(fd, body, size) < 0) {
+                goto done;
+            }
+            sent += size;
+            sleep_until(start_nsec + sent * 1000000000ULL / bench_run->connection_rate);
+        }
+
+        size_t request_end = headers_end + 4 - request;
+        memmove(request, &request[request_end], request_size - request_end);
+        request_size -= request_end;
+    }
+
+done:
+    free(body);
+    close(fd);
+    return NULL;
+}
+
+void *accept_connections(void *args) {
+    int listen_fd = (int)(intptr_t)args;
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        pthread_t thread;
+        pthread_create(&thread, NULL, serve_connection, (void *)(intptr_t)fd);
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+int start_server() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(fd >= 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    int ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    assert(ret == 0);
+    ret = listen(fd, 256);
+    assert(ret == 0);
+    socklen_t addr_size = sizeof(addr);
+    getsockname(fd, (struct sockaddr *)&addr, &addr_size);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, accept_connections, (void *)(intptr_t)fd);
+    pthread_detach(thread);
+    return ntohs(addr.sin_port);
+}
+
+/// read_files()
+///     Reads end of the second block of a new file until time is up, so every read
+///     waits for a whole download. Reads that do not start at beginning of file are
+///     not followed by readahead.
+void *read_files(void *args) {
+    uint8_t buf[4096];
+    char rev[DB_REV_SIZE] = "1a2b3c4d";
+    while (time_nsec() < stop_nsec) {
+        uint32_t file_number = __sync_fetch_and_add(&next_file, 1);
+        char path[64];
+        snprintf(path, sizeof(path), "/bench/file_%u", file_number);
+        uint64_t offset = 2 * BLOCK_SIZE - sizeof(buf);
+        if (read_file_from_cache(file_number, strlen(path) + 1, path, rev,
+                offset, sizeof(buf), bench_run->file_size, buf) != 0) {
+            __sync_fetch_and_add(&failed_reads, 1);
+            continue;
+        }
+        for (size_t i = 0; i < sizeof(buf); i++) {
+            assert(buf[i] == file_byte(file_number, offset + i));
+        }
+        __sync_fetch_and_add(&read_bytes, BLOCK_SIZE);
+    }
+    return NULL;
+}
+
+/// read_sequentially()
+///     Reads one file from beginning until time is up, the way FUSE reads image
+void *read_sequentially(void *args) {
+    uint8_t *buf = (uint8_t *)malloc(SEQUENTIAL_READ_SIZE);
+    assert(buf != NULL);
+    char rev[DB_REV_SIZE] = "1a2b3c4d";
+    char *path = "/bench/file_0";
+    uint64_t offset = 0;
+    while ((time_nsec() < stop_nsec) && (offset < bench_run->file_size)) {
+        if (read_file_from_cache(0, strlen(path) + 1, path, rev,
+                offset, SEQUENTIAL_READ_SIZE, bench_run->file_size, buf) != 0) {
+            __sync_fetch_and_add(&failed_reads, 1);
+            continue;
+        }
+        for (size_t i = 0; i < SEQUENTIAL_READ_SIZE; i++) {
+            assert(buf[i] == file_byte(0, offset + i));
+        }
+        offset += SEQUENTIAL_READ_SIZE;
+        read_bytes += SEQUENTIAL_READ_SIZE;
+    }
+    free(buf);
+    return NULL;
+}
+
+/// run_bench()
+///     Runs in child process since file cache can only be initialized once, writes
+///     line of results to result_fd
+void run_bench(const struct BenchRun *run, int seconds, int result_fd) {
+    bench_run = run;
+    int reader_count = run->sequential ? 1 : run->transfer_count + EXTRA_READERS;
+    // readers move on once data is received, before transfer releases the block
+    int cache_size_mb = run->sequential ? SEQUENTIAL_CACHE_MB : 2 * reader_count * (BLOCK_SIZE >> 20);
+    char value[16];
+    snprintf(value, sizeof(value), "%d", run->transfer_count);
+    setenv("DBBOX_FETCH_TRANSFERS", value, 1);
+    snprintf(value, sizeof(value), "%d", run->coalesce_blocks);
+    setenv("DBBOX_FETCH_COALESCE_BLOCKS", value, 1);
+    snprintf(value, sizeof(value), "%d", cache_size_mb);
+    setenv("DBBOX_CACHE_SIZE_MB", value, 1);
+    unsetenv("DBBOX_DISK_CACHE_DIR");
+
+    int port = start_server();
+    char url[64];
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/files", port);
+    URL_FILES = url;
+    CONSUMER_KEY = "bench";
+    CONSUMER_SECRET = "bench";
+
+    // debug log of every request would take more time than requests
+    freopen("/dev/null", "w", stdout);
+    initialize_file_cache();
+
+    uint64_t start = time_nsec();
+    stop_nsec = start + seconds * 1000000000ULL;
+    pthread_t *readers = (pthread_t *)malloc(reader_count * sizeof(pthread_t));
+    assert(readers != NULL);
+    for (int i = 0; i < reader_count; i++) {
+        pthread_create(&readers[i], NULL, run->sequential ? read_sequentially : read_files, NULL);
+    }
+    for (int i = 0; i < reader_count; i++) {
+        pthread_join(readers[i], NULL);
+    }
+    uint64_t elapsed = time_nsec() - start;
+
+    struct RequestStats request_stats;
+    get_request_stats(REQUEST_FILE, &request_stats);
+    char result[128];
+    int size = snprintf(result, sizeof(result), "%-11s %10d %10d %10llu %10u %10.1f MB/s\n",
+        run->sequential ? "sequential" : "parallel", run->transfer_count, run->coalesce_blocks,
+        (unsigned long long)request_stats.requests, failed_reads, read_bytes * 1e3 / elapsed);
+    write(result_fd, result, size);
+}
+
+int main(int argc, char **argv) {
+    int seconds = (argc > 1) ? atoi(argv[1]) : 5;
+    printf("%-11s %10s %10s %10s %10s %15s\n", "reads", "transfers", "coalesce", "requests", "failed", "throughput");
+    fflush(stdout);
+
+    for (size_t i = 0; i < sizeof(BENCH_RUNS) / sizeof(BENCH_RUNS[0]); i++) {
+        int result_pipe[2];
+        int ret = pipe(result_pipe);
+        assert(ret == 0);
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(result_pipe[0]);
+            run_bench(&BENCH_RUNS[i], seconds, result_pipe[1]);
+            _exit(0);
+        }
+        close(result_pipe[1]);
+        char result[128];
+        ssize_t size = read(result_pipe[0], result, sizeof(result) - 1);
+        close(result_pipe[0]);
+        waitpid(pid, NULL, 0);
+        if (size > 0) {
+            result[size] = 0;
+            printf("%s", result);
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,171 @@
+// Benchmark for volume geometry choices, for each cluster size and volume size shows
+// FAT size, memory used by dbfat and cluster map, slack and read throughput for
+// synthetic accounts, run with: make bench && ./bench/bench_geometry [read_mb]
+
+#include <assert.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dbfat.h"
+#include "utf.h"
+
+#define READ_SIZE     (128 * 1024)   // FUSE max_read
+#define FILES_PER_DIR 100
+#define MIN_FIT_VOLUME_MB 1024
+#define DELTA_PAGE_ENTRIES 2000     // entries in a full page of delta
+
+struct Account {
+    const char *name;
+    uint32_t files;
+    uint32_t min_file_size;
+    uint32_t max_file_size;
+};
+
+// small files of a documents account and large ones of a media library
+struct Account ACCOUNTS[] = {
+    { "documents", 100000, 1, 64 * 1024 },
+    { "media",     2000,   1024 * 1024, 32 * 1024 * 1024 },
+};
+#define N_ACCOUNTS (sizeof(ACCOUNTS) / sizeof(ACCOUNTS[0]))
+
+uint32_t CLUSTER_SIZES_KB[] = { 4, 16, 32, 64 };
+#define N_CLUSTER_SIZES (sizeof(CLUSTER_SIZES_KB) / sizeof(CLUSTER_SIZES_KB[0]))
+
+// file data is not interesting here, only the cost of mapping image to files
+int read_file_from_cache(uint32_t file_id, size_t path_size, char *utf8path, char *rev,
+        uint64_t offset, uint32_t size, uint64_t file_size, uint8_t *buf) {
+    memset(buf, (uint8_t)file_id, size);
+    return 0;
+}
+
+uint64_t time_nsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// same size for file i on every run, so all geometries get identical accounts
+uint32_t get_file_size(struct Account *account, uint32_t i) {
+    uint64_t x = (i + 1) * 0x9E3779B97F4A7C15ULL;
+    x ^= x >> 29;
+    return account->min_file_size + (uint32_t)(x % (account->max_file_size - account->min_file_size + 1));
+}
+
+/// get_account_size()
+///     Returns size of account files when stored in clusters of cluster_size bytes,
+///     cluster_size of 1 gives size of file data alone
+uint64_t get_account_size(struct Account *account, uint32_t cluster_size) {
+    uint64_t size = 0;
+    for (uint32_t i = 0; i < account->files; i++) {
+        uint64_t clusters = ((uint64_t)get_file_size(account, i) + cluster_size - 1) / cluster_size;
+        size += ((clusters == 0) ? 1 : clusters) * cluster_size;
+    }
+    return size;
+}
+
+/// add_account()
+///     Adds files of account in pages of DELTA_PAGE_ENTRIES the way delta pages are applied
+void add_account(struct Account *account) {
+    struct FileEntryChange *changes = (struct FileEntryChange *)malloc(DELTA_PAGE_ENTRIES * sizeof(struct FileEntryChange));
+    uint32_t change_count = 0;
+    for (uint32_t i = 0; i < account->files; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/%s/%u/file %u.dat", account->name, i / FILES_PER_DIR, i);
+
+        struct FileEntryChange *change = &changes[change_count++];
+        memset(change, 0, sizeof(struct FileEntryChange));
+        change->metadata.size = get_file_size(account, i);
+        strcpy(change->metadata.rev, "1");
+
+        size_t path_chars;
+        utf8_to_utf16(strlen(path), path, &path_chars, &change->path);
+        change->path_chars = path_chars;
+
+        if ((change_count == DELTA_PAGE_ENTRIES) || (i + 1 == account->files)) {
+            begin_file_entries();
+            stage_file_entries(changes, change_count);
+            commit_file_entries("", 0, i + 1 < account->files);
+            for (uint32_t j = 0; j < change_count; j++) {
+                free(changes[j].path);
+            }
+            change_count = 0;
+        }
+    }
+    free(changes);
+}
+
+/// read_image()
+///     Reads size bytes of image from offset in READ_SIZE requests, returns MB/s
+double read_image(uint64_t offset, uint64_t size) {
+    uint8_t *buf = (uint8_t *)malloc(READ_SIZE);
+    uint64_t start = time_nsec();
+    for (uint64_t done = 0; done < size; done += READ_SIZE) {
+        uint32_t read_size = (size - done < READ_SIZE) ? (uint32_t)(size - done) : READ_SIZE;
+        int r = read_data(offset + done, read_size, buf);
+        assert(r == 0);
+    }
+    double seconds = (double)(time_nsec() - start) / 1e9;
+    free(buf);
+    return (double)size / (1024 * 1024) / seconds;
+}
+
+void bench_geometry(struct Account *account, uint64_t volume_size_mb, uint32_t cluster_size_kb, uint64_t read_size) {
+    char value[32];
+    snprintf(value, sizeof(value), "%llu", (unsigned long long)volume_size_mb);
+    setenv("DBBOX_VOLUME_SIZE_MB", value, 1);
+    snprintf(value, sizeof(value), "%u", cluster_size_kb);
+    setenv("DBBOX_CLUSTER_SIZE_KB", value, 1);
+
+    size_t heap_start = mallinfo2().uordblks;
+    initialize_dbfat();
+    if ((BYTES_PER_CLUSTER != cluster_size_kb * 1024) ||
+            ((uint64_t)BPB_TotalSectors != volume_size_mb * (1024 * 1024 / BPB_BytesPerSector))) {
+        printf("  %7llu MB %2u KB: not a valid FAT32 volume\n", (unsigned long long)volume_size_mb, cluster_size_kb);
+        cleanup_dbfat();
+        return;
+    }
+
+    uint64_t start = time_nsec();
+    add_account(account);
+    double add_usec = (double)(time_nsec() - start) / 1000 / account->files;
+    size_t heap = mallinfo2().uordblks - heap_start;
+
+    const uint64_t fat_start = (uint64_t)BPB_ReservedSectorCount * BPB_BytesPerSector;
+    const uint64_t fat_size = (uint64_t)BPB_FATSz32 * BPB_BytesPerSector;
+    const uint64_t data_start = fat_start + BPB_NumFATs * fat_size;
+    double fat_mbps = read_image(fat_start, fat_size);
+    uint64_t account_size = get_account_size(account, 1);
+    uint64_t allocated = get_account_size(account, BYTES_PER_CLUSTER);
+    double data_mbps = read_image(data_start, (read_size < allocated) ? read_size : allocated);
+
+    printf("  %7llu MB %2u KB: clusters %9u FAT %7.1f MB heap %7.1f MB slack %5.1f%% add %5.2f us/file"
+            " FAT read %7.1f MB/s data read %7.1f MB/s\n",
+            (unsigned long long)volume_size_mb, cluster_size_kb, N_CLUSTERS, (double)fat_size / (1024 * 1024),
+            (double)heap / (1024 * 1024), 100.0 * (allocated - account_size) / allocated, add_usec,
+            fat_mbps, data_mbps);
+    cleanup_dbfat();
+}
+
+int main(int argc, char **argv) {
+    uint64_t read_size = (uint64_t)((argc > 1) ? atoi(argv[1]) : 1024) * 1024 * 1024;
+
+    for (uint32_t a = 0; a < N_ACCOUNTS; a++) {
+        struct Account *account = &ACCOUNTS[a];
+        printf("%s: %u files, %.1f MB\n", account->name, account->files,
+                (double)get_account_size(account, 1) / (1024 * 1024));
+        for (uint32_t c = 0; c < N_CLUSTER_SIZES; c++) {
+            // volume shrunk to fit account with a quarter of it free
+            uint64_t fit_volume_mb = get_account_size(account, CLUSTER_SIZES_KB[c] * 1024) / (1024 * 1024) * 5 / 4;
+            if (fit_volume_mb < MIN_FIT_VOLUME_MB) {
+                fit_volume_mb = MIN_FIT_VOLUME_MB;
+            }
+            bench_geometry(account, DEFAULT_VOLUME_SIZE_MB, CLUSTER_SIZES_KB[c], read_size);
+            bench_geometry(account, fit_volume_mb, CLUSTER_SIZES_KB[c], read_size);
+        }
+    }
+    return 0;
+}
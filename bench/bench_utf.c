@@ -0,0 +1,220 @@
+// Microbenchmark for utf.c against iconv, run with: make bench && ./bench/bench_utf [iterations]
+
+#include <assert.h>
+#include <iconv.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "utf.h"
+
+#define N_PATHS 1024
+#define MAX_PATH_SIZE 512
+
+// path components, mix of plain ASCII names and typical non ASCII ones
+const char *COMPONENTS[] = {
+    "Photos", "Documents", "Camera Uploads", "2013-05-04 12.31.07.jpg", "README.txt",
+    "project", "src", "Makefile", "backup.tar.gz", "Public",
+    "R\xc3\xa9sum\xc3\xa9.pdf", "\xc3\x9c" "bersicht", "\xd0\x94\xd0\xbe\xd0\xba\xd1\x83\xd0\xbc\xd0\xb5\xd0\xbd\xd1\x82\xd1\x8b",
+    "\xe5\x86\x99\xe7\x9c\x9f", "\xf0\x9f\x93\xb7 photos",
+};
+#define N_COMPONENTS (sizeof(COMPONENTS) / sizeof(COMPONENTS[0]))
+#define N_ASCII_COMPONENTS 10
+
+struct PathSet {
+    const char *name;
+    size_t n_components;
+    char *paths[N_PATHS];
+    size_t sizes[N_PATHS];
+};
+
+uint64_t time_nsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void generate_paths(struct PathSet *set) {
+    for (int i = 0; i < N_PATHS; i++) {
+        char path[MAX_PATH_SIZE] = "";
+        int depth = 1 + rand() % 6;
+        for (int d = 0; d < depth; d++) {
+            strcat(path, "/");
+            strcat(path, COMPONENTS[rand() % set->n_components]);
+        }
+        set->paths[i] = strdup(path);
+        set->sizes[i] = strlen(path);
+    }
+}
+
+// Same as the original iconv based implementation from dbfat.c
+void iconv_utf8_to_utf16(size_t utf8size, char *utf8string, size_t *utf16chars, utf16_t **utf16string) {
+    const size_t BUF_SIZE = 64 * 1024;
+    char OUTBUF[BUF_SIZE];
+    char *outbuf = OUTBUF;
+    size_t inbytesleft = utf8size;
+    size_t outbytesleft = BUF_SIZE;
+
+    iconv_t cd = iconv_open("UTF-16LE", "UTF-8");
+    assert(cd != (iconv_t) -1);
+    size_t r = iconv(cd, &utf8string, &inbytesleft, &outbuf, &outbytesleft);
+    assert(r != (size_t) -1);
+    assert(inbytesleft == 0);
+
+    *utf16chars = (BUF_SIZE - outbytesleft) / sizeof(utf16_t);
+    *utf16string = (utf16_t *)malloc((*utf16chars) * sizeof(utf16_t));
+    memcpy(*utf16string, OUTBUF, (*utf16chars) * sizeof(utf16_t));
+    iconv_close(cd);
+}
+
+void iconv_utf16_to_utf8(size_t utf16chars, utf16_t *utf16string, size_t *utf8size, char **utf8string) {
+    const size_t BUF_SIZE = 64 * 1024;
+    char OUTBUF[BUF_SIZE];
+    char *outbuf = OUTBUF;
+    size_t inbytesleft = utf16chars * sizeof(utf16_t);
+    size_t outbytesleft = BUF_SIZE;
+
+    iconv_t cd = iconv_open("UTF-8", "UTF-16LE");
+    assert(cd != (iconv_t) -1);
+    size_t r = iconv(cd, (char **)&utf16string, &inbytesleft, &outbuf, &outbytesleft);
+    assert(r != (size_t) -1);
+    assert(inbytesleft == 0);
+
+    *utf8size = (BUF_SIZE - outbytesleft) + 1;
+    *utf8string = (char *)malloc(*utf8size);
+    memcpy(*utf8string, OUTBUF, *utf8size);
+    (*utf8string)[*utf8size - 1] = 0;
+    iconv_close(cd);
+}
+
+void verify_paths(struct PathSet *set) {
+    for (int i = 0; i < N_PATHS; i++) {
+        size_t chars, expected_chars, size, expected_size;
+        utf16_t *utf16, *expected_utf16;
+        char *utf8, *expected_utf8;
+
+        utf8_to_utf16(set->sizes[i], set->paths[i], &chars, &utf16);
+        iconv_utf8_to_utf16(set->sizes[i], set->paths[i], &expected_chars, &expected_utf16);
+        assert(chars == expected_chars);
+        assert(memcmp(utf16, expected_utf16, chars * sizeof(utf16_t)) == 0);
+
+        utf16_to_utf8(chars, utf16, &size, &utf8);
+        iconv_utf16_to_utf8(chars, utf16, &expected_size, &expected_utf8);
+        assert(size == expected_size);
+        assert(memcmp(utf8, expected_utf8, size) == 0);
+        assert(strcmp(utf8, set->paths[i]) == 0);
+
+        free(utf16);
+        free(expected_utf16);
+        free(utf8);
+        free(expected_utf8);
+    }
+}
+
+void report(const char *set_name, const char *name, uint64_t nsec, int iterations) {
+    printf("%-10s %-24s %8.1f ns/path\n", set_name, name, (double)nsec / ((uint64_t)iterations * N_PATHS));
+}
+
+void bench_paths(struct PathSet *set, int iterations) {
+    utf16_t *utf16[N_PATHS];
+    size_t chars[N_PATHS];
+    utf16_t utf16buf[MAX_PATH_SIZE];
+    char utf8buf[3 * MAX_PATH_SIZE];
+    volatile size_t sink = 0;
+    uint64_t start;
+
+    for (int i = 0; i < N_PATHS; i++) {
+        utf8_to_utf16(set->sizes[i], set->paths[i], &chars[i], &utf16[i]);
+    }
+
+    start = time_nsec();
+    for (int it = 0; it < iterations; it++) {
+        for (int i = 0; i < N_PATHS; i++) {
+            size_t n;
+            utf16_t *s;
+            iconv_utf8_to_utf16(set->sizes[i], set->paths[i], &n, &s);
+            sink += n;
+            free(s);
+        }
+    }
+    report(set->name, "iconv utf8->utf16", time_nsec() - start, iterations);
+
+    start = time_nsec();
+    for (int it = 0; it < iterations; it++) {
+        for (int i = 0; i < N_PATHS; i++) {
+            size_t n;
+            utf16_t *s;
+            utf8_to_utf16(set->sizes[i], set->paths[i], &n, &s);
+            sink += n;
+            free(s);
+        }
+    }
+    report(set->name, "utf8_to_utf16", time_nsec() - start, iterations);
+
+    start = time_nsec();
+    for (int it = 0; it < iterations; it++) {
+        for (int i = 0; i < N_PATHS; i++) {
+            sink += utf8_to_utf16_buf(set->sizes[i], set->paths[i], utf16buf);
+        }
+    }
+    report(set->name, "utf8_to_utf16_buf", time_nsec() - start, iterations);
+
+    start = time_nsec();
+    for (int it = 0; it < iterations; it++) {
+        for (int i = 0; i < N_PATHS; i++) {
+            size_t n;
+            char *s;
+            iconv_utf16_to_utf8(chars[i], utf16[i], &n, &s);
+            sink += n;
+            free(s);
+        }
+    }
+    report(set->name, "iconv utf16->utf8", time_nsec() - start, iterations);
+
+    start = time_nsec();
+    for (int it = 0; it < iterations; it++) {
+        for (int i = 0; i < N_PATHS; i++) {
+            size_t n;
+            char *s;
+            utf16_to_utf8(chars[i], utf16[i], &n, &s);
+            sink += n;
+            free(s);
+        }
+    }
+    report(set->name, "utf16_to_utf8", time_nsec() - start, iterations);
+
+    start = time_nsec();
+    for (int it = 0; it < iterations; it++) {
+        for (int i = 0; i < N_PATHS; i++) {
+            sink += utf16_to_utf8_buf(chars[i], utf16[i], utf8buf);
+        }
+    }
+    report(set->name, "utf16_to_utf8_buf", time_nsec() - start, iterations);
+
+    for (int i = 0; i < N_PATHS; i++) {
+        free(utf16[i]);
+    }
+}
+
+int main(int argc, char **argv) {
+    int iterations = (argc > 1) ? atoi(argv[1]) : 100;
+    struct PathSet ascii_set = { .name = "ascii", .n_components = N_ASCII_COMPONENTS };
+    struct PathSet mixed_set = { .name = "mixed", .n_components = N_COMPONENTS };
+
+    srand(1);
+    generate_paths(&ascii_set);
+    generate_paths(&mixed_set);
+    verify_paths(&ascii_set);
+    verify_paths(&mixed_set);
+
+    bench_paths(&ascii_set, iterations);
+    bench_paths(&mixed_set, iterations);
+
+    for (int i = 0; i < N_PATHS; i++) {
+        free(ascii_set.paths[i]);
+        free(mixed_set.paths[i]);
+    }
+    return 0;
+}
@@ -6,144 +6,736 @@
 
 #include "dbfat.h"
 #include "cluster.h"
+#include "epoch.h"
 
-// FAT Entries
-uint32_t *FAT_ENTRIES;
+// Cluster chains are stored as lists of extents in their DirEntry, FAT is never kept
+// in memory and its sectors are built from extents when they are read. Clusters are
+// grouped into pages of CLUSTERS_PER_PAGE, page is allocated only when some of its
+// clusters are used and missing pages are completely free, so memory grows with the
+// number of files and fragments and not with the size of the volume.
+//
+// Pages are shared with published image versions and readers use them without
+// locks, so writer never changes a published page. It copies the page on first
+// change after publishing and retires the old one, CLUSTER_PAGES is the writer's
+// page table of the next version.
+#define CLUSTERS_PER_PAGE 4096
+#define WORDS_PER_PAGE    (CLUSTERS_PER_PAGE / 64)
+#define N_PAGES           ((uint32_t)((N_CLUSTERS + CLUSTERS_PER_PAGE - 1) / CLUSTERS_PER_PAGE))
+#define FAT_ENTRIES_PER_SECTOR (BPB_BytesPerSector / sizeof(uint32_t))
+
+// Reference from page to extent that overlaps it
+struct ExtentRef {
+    uint32_t first_cluster;
+    uint32_t clusters;
+    struct DirEntry *dir_entry;
+    struct EntryView *view;     // readers use view instead of dir_entry
+    uint32_t extent;            // index in dir_entry->extents and view->extents
+};
+
+struct ClusterPage {
+    // bit is set when cluster is free, bits past N_CLUSTERS are never set
+    uint64_t free_bitmap[WORDS_PER_PAGE];
+    uint32_t used_clusters;     // including clusters 0, 1 and ones past N_CLUSTERS
+
+    // extents that overlap page, sorted by first cluster
+    struct ExtentRef *refs;
+    uint32_t ref_count;
+    uint32_t ref_capacity;
+
+    uint64_t version;           // page can be changed in place only in its own version
+};
+
+struct ClusterPage **CLUSTER_PAGES;
+uint64_t CLUSTER_PAGES_VERSION = 1;
 uint32_t LAST_FREE_ENTRY = 2;
 
-// Directory Entries
-struct DirEntry **DIR_ENTRIES;
+// Free Cluster Bitmap summaries. FREE_SUMMARY has one bit per bitmap word which is
+// set when that word has at least one free cluster, so each summary word covers one
+// page and free clusters are found by scanning 4096 clusters at a time. FULL_SUMMARY
+// bits are set for words where all 64 clusters are free, long free runs always
+// contain such words so they are found without walking small fragments.
+#define BITMAP_WORDS  ((uint32_t)((N_CLUSTERS + 63) / 64))
+#define SUMMARY_WORDS N_PAGES
+#define MIN_FULL_WORD_RUN 127
+// number of small free fragments looked at before settling for longest of them
+#define MAX_FREE_RUN_CANDIDATES 256
+uint64_t *FREE_SUMMARY;
+uint64_t *FULL_SUMMARY;
+
+void link_cluster_run(struct DirEntry *dir_entry, uint32_t cluster, uint32_t count);
+
+uint64_t get_bitmap_word(struct ClusterPage **pages, uint32_t word) {
+    struct ClusterPage *page = pages[word / WORDS_PER_PAGE];
+    return (page == NULL) ? ~0ULL : page->free_bitmap[word % WORDS_PER_PAGE];
+}
+
+/// get_cluster_page()
+///     Returns page of cluster that writer can change, page is created if it does not
+///     exist and copied if it is shared with published versions
+struct ClusterPage * get_cluster_page(uint32_t cluster) {
+    uint32_t page_n = cluster / CLUSTERS_PER_PAGE;
+    struct ClusterPage *page = CLUSTER_PAGES[page_n];
+    if (page == NULL) {
+        page = (struct ClusterPage *)malloc(sizeof(struct ClusterPage));
+        assert(page != NULL);
+        memset(page->free_bitmap, 0xFF, sizeof(page->free_bitmap));
+        page->used_clusters = 0;
+        page->refs = NULL;
+        page->ref_count = 0;
+        page->ref_capacity = 0;
+        page->version = CLUSTER_PAGES_VERSION;
+        CLUSTER_PAGES[page_n] = page;
+    } else if (page->version != CLUSTER_PAGES_VERSION) {
+        struct ClusterPage *copy = (struct ClusterPage *)malloc(sizeof(struct ClusterPage));
+        assert(copy != NULL);
+        memcpy(copy, page, sizeof(struct ClusterPage));
+        if (page->ref_capacity > 0) {
+            copy->refs = (struct ExtentRef *)malloc(page->ref_capacity * sizeof(struct ExtentRef));
+            assert(copy->refs != NULL);
+            memcpy(copy->refs, page->refs, page->ref_count * sizeof(struct ExtentRef));
+        }
+        copy->version = CLUSTER_PAGES_VERSION;
+        retire_memory(page->refs);
+        retire_memory(page);
+        CLUSTER_PAGES[page_n] = page = copy;
+    }
+    return page;
+}
+
+void update_summaries(uint32_t word) {
+    uint64_t bits = get_bitmap_word(CLUSTER_PAGES, word);
+    uint64_t mask = 1ULL << (word % 64);
+    FREE_SUMMARY[word / 64] = (bits != 0) ? (FREE_SUMMARY[word / 64] | mask) : (FREE_SUMMARY[word / 64] & ~mask);
+    FULL_SUMMARY[word / 64] = (bits == ~0ULL) ? (FULL_SUMMARY[word / 64] | mask) : (FULL_SUMMARY[word / 64] & ~mask);
+}
+
+void mark_cluster_used(uint32_t cluster) {
+    struct ClusterPage *page = get_cluster_page(cluster);
+    uint64_t *word = &page->free_bitmap[(cluster % CLUSTERS_PER_PAGE) / 64];
+    assert(*word & (1ULL << (cluster % 64)));
+    *word &= ~(1ULL << (cluster % 64));
+    page->used_clusters++;
+    update_summaries(cluster / 64);
+}
+
+void mark_cluster_free(uint32_t cluster) {
+    uint32_t page_n = cluster / CLUSTERS_PER_PAGE;
+    struct ClusterPage *page = get_cluster_page(cluster);
+    uint64_t *word = &page->free_bitmap[(cluster % CLUSTERS_PER_PAGE) / 64];
+    assert((*word & (1ULL << (cluster % 64))) == 0);
+    *word |= 1ULL << (cluster % 64);
+    page->used_clusters--;
+    if ((page->used_clusters == 0) && (page->ref_count == 0)) {
+        // page is completely free again, it was copied above so it is not published
+        free(page->refs);
+        free(page);
+        CLUSTER_PAGES[page_n] = NULL;
+    }
+    update_summaries(cluster / 64);
+}
+
+/// mark_cluster_reserved()
+///     Marks cluster that does not hold data as used forever, i.e. clusters 0 and 1
+///     and ones past N_CLUSTERS in the last page. Pages that have them are never freed.
+void mark_cluster_reserved(uint32_t cluster) {
+    struct ClusterPage *page = get_cluster_page(cluster);
+    page->free_bitmap[(cluster % CLUSTERS_PER_PAGE) / 64] &= ~(1ULL << (cluster % 64));
+    page->used_clusters++;
+}
+
+/// find_extent_ref()
+///     Returns index of first reference in page that ends after cluster
+uint32_t find_extent_ref(struct ClusterPage *page, uint32_t cluster) {
+    uint32_t lo = 0;
+    uint32_t hi = page->ref_count;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (page->refs[mid].first_cluster + page->refs[mid].clusters <= cluster) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/// get_extent_ref()
+///     Returns reference to extent that has cluster in it or NULL if cluster is free
+struct ExtentRef * get_extent_ref(struct ClusterPage **pages, uint32_t cluster) {
+    if (cluster >= N_CLUSTERS) {
+        return NULL;
+    }
+    struct ClusterPage *page = pages[cluster / CLUSTERS_PER_PAGE];
+    if (page == NULL) {
+        return NULL;
+    }
+    uint32_t i = find_extent_ref(page, cluster);
+    if ((i < page->ref_count) && (page->refs[i].first_cluster <= cluster)) {
+        return &page->refs[i];
+    }
+    return NULL;
+}
+
+void add_extent_refs(struct DirEntry *dir_entry, uint32_t extent) {
+    struct ClusterExtent *e = &dir_entry->extents[extent];
+    struct ExtentRef ref = { e->first_cluster, e->clusters, dir_entry, dir_entry->view, extent };
+    uint32_t last_cluster = e->first_cluster + e->clusters - 1;
+    for (uint32_t page_n = e->first_cluster / CLUSTERS_PER_PAGE; page_n <= last_cluster / CLUSTERS_PER_PAGE; page_n++) {
+        struct ClusterPage *page = get_cluster_page(page_n * CLUSTERS_PER_PAGE);
+        if (page->ref_count == page->ref_capacity) {
+            page->ref_capacity = (page->ref_capacity == 0) ? 4 : (page->ref_capacity * 2);
+            page->refs = (struct ExtentRef *)realloc(page->refs, page->ref_capacity * sizeof(struct ExtentRef));
+            assert(page->refs != NULL);
+        }
+        uint32_t i = find_extent_ref(page, ref.first_cluster);
+        memmove(&page->refs[i + 1], &page->refs[i], (page->ref_count - i) * sizeof(struct ExtentRef));
+        page->refs[i] = ref;
+        page->ref_count++;
+    }
+}
+
+/// remove_extent_refs()
+///     Removes references to extent from all pages. Pages stay allocated because
+///     clusters of extent are still marked as used.
+void remove_extent_refs(struct ClusterExtent *e) {
+    uint32_t last_cluster = e->first_cluster + e->clusters - 1;
+    for (uint32_t page_n = e->first_cluster / CLUSTERS_PER_PAGE; page_n <= last_cluster / CLUSTERS_PER_PAGE; page_n++) {
+        struct ClusterPage *page = get_cluster_page(page_n * CLUSTERS_PER_PAGE);
+        uint32_t i = find_extent_ref(page, e->first_cluster);
+        assert((i < page->ref_count) && (page->refs[i].first_cluster == e->first_cluster));
+        memmove(&page->refs[i], &page->refs[i + 1], (page->ref_count - i - 1) * sizeof(struct ExtentRef));
+        page->ref_count--;
+    }
+}
 
 void initialize_clusters(struct DirEntry *ROOT_DIR_ENTRY) {
-    // BOOT_SECTOR Checks
-    assert(BOOT_SECTOR[13] == BPB_SectorsPerCluster);
-    assert(BOOT_SECTOR[66] == 0x29);
-    assert(BOOT_SECTOR[510] == 0x55);
-    assert(BOOT_SECTOR[511] == 0xAA);
+    if (IMAGE_FORMAT == IMAGE_FORMAT_FAT32) {
+        // BOOT_SECTOR Checks
+        assert(BOOT_SECTOR[13] == BPB_SectorsPerCluster);
+        assert(BOOT_SECTOR[66] == 0x29);
+        assert(BOOT_SECTOR[510] == 0x55);
+        assert(BOOT_SECTOR[511] == 0xAA);
 
-    // FS_INFO Checks
-    assert(FS_INFO[510] == 0x55);
-    assert(FS_INFO[511] == 0xAA);
+        // FS_INFO Checks
+        assert(FS_INFO[510] == 0x55);
+        assert(FS_INFO[511] == 0xAA);
+    }
 
     printf("Size of FAT in sectors: %u (%u Bytes)\n", BPB_FATSz32, BPB_FATSz32 * BPB_BytesPerSector);
 
-    FAT_ENTRIES = (uint32_t *)malloc(BPB_FATSz32 * BPB_BytesPerSector);
-    DIR_ENTRIES = (struct DirEntry **)malloc(N_CLUSTERS * sizeof(struct DirEntry *));
-    memset(FAT_ENTRIES, 0, BPB_FATSz32 * BPB_BytesPerSector);
+    CLUSTER_PAGES = (struct ClusterPage **)calloc(N_PAGES, sizeof(struct ClusterPage *));
+    FREE_SUMMARY = (uint64_t *)malloc(SUMMARY_WORDS * sizeof(uint64_t));
+    FULL_SUMMARY = (uint64_t *)malloc(SUMMARY_WORDS * sizeof(uint64_t));
+    memset(FREE_SUMMARY, 0xFF, SUMMARY_WORDS * sizeof(uint64_t));
+    memset(FULL_SUMMARY, 0xFF, SUMMARY_WORDS * sizeof(uint64_t));
 
-    // initialize cluster 0 and 1 fat entries
-    FAT_ENTRIES[0] = 0x0FFFFFF0;
-    FAT_ENTRIES[1] = 0x08FFFFFF;
+    // clusters 0 and 1 and ones past the end of volume can never be allocated
+    mark_cluster_reserved(0);
+    mark_cluster_reserved(1);
+    for (uint32_t i = N_CLUSTERS; i < N_PAGES * CLUSTERS_PER_PAGE; i++) {
+        mark_cluster_reserved(i);
+    }
+    for (uint32_t word = 0; word < N_PAGES * WORDS_PER_PAGE; word++) {
+        update_summaries(word);
+    }
 
-    // root directory fat entry
-    FAT_ENTRIES[BPB_RootCluster] = FAT_EOFC_ENTRY;
-    DIR_ENTRIES[BPB_RootCluster] = ROOT_DIR_ENTRY;
+    // root directory cluster
+    ROOT_DIR_ENTRY->extents = NULL;
+    ROOT_DIR_ENTRY->extent_count = 0;
+    link_cluster_run(ROOT_DIR_ENTRY, BPB_RootCluster, 1);
 }
 
 void cleanup_clusters() {
-    free(FAT_ENTRIES);
-    free(DIR_ENTRIES);
+    for (uint32_t i = 0; i < N_PAGES; i++) {
+        if (CLUSTER_PAGES[i] != NULL) {
+            free(CLUSTER_PAGES[i]->refs);
+            free(CLUSTER_PAGES[i]);
+        }
+    }
+    free(CLUSTER_PAGES);
+    free(FREE_SUMMARY);
+    free(FULL_SUMMARY);
+}
+
+/// find_summary_word_from()
+///     Returns first bitmap word starting from word that has its bit set in summary,
+///     or BITMAP_WORDS if there is no such word
+uint32_t find_summary_word_from(uint64_t *summary, uint32_t word) {
+    for (uint32_t s = word / 64; s < SUMMARY_WORDS; s++) {
+        uint64_t bits = summary[s];
+        if (s == word / 64) {
+            bits &= ~0ULL << (word % 64);
+        }
+        if (bits != 0) {
+            return s * 64 + __builtin_ctzll(bits);
+        }
+    }
+    return BITMAP_WORDS;
+}
+
+/// find_free_cluster_from()
+///     Returns first free cluster starting from cluster start, or N_CLUSTERS if there
+///     are no free clusters after it
+uint32_t find_free_cluster_from(uint32_t start) {
+    uint32_t word = start / 64;
+    if (word >= BITMAP_WORDS) {
+        return N_CLUSTERS;
+    }
+    uint64_t bits = get_bitmap_word(CLUSTER_PAGES, word) & (~0ULL << (start % 64));
+    if (bits != 0) {
+        return word * 64 + __builtin_ctzll(bits);
+    }
+
+    // skip words without free clusters using summary
+    word = find_summary_word_from(FREE_SUMMARY, word + 1);
+    if (word >= BITMAP_WORDS) {
+        return N_CLUSTERS;
+    }
+    return word * 64 + __builtin_ctzll(get_bitmap_word(CLUSTER_PAGES, word));
+}
+
+/// get_free_run_length()
+///     Returns number of consecutive free clusters starting at cluster, counting at
+///     most max_clusters
+uint32_t get_free_run_length(struct ClusterPage **pages, uint32_t cluster, uint32_t max_clusters) {
+    uint32_t run = 0;
+    while ((run < max_clusters) && (cluster + run < N_CLUSTERS)) {
+        uint32_t position = cluster + run;
+        uint32_t bits_left = 64 - (position % 64);
+        uint64_t used = ~get_bitmap_word(pages, position / 64) >> (position % 64);
+        uint32_t free_bits = (used == 0) ? bits_left : (uint32_t)__builtin_ctzll(used);
+        run += free_bits;
+        if (free_bits < bits_left) {
+            break;
+        }
+    }
+    return (run < max_clusters) ? run : max_clusters;
 }
 
 /// find_free_cluster()
-///     Finds available cluster by traversing through FAT_ENTRIES
+///     Finds available cluster starting from the last allocated one, wraps around to
+///     the start of the volume when it reaches the end of it
 uint32_t find_free_cluster() {
-    for (uint32_t i = LAST_FREE_ENTRY; i < N_CLUSTERS; i++) {
-        if (FAT_ENTRIES[i] == FAT_FREE_ENTRY) {
-            LAST_FREE_ENTRY = i;
-            return i;
+    uint32_t cluster = find_free_cluster_from(LAST_FREE_ENTRY);
+    if (cluster >= N_CLUSTERS) {
+        cluster = find_free_cluster_from(2);
+    }
+    // if there are no more available clusters that is bad, very bad...
+    assert(cluster < N_CLUSTERS);
+    LAST_FREE_ENTRY = cluster;
+    return cluster;
+}
+
+/// find_long_free_run_in()
+///     Same as find_free_run_in() but only looks at runs that contain at least one
+///     fully free bitmap word, i.e. it finds every run of MIN_FULL_WORD_RUN or more
+///     clusters but skips smaller fragments
+uint32_t find_long_free_run_in(uint32_t start, uint32_t end, uint32_t clusters,
+        uint32_t *best_cluster, uint32_t *best_run) {
+    uint32_t word = find_summary_word_from(FULL_SUMMARY, start / 64);
+    while ((word < BITMAP_WORDS) && (word * 64 < end)) {
+        // run may start with free clusters at the end of previous word
+        uint32_t cluster = word * 64;
+        if (word > 0) {
+            uint64_t used = ~get_bitmap_word(CLUSTER_PAGES, word - 1);
+            cluster -= (used == 0) ? 64 : __builtin_clzll(used);
+        }
+        uint32_t run = get_free_run_length(CLUSTER_PAGES, cluster, clusters);
+        if (run > *best_run) {
+            *best_cluster = cluster;
+            *best_run = run;
+            if (run == clusters) {
+                return 1;
+            }
         }
+        word = find_summary_word_from(FULL_SUMMARY, (cluster + run) / 64 + 1);
     }
-    for (uint32_t i = 2; i < LAST_FREE_ENTRY; i++) {
-        if (FAT_ENTRIES[i] == FAT_FREE_ENTRY) {
-            LAST_FREE_ENTRY = i;
-            return i;
+    return 0;
+}
+
+/// find_free_run_in()
+///     Looks for run of free clusters in [start, end), see find_free_run(). Gives up
+///     after looking at *candidates runs so that fully fragmented volume is not
+///     walked all the way through on every allocation.
+uint32_t find_free_run_in(uint32_t start, uint32_t end, uint32_t clusters,
+        uint32_t *best_cluster, uint32_t *best_run, uint32_t *candidates) {
+    uint32_t cluster = find_free_cluster_from(start);
+    while ((cluster < end) && (*candidates > 0)) {
+        *candidates -= 1;
+        uint32_t run = get_free_run_length(CLUSTER_PAGES, cluster, clusters);
+        if (run > *best_run) {
+            *best_cluster = cluster;
+            *best_run = run;
+            if (run == clusters) {
+                return 1;
+            }
         }
+        // cluster + run is used, so next free cluster is after it
+        cluster = find_free_cluster_from(cluster + run + 1);
     }
-    // if there are no more available clusters that is bad, very bad...
-    assert(0);
+    return 0;
+}
+
+/// find_free_run()
+///     Finds first run of at least clusters free clusters starting from the last
+///     allocated one. If there is no such run, returns longest free run instead, or
+///     when only small fragments are left the longest of the first ones it finds.
+///     Length of the run, capped at clusters, is stored in run_clusters and it is
+///     0 when there are no free clusters left at all.
+uint32_t find_free_run(uint32_t clusters, uint32_t *run_clusters) {
+    uint32_t best_cluster = 0;
+    uint32_t best_run = 0;
+    uint32_t candidates = MAX_FREE_RUN_CANDIDATES;
+    assert(clusters > 0);
+    if (clusters >= MIN_FULL_WORD_RUN) {
+        if (find_long_free_run_in(LAST_FREE_ENTRY, N_CLUSTERS, clusters, &best_cluster, &best_run) ||
+                find_long_free_run_in(2, LAST_FREE_ENTRY, clusters, &best_cluster, &best_run) ||
+                (best_run >= MIN_FULL_WORD_RUN)) {
+            *run_clusters = best_run;
+            return best_cluster;
+        }
+        // there are only small fragments left, fall back to looking at all of them
+    }
+    if (!find_free_run_in(LAST_FREE_ENTRY, N_CLUSTERS, clusters, &best_cluster, &best_run, &candidates)) {
+        find_free_run_in(2, LAST_FREE_ENTRY, clusters, &best_cluster, &best_run, &candidates);
+    }
+    *run_clusters = best_run;
+    return best_cluster;
 }
 
 int is_cluster_free(uint32_t cluster) {
-    return (FAT_ENTRIES[cluster] == FAT_FREE_ENTRY) ? 1 : 0;
+    return (get_bitmap_word(CLUSTER_PAGES, cluster / 64) >> (cluster % 64)) & 1;
 }
 
-uint32_t allocate_cluster_chain(struct DirEntry *dir_entry, uint32_t size) {
-    uint32_t first_cluster = find_free_cluster();
-    uint32_t current_size = BYTES_PER_CLUSTER;
+uint32_t get_chain_clusters(uint64_t size) {
+    uint32_t clusters = (uint32_t)((size + BYTES_PER_CLUSTER - 1) / BYTES_PER_CLUSTER);
+    return (clusters == 0) ? 1 : clusters;
+}
 
-    uint32_t next_cluster = first_cluster;
-    while (1) {
-        // set next_cluster as occupied always otherwise find_free_cluster will not know
-        // that it is occupied already
-        FAT_ENTRIES[next_cluster] = FAT_EOFC_ENTRY;
-        DIR_ENTRIES[next_cluster] = dir_entry;
+/// link_cluster_run()
+///     Marks clusters [cluster, cluster + count) as used by dir_entry and appends them
+///     to the end of its cluster chain, merging them with last extent if they follow it
+void link_cluster_run(struct DirEntry *dir_entry, uint32_t cluster, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        mark_cluster_used(cluster + i);
+    }
 
-        if (current_size < size) {
-            FAT_ENTRIES[next_cluster] = find_free_cluster();
-            next_cluster = FAT_ENTRIES[next_cluster];
-            current_size += BYTES_PER_CLUSTER;
-        } else {
+    struct ClusterExtent *last = (dir_entry->extent_count == 0) ? NULL : &dir_entry->extents[dir_entry->extent_count - 1];
+    if ((last != NULL) && (last->first_cluster + last->clusters == cluster)) {
+        remove_extent_refs(last);
+        last->clusters += count;
+    } else {
+        uint32_t ordinal = (last == NULL) ? 0 : (last->ordinal + last->clusters);
+        dir_entry->extents = (struct ClusterExtent *)realloc(dir_entry->extents,
+            (dir_entry->extent_count + 1) * sizeof(struct ClusterExtent));
+        assert(dir_entry->extents != NULL);
+        last = &dir_entry->extents[dir_entry->extent_count];
+        last->first_cluster = cluster;
+        last->clusters = count;
+        last->ordinal = ordinal;
+        dir_entry->extent_count++;
+    }
+    add_extent_refs(dir_entry, dir_entry->extent_count - 1);
+    LAST_FREE_ENTRY = cluster + count - 1;
+}
+
+/// append_cluster_runs()
+///     Allocates clusters for dir_entry as one contiguous run if there is a long enough
+///     free run, otherwise as few runs as possible taking longest ones first. Returns
+///     first allocated cluster.
+uint32_t append_cluster_runs(struct DirEntry *dir_entry, uint32_t clusters) {
+    uint32_t first_cluster = 0;
+    while (clusters > 0) {
+        uint32_t run;
+        uint32_t cluster = find_free_run(clusters, &run);
+        // if there are no more available clusters that is bad, very bad...
+        assert(run > 0);
+
+        link_cluster_run(dir_entry, cluster, run);
+        if (first_cluster == 0) {
+            first_cluster = cluster;
+        }
+        clusters -= run;
+    }
+    return first_cluster;
+}
+
+/// truncate_cluster_chain()
+///     Frees all clusters of dir_entry chain past first clusters
+void truncate_cluster_chain(struct DirEntry *dir_entry, uint32_t clusters) {
+    while (dir_entry->extent_count > 0) {
+        struct ClusterExtent *last = &dir_entry->extents[dir_entry->extent_count - 1];
+        if (last->ordinal + last->clusters <= clusters) {
             break;
         }
+        uint32_t keep = (last->ordinal < clusters) ? (clusters - last->ordinal) : 0;
+        remove_extent_refs(last);
+        for (uint32_t i = keep; i < last->clusters; i++) {
+            mark_cluster_free(last->first_cluster + i);
+        }
+        if (keep > 0) {
+            last->clusters = keep;
+            add_extent_refs(dir_entry, dir_entry->extent_count - 1);
+            break;
+        }
+        dir_entry->extent_count--;
+    }
+    if (dir_entry->extent_count == 0) {
+        free(dir_entry->extents);
+        dir_entry->extents = NULL;
     }
+}
+
+/// allocate_cluster_chain()
+///     Allocates cluster chain for size bytes, chain is a single contiguous extent
+///     whenever there is enough contiguous free space, so that file data maps to one
+///     sequential range of the image
+uint32_t allocate_cluster_chain(struct DirEntry *dir_entry, uint64_t size) {
+    assert(dir_entry->extent_count == 0);
+    return append_cluster_runs(dir_entry, get_chain_clusters(size));
+}
+
+/// reallocate_cluster_chain()
+///     Shrinks or extends cluster chain to fit new_size bytes. Chain is extended in
+///     place if clusters right after its end are free, otherwise whole chain is moved
+///     to a new contiguous extent. Returns new first cluster of chain, callers must
+///     update references to the old one when it changes.
+uint32_t reallocate_cluster_chain(uint32_t first_cluster, uint64_t new_size) {
+    struct DirEntry *dir_entry = get_cluster_dir_entry(first_cluster);
+    assert((dir_entry != NULL) && (dir_entry->extents[0].first_cluster == first_cluster));
+
+    uint32_t new_clusters = get_chain_clusters(new_size);
+    struct ClusterExtent *last = &dir_entry->extents[dir_entry->extent_count - 1];
+    uint32_t clusters = last->ordinal + last->clusters;
+    if (new_clusters <= clusters) {
+        truncate_cluster_chain(dir_entry, new_clusters);
+        return first_cluster;
+    }
+
+    uint32_t extra_clusters = new_clusters - clusters;
+    uint32_t next_cluster = last->first_cluster + last->clusters;
+    if (get_free_run_length(CLUSTER_PAGES, next_cluster, extra_clusters) == extra_clusters) {
+        link_cluster_run(dir_entry, next_cluster, extra_clusters);
+        return first_cluster;
+    }
+
+    // root directory cluster is fixed in BOOT_SECTOR so it can never move
+    if (first_cluster != BPB_RootCluster) {
+        uint32_t run;
+        uint32_t new_first_cluster = find_free_run(new_clusters, &run);
+        if (run == new_clusters) {
+            truncate_cluster_chain(dir_entry, 0);
+            link_cluster_run(dir_entry, new_first_cluster, new_clusters);
+            return new_first_cluster;
+        }
+    }
+
+    // no contiguous extent is large enough, just append to existing chain
+    append_cluster_runs(dir_entry, extra_clusters);
     return first_cluster;
 }
 
-uint32_t reallocate_cluster_chain(uint32_t first_cluster, uint32_t new_size) {
-    uint32_t next_cluster = first_cluster;
-    uint32_t current_size = BYTES_PER_CLUSTER;
+void free_cluster_chain(uint32_t first_cluster) {
+    struct DirEntry *dir_entry = get_cluster_dir_entry(first_cluster);
+    assert((dir_entry != NULL) && (dir_entry->extents[0].first_cluster == first_cluster));
+    truncate_cluster_chain(dir_entry, 0);
+}
 
-    uint8_t extending = 0;
+struct DirEntry * get_cluster_dir_entry(uint32_t cluster) {
+    struct ExtentRef *ref = get_extent_ref(CLUSTER_PAGES, cluster);
+    return (ref == NULL) ? NULL : ref->dir_entry;
+}
 
-    while (current_size < new_size) {
-        if (FAT_ENTRIES[next_cluster] == FAT_EOFC_ENTRY) {
-            // new size is larger than previous so extend the cluster
-            extending = 1;
+/// restore_cluster_chain()
+///     Replaces cluster chain of dir_entry with extents saved in a snapshot. Clusters
+///     must be free or already in the chain of dir_entry, otherwise nothing is changed
+///     and -1 is returned.
+int restore_cluster_chain(struct DirEntry *dir_entry, struct ClusterExtent *extents, uint32_t extent_count) {
+    if (extent_count == 0) {
+        return -1;
+    }
+    uint32_t ordinal = 0;
+    for (uint32_t i = 0; i < extent_count; i++) {
+        struct ClusterExtent *e = &extents[i];
+        if ((e->ordinal != ordinal) || (e->clusters == 0) || (e->first_cluster < 2) ||
+                (e->first_cluster >= N_CLUSTERS) || (e->clusters > N_CLUSTERS - e->first_cluster)) {
+            return -1;
         }
-        if (extending == 1) {
-            FAT_ENTRIES[next_cluster] = find_free_cluster();
-            DIR_ENTRIES[next_cluster] = DIR_ENTRIES[first_cluster];
+        uint32_t cluster = e->first_cluster;
+        while (cluster < e->first_cluster + e->clusters) {
+            uint32_t run = get_free_run_length(CLUSTER_PAGES, cluster, e->first_cluster + e->clusters - cluster);
+            if (run == 0) {
+                if (get_cluster_dir_entry(cluster) != dir_entry) {
+                    return -1;
+                }
+                run = 1;
+            }
+            cluster += run;
         }
+        ordinal += e->clusters;
+    }
 
-        next_cluster = FAT_ENTRIES[next_cluster];
-        current_size += BYTES_PER_CLUSTER;
+    truncate_cluster_chain(dir_entry, 0);
+    for (uint32_t i = 0; i < extent_count; i++) {
+        link_cluster_run(dir_entry, extents[i].first_cluster, extents[i].clusters);
     }
-    if (extending == 0 && FAT_ENTRIES[next_cluster] != FAT_EOFC_ENTRY) {
-        // free clusters since we have shrunk current chain
-        free_cluster_chain(FAT_ENTRIES[next_cluster]);
+    return 0;
+}
+
+/// get_allocation_start()
+///     Returns cluster where search for free clusters continues, it is saved with
+///     snapshot so that files added after restart are placed the same way
+uint32_t get_allocation_start() {
+    return LAST_FREE_ENTRY;
+}
+
+void set_allocation_start(uint32_t cluster) {
+    LAST_FREE_ENTRY = ((cluster >= 2) && (cluster < N_CLUSTERS)) ? cluster : 2;
+}
+
+/// update_extent_views()
+///     Points references to extents of dir_entry to its current view, called when
+///     view is rebuilt
+void update_extent_views(struct DirEntry *dir_entry) {
+    for (uint32_t extent = 0; extent < dir_entry->extent_count; extent++) {
+        struct ClusterExtent *e = &dir_entry->extents[extent];
+        uint32_t last_cluster = e->first_cluster + e->clusters - 1;
+        for (uint32_t page_n = e->first_cluster / CLUSTERS_PER_PAGE; page_n <= last_cluster / CLUSTERS_PER_PAGE; page_n++) {
+            struct ClusterPage *page = get_cluster_page(page_n * CLUSTERS_PER_PAGE);
+            uint32_t i = find_extent_ref(page, e->first_cluster);
+            assert((i < page->ref_count) && (page->refs[i].first_cluster == e->first_cluster));
+            page->refs[i].view = dir_entry->view;
+        }
     }
+}
 
-    FAT_ENTRIES[next_cluster] = FAT_EOFC_ENTRY;
-    DIR_ENTRIES[next_cluster] = DIR_ENTRIES[first_cluster];
-    return first_cluster;
+/// publish_cluster_pages()
+///     Returns copy of page table for published image version, its pages are shared
+///     with it from now on and writer copies them before changing them again
+struct ClusterPage **publish_cluster_pages() {
+    struct ClusterPage **pages = (struct ClusterPage **)malloc(N_PAGES * sizeof(struct ClusterPage *));
+    assert(pages != NULL);
+    memcpy(pages, CLUSTER_PAGES, N_PAGES * sizeof(struct ClusterPage *));
+    CLUSTER_PAGES_VERSION++;
+    return pages;
 }
 
-void free_cluster_chain(uint32_t first_cluster) {
-    uint32_t next_cluster = first_cluster;
-    do {
-        uint32_t tmp = FAT_ENTRIES[next_cluster];
-        FAT_ENTRIES[next_cluster] = FAT_FREE_ENTRY;
-        next_cluster = tmp;
-    } while (next_cluster != FAT_EOFC_ENTRY);
+/// get_cluster_view()
+///     Returns view of entry that owns cluster in published image version and sets
+///     offset to offset in bytes of cluster from the start of its data, or returns
+///     NULL if cluster is free
+struct EntryView * get_cluster_view(struct ImageView *view, uint32_t cluster, uint64_t *offset) {
+    struct ExtentRef *ref = get_extent_ref(view->cluster_pages, cluster);
+    if (ref == NULL) {
+        return NULL;
+    }
+    struct ClusterExtent *e = &ref->view->extents[ref->extent];
+    *offset = (uint64_t)(e->ordinal + (cluster - e->first_cluster)) * BYTES_PER_CLUSTER;
+    return ref->view;
 }
 
-uint32_t get_cluster_chain_size(uint32_t first_cluster, uint32_t last_cluster) {
-    uint32_t clusters = 0;
-    while (first_cluster != last_cluster) {
-        assert(first_cluster != FAT_FREE_ENTRY);
-        assert(first_cluster != FAT_EOFC_ENTRY);
-        first_cluster = FAT_ENTRIES[first_cluster];
-        clusters += 1;
+/// get_cluster_run()
+///     Returns number of consecutive clusters starting at cluster (at most max_clusters)
+///     that are either all free or all belong to the same DirEntry at consecutive offsets,
+///     i.e. that map to one contiguous range of the same data
+uint32_t get_cluster_run(struct ImageView *view, uint32_t cluster, uint32_t max_clusters) {
+    uint32_t run = 1;
+    struct ExtentRef *ref = get_extent_ref(view->cluster_pages, cluster);
+    if (cluster >= N_CLUSTERS) {
+        run = max_clusters;
+    } else if (ref == NULL) {
+        run = get_free_run_length(view->cluster_pages, cluster, max_clusters);
+        if (cluster + run >= N_CLUSTERS) {
+            // clusters past the end of volume are treated as free too
+            run = max_clusters;
+        }
+    } else {
+        // adjacent extents of the same chain are always merged
+        run = ref->first_cluster + ref->clusters - cluster;
+        if (run > max_clusters) {
+            run = max_clusters;
+        }
     }
-    return clusters * BPB_SectorsPerCluster * BPB_BytesPerSector;
+    return run;
 }
 
-struct DirEntry * get_cluster_dir_entry(uint32_t cluster) {
-    return DIR_ENTRIES[cluster];
+/// read_fat_sector()
+///     Builds FAT sector from extents of clusters it covers, entries of free clusters
+///     and ones past N_CLUSTERS are 0
+void read_fat_sector(struct ImageView *view, uint32_t sector, uint32_t *entries) {
+    uint32_t first = sector * FAT_ENTRIES_PER_SECTOR;
+    uint32_t end = first + FAT_ENTRIES_PER_SECTOR;
+    uint32_t eofc_entry = (IMAGE_FORMAT == IMAGE_FORMAT_EXFAT) ? EXFAT_EOFC_ENTRY : FAT_EOFC_ENTRY;
+    memset(entries, 0, BPB_BytesPerSector);
+    if (first == 0) {
+        entries[0] = (IMAGE_FORMAT == IMAGE_FORMAT_EXFAT) ? 0xFFFFFFF8 : 0x0FFFFFF0;
+        entries[1] = (IMAGE_FORMAT == IMAGE_FORMAT_EXFAT) ? 0xFFFFFFFF : 0x08FFFFFF;
+    }
+    if (first >= N_CLUSTERS) {
+        return;
+    }
+
+    // sector never crosses page boundary
+    struct ClusterPage *page = view->cluster_pages[first / CLUSTERS_PER_PAGE];
+    if (page == NULL) {
+        return;
+    }
+    for (uint32_t i = find_extent_ref(page, first); i < page->ref_count; i++) {
+        struct ExtentRef *ref = &page->refs[i];
+        if (ref->first_cluster >= end) {
+            break;
+        }
+        uint32_t extent_end = ref->first_cluster + ref->clusters;
+        uint32_t next_extent_cluster = eofc_entry;
+        if (ref->extent + 1 < ref->view->extent_count) {
+            next_extent_cluster = ref->view->extents[ref->extent + 1].first_cluster;
+        }
+
+        uint32_t cluster = (ref->first_cluster > first) ? ref->first_cluster : first;
+        for (; (cluster < extent_end) && (cluster < end); cluster++) {
+            entries[cluster - first] = (cluster + 1 < extent_end) ? (cluster + 1) : next_extent_cluster;
+        }
+    }
 }
 
-int read_fat_sector(uint32_t fat_sector, uint8_t *buf) {
-    memcpy(buf, &FAT_ENTRIES[fat_sector * BPB_BytesPerSector / sizeof(uint32_t)], BPB_BytesPerSector);
+int read_fat_data(struct ImageView *view, uint32_t offset, uint32_t size, uint8_t *buf) {
+    assert(offset + size <= BPB_FATSz32 * BPB_BytesPerSector);
+    uint32_t entries[FAT_ENTRIES_PER_SECTOR];
+    uint32_t buf_offset = 0;
+    while (buf_offset < size) {
+        uint32_t sector = (offset + buf_offset) / BPB_BytesPerSector;
+        uint32_t sector_offset = (offset + buf_offset) % BPB_BytesPerSector;
+        uint32_t sector_size = BPB_BytesPerSector - sector_offset;
+        if (sector_size > size - buf_offset) {
+            sector_size = size - buf_offset;
+        }
+        read_fat_sector(view, sector, entries);
+        memcpy(&buf[buf_offset], &((uint8_t *)entries)[sector_offset], sector_size);
+        buf_offset += sector_size;
+    }
     return 0;
 }
+
+/// read_allocation_bitmap()
+///     Reads exFAT allocation bitmap, bit 0 of its first byte is cluster 2 and bits
+///     are set for used clusters
+void read_allocation_bitmap(struct ImageView *view, uint32_t offset, uint32_t size, uint8_t *buf) {
+    for (uint32_t i = 0; i < size; i++) {
+        uint64_t cluster = 2 + (uint64_t)(offset + i) * 8;
+        uint8_t used = 0;
+        if (cluster < N_CLUSTERS) {
+            // byte can span two bitmap words, words past the last page are all free
+            uint32_t word = (uint32_t)(cluster / 64);
+            uint32_t shift = (uint32_t)(cluster % 64);
+            uint64_t free_bits = get_bitmap_word(view->cluster_pages, word) >> shift;
+            if ((shift > 56) && (word + 1 < N_PAGES * WORDS_PER_PAGE)) {
+                free_bits |= get_bitmap_word(view->cluster_pages, word + 1) << (64 - shift);
+            }
+            used = ~(uint8_t)free_bits;
+            if (N_CLUSTERS - cluster < 8) {
+                used &= (1 << (N_CLUSTERS - cluster)) - 1;
+            }
+        }
+        buf[i] = used;
+    }
+}
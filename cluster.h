@@ -7,19 +7,35 @@
 // FAT Entry Constants
 #define FAT_FREE_ENTRY  0x00000000
 #define FAT_EOFC_ENTRY  0x0FFFFFFF
+#define EXFAT_EOFC_ENTRY 0xFFFFFFFF
 
 void initialize_clusters(struct DirEntry *ROOT_DIR_ENTRY);
 void cleanup_clusters();
 
 uint32_t find_free_cluster();
+uint32_t find_free_run(uint32_t clusters, uint32_t *run_clusters);
 int is_cluster_free(uint32_t cluster);
 
-uint32_t allocate_cluster_chain(struct DirEntry *dir_entry, uint32_t size);
-uint32_t reallocate_cluster_chain(uint32_t first_cluster, uint32_t new_size);
+uint32_t get_chain_clusters(uint64_t size);
+uint32_t allocate_cluster_chain(struct DirEntry *dir_entry, uint64_t size);
+uint32_t reallocate_cluster_chain(uint32_t first_cluster, uint64_t new_size);
 void free_cluster_chain(uint32_t first_cluster);
-uint32_t get_cluster_chain_size(uint32_t first_cluster, uint32_t last_cluster);
-
 struct DirEntry * get_cluster_dir_entry(uint32_t cluster);
-int read_fat_sector(uint32_t fat_sector, uint8_t *buf);
+
+// restoring of cluster map saved in snapshot
+int restore_cluster_chain(struct DirEntry *dir_entry, struct ClusterExtent *extents, uint32_t extent_count);
+uint32_t get_allocation_start();
+void set_allocation_start(uint32_t cluster);
+
+// publishing of cluster map, called by writer
+void update_extent_views(struct DirEntry *dir_entry);
+struct ClusterPage **publish_cluster_pages();
+
+// readers of published image version
+struct EntryView * get_cluster_view(struct ImageView *view, uint32_t cluster, uint64_t *offset);
+uint32_t get_cluster_run(struct ImageView *view, uint32_t cluster, uint32_t max_clusters);
+void read_fat_sector(struct ImageView *view, uint32_t sector, uint32_t *entries);
+int read_fat_data(struct ImageView *view, uint32_t offset, uint32_t size, uint8_t *buf);
+void read_allocation_bitmap(struct ImageView *view, uint32_t offset, uint32_t size, uint8_t *buf);
 
 #endif
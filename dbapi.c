@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,12 +8,13 @@
 #include <unistd.h>
 
 #include <curl/curl.h>
-#include <iconv.h>
 #include <oauth.h>
 #include <pthread.h>
 
+#include "arena.h"
 #include "dbapi.h"
 #include "dbfat.h"
+#include "delta.h"
 #include "cJSON.h"
 
 char *CONSUMER_KEY_APP_FOLDER    = "ow8tibho1dgcmcl";
@@ -25,17 +27,92 @@ char *TOKEN_SECRET = "yjn1qn3y5kktpej";
 
 long int REQUEST_TIMEOUT = 60; // in seconds
 char *URL_DELTA = "https://api.dropbox.com/1/delta";
+char *URL_LONGPOLL_DELTA = "https://api-notify.dropbox.com/1/longpoll_delta";
 char *URL_FILES = "https://api-content.dropbox.com/1/files";
 
 char *DROPBOX_ROOT = "/sandbox";
 
 // HTTP Status Codes
-const long int HTTP_OK              = 200;
-const long int HTTP_PARTIAL_CONTENT = 206;
+const long int HTTP_OK                = 200;
+const long int HTTP_PARTIAL_CONTENT   = 206;
+const long int HTTP_CLIENT_ERROR      = 400;
+const long int HTTP_TOO_MANY_REQUESTS = 429;
+const long int HTTP_SERVER_ERROR      = 500;
+const long int HTTP_UNAVAILABLE       = 503;
+
+// longpoll_delta returns after LONGPOLL_TIMEOUT seconds if nothing changes, server
+// adds up to 90 seconds of random jitter to that
+long int LONGPOLL_TIMEOUT         = 30;
+long int LONGPOLL_REQUEST_TIMEOUT = 30 + 90 + 30;
+// wait after failed delta request
+long int DELTA_RETRY_INTERVAL     = 30;
+// snapshot of file entries is saved at most this often while delta pages are applied
+long int SNAPSHOT_INTERVAL        = 300;
 
 CURL *dbapi_curl   = NULL;
 char *dbapi_cursor = NULL;
 
+// Everything a request allocates comes from arena of its thread, including cJSON
+// nodes, and it is all freed at once when request finishes. Strings signed by
+// liboauth are the only ones left on the heap. File requests run many at a time on
+// one thread, every one of them has an arena of its own.
+__thread struct Arena *REQUEST_ARENA = NULL;
+struct RequestStats request_stats[REQUEST_TYPES];
+
+struct Arena *get_request_arena() {
+    if (REQUEST_ARENA == NULL) {
+        REQUEST_ARENA = (struct Arena *)malloc(sizeof(struct Arena));
+        assert(REQUEST_ARENA != NULL);
+        init_arena(REQUEST_ARENA, ARENA_BLOCK_SIZE);
+    }
+    return REQUEST_ARENA;
+}
+
+void *request_arena_malloc(size_t size) {
+    return arena_alloc(get_request_arena(), size);
+}
+
+void request_arena_free(void *ptr) {
+}
+
+/// finish_request()
+///     Adds allocations of request to counters of its type and frees them
+void finish_request(enum RequestType type, struct Arena *arena) {
+    struct RequestStats *stats = &request_stats[type];
+    __sync_fetch_and_add(&stats->requests, 1);
+    __sync_fetch_and_add(&stats->allocations, arena->allocations);
+    __sync_fetch_and_add(&stats->allocated_bytes, arena->allocated_bytes);
+    __sync_fetch_and_add(&stats->heap_allocations, arena->heap_allocations);
+    reset_arena(arena);
+}
+
+void get_request_stats(enum RequestType type, struct RequestStats *stats) {
+    *stats = request_stats[type];
+}
+
+// Response body kept in request arena
+struct ResponseBuffer {
+    struct Arena *arena;
+    char *data;
+    size_t size;
+    size_t capacity;
+};
+
+size_t response_buffer_write(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    struct ResponseBuffer *buffer = (struct ResponseBuffer *)userdata;
+    size_t data_size = size * nmemb;
+    // one more byte for terminating zero
+    if (buffer->size + data_size + 1 > buffer->capacity) {
+        size_t capacity = (buffer->size + data_size + 1) * 2;
+        buffer->data = (char *)arena_realloc(buffer->arena, buffer->data, buffer->capacity, capacity);
+        buffer->capacity = capacity;
+    }
+    memcpy(&buffer->data[buffer->size], ptr, data_size);
+    buffer->size += data_size;
+    buffer->data[buffer->size] = 0;
+    return data_size;
+}
+
 char hex_char(int hex_digit) {
     assert(hex_digit >= 0);
     assert(hex_digit < 16);
@@ -46,10 +123,9 @@ char hex_char(int hex_digit) {
     }
 }
 
-char *db_url_escape(char *url) {
+char *db_url_escape(struct Arena *arena, char *url) {
     size_t url_size = strlen(url);
-    char *buf = (char *)malloc(url_size * 3 + 1);
-    memset(buf, 0, url_size * 3 + 1);
+    char *buf = (char *)arena_alloc(arena, url_size * 3 + 1);
 
     size_t buf_offset = 0;
     for (int i = 0; i < url_size; i++) {
@@ -63,8 +139,8 @@ char *db_url_escape(char *url) {
             buf_offset += 1;
         } else {
             buf[buf_offset] = '%';
-            buf[buf_offset + 1] = hex_char(url[i] / 16);
-            buf[buf_offset + 2] = hex_char(url[i] % 16);
+            buf[buf_offset + 1] = hex_char((uint8_t)url[i] / 16);
+            buf[buf_offset + 2] = hex_char((uint8_t)url[i] % 16);
             buf_offset += 3;
         }
     }
@@ -72,23 +148,21 @@ char *db_url_escape(char *url) {
     return buf;
 }
 
-void curl_base_setup(CURL *curl) {
+void curl_base_setup(CURL *curl, long int timeout) {
     curl_easy_reset(curl);
     curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
 
     curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0); //TODO(zm): fix this
     curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 2);
 
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, REQUEST_TIMEOUT);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout);
 }
 
-CURLcode dbapi_request(
-        CURL *curl, char* url, const char* method, char *range, char *request_args,
-        long int *http_status, char **response_buffer, size_t *response_size
-        ) {
-    const char *locale = "&locale=en";
-    char *posturl = (char *)malloc(strlen(url) + strlen(request_args) + strlen(locale) + 2);
-    sprintf(posturl, "%s?%s%s", url, request_args, locale);
+/// dbapi_sign_request()
+///     Signs request and sets its url, for POST requests signed arguments are sent as
+///     body. curl keeps its own copies of both so they are freed right away.
+void dbapi_sign_request(CURL *curl, struct Arena *arena, char *url, const char *method, char *request_args) {
+    char *posturl = arena_sprintf(arena, "%s?%s&locale=en", url, request_args);
 
     char *signed_url = NULL;
     char *signed_postargs = NULL;
@@ -103,112 +177,230 @@ CURLcode dbapi_request(
     }
     assert(signed_url);
 
-    curl_base_setup(curl);
     curl_easy_setopt(curl, CURLOPT_URL, signed_url);
     if (strcmp(method, "GET") == 0) {
         curl_easy_setopt(curl, CURLOPT_HTTPGET, 1);
     } else if (strcmp(method, "POST") == 0) {
-        curl_easy_setopt(curl, CURLOPT_POST, 1);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, signed_postargs);
+        curl_easy_setopt(curl, CURLOPT_COPYPOSTFIELDS, signed_postargs);
     }
 
+    printf("[DEBUG] DBApi %s request, signed_url: %s, signed_args: %s\n", method, signed_url, (signed_postargs ? signed_postargs : "NULL"));
+
+    if (signed_postargs) free(signed_postargs);
+    if (signed_url) free(signed_url);
+}
+
+/// dbapi_perform()
+///     Signs and performs request, response body is passed to write_function with
+///     write_data the same way curl does. If write_function is NULL write_data must
+///     be a FILE* that body is written to. Request fails after timeout seconds.
+CURLcode dbapi_perform(
+        CURL *curl, char* url, const char* method, char *range, char *request_args, long int timeout,
+        curl_write_callback write_function, void *write_data, long int *http_status
+        ) {
+    curl_base_setup(curl, timeout);
+    dbapi_sign_request(curl, get_request_arena(), url, method, request_args);
     if (range != NULL) {
         curl_easy_setopt(curl, CURLOPT_RANGE, range);
     }
 
-    printf("[DEBUG] DBApi %s request, signed_url: %s, signed_args: %s\n", method, signed_url, (signed_postargs ? signed_postargs : "NULL"));
-
     *http_status = 0;
-    *response_size  = 0;
-    *response_buffer = NULL;
-    FILE *response_file = open_memstream(response_buffer, response_size);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, response_file);
+    if (write_function != NULL) {
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_function);
+    }
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, write_data);
     CURLcode ret = curl_easy_perform(curl);
-    fclose(response_file);
 
     if (ret == CURLE_OK) {
         curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, http_status);
-        printf("[DEBUG] DBApi %s request finished, http status code: %ld, response size: %zu bytes\n", method, *http_status, *response_size);
     } else {
         printf("[ERROR] DBApi %s request failed, error code: %u, error msg: %s\n", method, ret, curl_easy_strerror(ret));
     }
+    return ret;
+}
 
-    free(posturl);
-    if (signed_postargs) free(signed_postargs);
-    if (signed_url) free(signed_url);
+/// dbapi_request()
+///     Performs request and returns its whole body in response_buffer, it is zero
+///     terminated and freed when request finishes
+CURLcode dbapi_request(
+        CURL *curl, char* url, const char* method, char *range, char *request_args, long int timeout,
+        long int *http_status, char **response_buffer, size_t *response_size
+        ) {
+    struct ResponseBuffer response = { get_request_arena(), NULL, 0, 0 };
+    CURLcode ret = dbapi_perform(curl, url, method, range, request_args, timeout,
+        response_buffer_write, &response, http_status);
+    *response_buffer = response.data;
+    *response_size = response.size;
+
+    if (ret == CURLE_OK) {
+        printf("[DEBUG] DBApi %s request finished, http status code: %ld, response size: %zu bytes\n", method, *http_status, *response_size);
+    }
     return ret;
 }
 
-CURLcode dbapi_json_request(CURL *curl, char* url, const char* method, char *request_args, long int *http_status, cJSON **result) {
+CURLcode dbapi_json_request(CURL *curl, char* url, const char* method, char *request_args, long int timeout,
+        long int *http_status, cJSON **result) {
     char *response_buffer;
     size_t response_size;
-    CURLcode ret = dbapi_request(curl, url, method, NULL, request_args, http_status, &response_buffer, &response_size);
-    if (ret == CURLE_OK) {
+    CURLcode ret = dbapi_request(curl, url, method, NULL, request_args, timeout, http_status, &response_buffer, &response_size);
+    if ((ret == CURLE_OK) && (response_buffer != NULL)) {
+        // nodes are allocated from request arena
         *result = cJSON_Parse(response_buffer);
     } else {
         *result = NULL;
     }
-    if (response_buffer) free(response_buffer);
     return ret;
 }
 
-CURLcode dbapi_range_request(CURL *curl, char* url, const char* method,
-        char *request_args, long int range_start, long int range_end,
-        long int *http_status, char **response_buffer, size_t *response_size, cJSON **error) {
-    char range[20];
-    sprintf(range, "%ld-%ld", range_start, range_end - 1);
-    CURLcode ret = dbapi_request(curl, url, method, range, request_args, http_status, response_buffer, response_size);
-    if (ret == CURLE_OK) {
-        if ((*http_status == HTTP_OK) || (*http_status == HTTP_PARTIAL_CONTENT)) {
-            *error = NULL;
-        } else {
-            *error = cJSON_Parse(*response_buffer);
-            free(*response_buffer);
-            *response_buffer = NULL;
+/// dbapi_longpoll_delta()
+///     Waits until there are changes after cursor or LONGPOLL_TIMEOUT passes. Returns 1
+///     if there are changes, 0 if not and -1 on failure. backoff is set to number of
+///     seconds the server asks to wait before the next call.
+int dbapi_longpoll_delta(CURL *curl, char *cursor, long int *backoff) {
+    char *request_args = arena_sprintf(get_request_arena(), "cursor=%s&timeout=%ld", cursor, LONGPOLL_TIMEOUT);
+    long int http_status;
+    cJSON *result;
+    CURLcode ret = dbapi_json_request(curl, URL_LONGPOLL_DELTA, "GET", request_args, LONGPOLL_REQUEST_TIMEOUT,
+        &http_status, &result);
+
+    *backoff = 0;
+    int changes = -1;
+    if ((ret == CURLE_OK) && (http_status == HTTP_OK) && (result != NULL)) {
+        cJSON *changes_item = cJSON_GetObjectItem(result, "changes");
+        cJSON *backoff_item = cJSON_GetObjectItem(result, "backoff");
+        if (changes_item != NULL) {
+            changes = (changes_item->type == cJSON_True) ? 1 : 0;
         }
-    } else {
-        *error = NULL;
-        if (*response_buffer) {
-            free(*response_buffer);
-            *response_buffer = NULL;
+        if (backoff_item != NULL) {
+            *backoff = backoff_item->valueint;
         }
+    } else if (ret == CURLE_OK) {
+        printf("[ERROR] DBApi longpoll_delta request failed, http status code: %ld\n", http_status);
     }
-    return ret;
+    finish_request(REQUEST_LONGPOLL, get_request_arena());
+    return changes;
 }
 
-int dbapi_delta(CURL *curl, char *cursor, long int *http_status, cJSON **result) {
-    const char *cursor_prefix = "cursor=";
-    char *request_args = (char *)malloc(strlen(cursor_prefix) + strlen(cursor) + 1);
-    sprintf(request_args, "%s%s", cursor_prefix, cursor);
-    CURLcode ret = dbapi_json_request(curl, URL_DELTA, "POST", request_args, http_status, result);
-    free(request_args);
-    return ((ret == CURLE_OK) && (*http_status == HTTP_OK)) ? 0 : -1;
+// Handle and arena of file request are kept from one request to the next, so options
+// that do not change are only set once and connection of the handle stays open
+struct FileRequest {
+    CURL *curl;
+    struct Arena arena;
+    int64_t range_start;
+    long int http_status;
+    dbapi_write_callback write_function;
+    void *write_data;
+
+    // body of failed request, it is JSON with error description
+    struct ResponseBuffer error;
+};
+
+size_t file_request_write(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    struct FileRequest *request = (struct FileRequest *)userdata;
+    if (request->http_status == 0) {
+        // headers are already received when body starts
+        curl_easy_getinfo(request->curl, CURLINFO_RESPONSE_CODE, &request->http_status);
+    }
+
+    if ((request->http_status == HTTP_PARTIAL_CONTENT) ||
+            ((request->http_status == HTTP_OK) && (request->range_start == 0))) {
+        return request->write_function(ptr, size * nmemb, request->write_data);
+    } else {
+        return response_buffer_write(ptr, size, nmemb, &request->error);
+    }
 }
 
-int dbapi_get_file(CURL *curl, char *path, char *rev, long int range_start, long int range_end,
-        char **response_buffer, size_t *response_size) {
-    const char *rev_prefix = "rev=";
-    char *request_args = (char *)malloc(strlen(rev_prefix) + strlen(rev) + 1);
-    sprintf(request_args, "%s%s", rev_prefix, rev);
+struct FileRequest *create_file_request() {
+    struct FileRequest *request = (struct FileRequest *)calloc(1, sizeof(struct FileRequest));
+    assert(request != NULL);
+    init_arena(&request->arena, ARENA_BLOCK_SIZE);
+    request->curl = curl_easy_init();
+    assert(request->curl != NULL);
+
+    curl_base_setup(request->curl, REQUEST_TIMEOUT);
+    curl_easy_setopt(request->curl, CURLOPT_WRITEFUNCTION, file_request_write);
+    curl_easy_setopt(request->curl, CURLOPT_WRITEDATA, request);
+#if LIBCURL_VERSION_NUM >= 0x072F00
+    // several downloads share one connection if server supports HTTP/2
+    curl_easy_setopt(request->curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(request->curl, CURLOPT_PIPEWAIT, 1);
+#endif
+    return request;
+}
 
-    char *escaped_path = db_url_escape(path);
-    char *url = (char *)malloc(strlen(URL_FILES) + strlen(DROPBOX_ROOT) + strlen(escaped_path) + 1);
-    sprintf(url, "%s%s%s", URL_FILES, DROPBOX_ROOT, escaped_path);
+void destroy_file_request(struct FileRequest *request) {
+    curl_easy_cleanup(request->curl);
+    cleanup_arena(&request->arena);
+    free(request);
+}
 
-    long int http_status;
-    cJSON *error = NULL;
-
-    CURLcode ret = dbapi_range_request(
-            curl, url, "GET", request_args, range_start, range_end,
-            &http_status, response_buffer, response_size, &error
-            );
-
-    free(escaped_path);
-    free(url);
-    free(request_args);
-    // TODO(ZM): might want to propagate or print this error
-    if (error) cJSON_Delete(error);
-    return ((ret == CURLE_OK) && ((http_status == HTTP_OK) || (http_status == HTTP_PARTIAL_CONTENT))) ? 0 : -1;
+/// start_file_request()
+///     Sets up request for range of file and returns its handle, request is performed
+///     by adding the handle to a curl multi handle. Received data is passed to
+///     write_function with write_data.
+CURL *start_file_request(struct FileRequest *request, char *path, char *rev, int64_t range_start, int64_t range_end,
+        long int timeout_msec, int fresh_connection, dbapi_write_callback write_function, void *write_data) {
+    struct Arena *arena = &request->arena;
+    char *request_args = arena_sprintf(arena, "rev=%s", rev);
+    char *url = arena_sprintf(arena, "%s%s%s", URL_FILES, DROPBOX_ROOT, db_url_escape(arena, path));
+    dbapi_sign_request(request->curl, arena, url, "GET", request_args);
+
+    // offsets of files over 4 GB do not fit in long on 32-bit targets
+    char range[2 * 20 + 2];
+    sprintf(range, "%" PRId64 "-%" PRId64, range_start, range_end - 1);
+    curl_easy_setopt(request->curl, CURLOPT_RANGE, range);
+    curl_easy_setopt(request->curl, CURLOPT_TIMEOUT_MS, timeout_msec);
+    curl_easy_setopt(request->curl, CURLOPT_FRESH_CONNECT, (long)fresh_connection);
+
+    request->range_start = range_start;
+    request->http_status = 0;
+    request->write_function = write_function;
+    request->write_data = write_data;
+    memset(&request->error, 0, sizeof(struct ResponseBuffer));
+    request->error.arena = arena;
+    return request->curl;
+}
+
+/// finish_file_request()
+///     Called once transfer of request is done with its result, returns REQUEST_OK if
+///     the whole range was received and class of the error otherwise
+enum RequestError finish_file_request(struct FileRequest *request, CURLcode result, long int *retry_after) {
+    long int http_status = 0;
+    *retry_after = 0;
+    if (result == CURLE_OK) {
+        curl_easy_getinfo(request->curl, CURLINFO_RESPONSE_CODE, &http_status);
+#if LIBCURL_VERSION_NUM >= 0x074200
+        curl_off_t retry_after_header = 0;
+        curl_easy_getinfo(request->curl, CURLINFO_RETRY_AFTER, &retry_after_header);
+        *retry_after = (long int)retry_after_header;
+#endif
+    } else {
+        printf("[ERROR] DBApi GET request failed, error code: %u, error msg: %s\n", result, curl_easy_strerror(result));
+    }
+
+    enum RequestError error;
+    if (result != CURLE_OK) {
+        error = REQUEST_TRANSPORT_ERROR;
+    } else if ((http_status == HTTP_PARTIAL_CONTENT) || ((http_status == HTTP_OK) && (request->range_start == 0))) {
+        error = REQUEST_OK;
+    } else if ((http_status == HTTP_TOO_MANY_REQUESTS) || ((http_status == HTTP_UNAVAILABLE) && (*retry_after > 0))) {
+        error = REQUEST_RATE_LIMITED;
+    } else if ((http_status >= HTTP_CLIENT_ERROR) && (http_status < HTTP_SERVER_ERROR)) {
+        error = REQUEST_CLIENT_ERROR;
+    } else {
+        error = REQUEST_SERVER_ERROR;
+    }
+    if ((result == CURLE_OK) && (error != REQUEST_OK)) {
+        printf("[ERROR] DBApi file request failed, http status code: %ld, retry after: %ld, error: %.*s\n",
+                http_status, *retry_after, (int)request->error.size, (request->error.data ? request->error.data : ""));
+    }
+
+    finish_request(REQUEST_FILE, &request->arena);
+    return error;
+}
+
+void cancel_file_request(struct FileRequest *request) {
+    finish_request(REQUEST_FILE, &request->arena);
 }
 
 void update_cursor(char *new_cursor) {
@@ -217,110 +409,152 @@ void update_cursor(char *new_cursor) {
     memcpy(dbapi_cursor, new_cursor, cursor_length);
 }
 
-int dbapi_update() {
+struct DeltaStream {
+    CURL *curl;
     long int http_status;
-    cJSON *result;
-    int ret = dbapi_delta(dbapi_curl, dbapi_cursor, &http_status, &result);
+    struct DeltaParser parser;
 
-    int update_more = 0;
-    if (ret == 0) {
-        int reset        = cJSON_GetObjectItem(result, "reset")->valueint;
-        int has_more     = cJSON_GetObjectItem(result, "has_more")->valueint;
-        char *new_cursor = cJSON_GetObjectItem(result, "cursor")->valuestring;
+    // body of failed request, it is JSON with error description
+    struct ResponseBuffer error;
+};
 
-        if (reset) {
-            // remove all file entries from local state
-            remove_all_file_entries();
-        }
+size_t delta_stream_write(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    struct DeltaStream *stream = (struct DeltaStream *)userdata;
+    if (stream->http_status == 0) {
+        // headers are already received when body starts
+        curl_easy_getinfo(stream->curl, CURLINFO_RESPONSE_CODE, &stream->http_status);
+    }
 
-        if (has_more) {
-            update_more = 1;
-        }
+    if (stream->http_status == HTTP_OK) {
+        // invalid response aborts the download
+        return (feed_delta_parser(&stream->parser, ptr, size * nmemb) == 0) ? (size * nmemb) : 0;
+    } else {
+        return response_buffer_write(ptr, size, nmemb, &stream->error);
+    }
+}
 
-        cJSON *entries = cJSON_GetObjectItem(result, "entries");
-        int nentries = cJSON_GetArraySize(entries);
-        printf("[DEBUG] DBApi DELTA request, reset: %d, has_more: %d, entries: %d, cursor:\n%s\n",
-                reset, has_more, nentries, new_cursor);
-        for (int i = 0; i < nentries; i++) {
-            cJSON *entry = cJSON_GetArrayItem(entries, i);
-
-            char *path = cJSON_GetArrayItem(entry, 0)->valuestring;
-            cJSON *metadata = cJSON_GetArrayItem(entry, 1);
-
-            utf16_t *utf16path;
-            size_t utf16path_chars;
-            utf8_to_utf16(strlen(path), path, &utf16path_chars, &utf16path);
-
-            if (metadata->type == cJSON_Object) {
-                struct DBMetaData dbmetadata;
-                dbmetadata.is_dir = (uint8_t)cJSON_GetObjectItem(metadata, "is_dir")->valueint;
-                dbmetadata.mtime = (uint32_t)cJSON_GetObjectItem(metadata, "modified")->valuedouble;
-                strcpy((char *)dbmetadata.rev, cJSON_GetObjectItem(metadata, "rev")->valuestring);
-
-                double size_double = cJSON_GetObjectItem(metadata, "bytes")->valuedouble;
-                if (size_double > FAT_MAX_FILE_SIZE) {
-                    // truncate files that are larger than what is supported by FAT
-                    dbmetadata.size = FAT_MAX_FILE_SIZE;
-                } else {
-                    dbmetadata.size = (uint32_t)size_double;
-                }
-
-                printf("ENTRY: %s\tis_dir: %u\tmtime: %u\tsize: %u, rev: %s\n",
-                        path, dbmetadata.is_dir, dbmetadata.mtime, dbmetadata.size, dbmetadata.rev);
-                add_file_entry(utf16path_chars, utf16path, &dbmetadata);
-            } else {
-                printf("ENTRY: %s\tremoved\n", path);
-                remove_file_entry(utf16path_chars, utf16path);
-            }
+void stage_delta_entries(struct FileEntryChange *changes, uint32_t change_count, void *callback_data) {
+    stage_file_entries(changes, change_count);
+}
 
-            free(utf16path);
-        }
+// parser has a whole batch of entries, it does not fit on stack of dbapi thread and
+// it is kept for the next request with its buffers
+struct DeltaStream *dbapi_delta_stream = NULL;
 
-        // update the dbapi_cursor
-        update_cursor(new_cursor);
+/// dbapi_delta()
+///     Requests the next delta page and applies its entries while it is received,
+///     page is published once it is complete. Returns 0 on success and sets has_more.
+int dbapi_delta(CURL *curl, char *cursor, int *has_more) {
+    char *request_args = arena_sprintf(get_request_arena(), "cursor=%s", cursor);
 
-        cJSON_Delete(result);
-    } else {
-        update_more = 2;
+    if (dbapi_delta_stream == NULL) {
+        dbapi_delta_stream = (struct DeltaStream *)malloc(sizeof(struct DeltaStream));
+        assert(dbapi_delta_stream != NULL);
+        init_delta_parser(&dbapi_delta_stream->parser, stage_delta_entries, NULL);
+    }
+    struct DeltaStream *stream = dbapi_delta_stream;
+    stream->curl = curl;
+    stream->http_status = 0;
+    memset(&stream->error, 0, sizeof(struct ResponseBuffer));
+    stream->error.arena = get_request_arena();
+    reset_delta_parser(&stream->parser);
+
+    begin_file_entries();
+    long int http_status;
+    CURLcode ret = dbapi_perform(curl, URL_DELTA, "POST", NULL, request_args, REQUEST_TIMEOUT,
+        delta_stream_write, stream, &http_status);
+
+    int success = 0;
+    if ((ret == CURLE_OK) && (http_status == HTTP_OK)) {
+        success = (finish_delta_parser(&stream->parser) == 0);
+    } else if (ret == CURLE_OK) {
+        printf("[ERROR] DBApi delta request failed, http status code: %ld, error: %.*s\n",
+                http_status, (int)stream->error.size, (stream->error.data ? stream->error.data : ""));
+    }
+
+    if (success) {
+        struct DeltaParser *parser = &stream->parser;
+        printf("[DEBUG] DBApi DELTA request, reset: %d, has_more: %d, entries: %u, cursor:\n%s\n",
+                parser->reset, parser->has_more, parser->entry_count, parser->cursor);
+        // readers see reset and all entries of the page at once
+        commit_file_entries(parser->cursor, (uint8_t)parser->reset, (uint8_t)parser->has_more);
+        update_cursor(parser->cursor);
+        *has_more = parser->has_more;
     }
 
-    return update_more;
+    finish_request(REQUEST_DELTA, get_request_arena());
+    return success ? 0 : -1;
 }
 
+int dbapi_update() {
+    int has_more = 0;
+    if (dbapi_delta(dbapi_curl, dbapi_cursor, &has_more) < 0) {
+        return 2;
+    }
+    return has_more ? 1 : 0;
+}
+
+/// dbapi_thread()
+///     Keeps image up to date, enumerates all pages of delta and then waits for
+///     changes with longpoll_delta, each page is published as soon as it is applied
 void *dbapi_thread(void *args) {
+    time_t snapshot_time = time(NULL);
     while (1) {
         int update_more = dbapi_update();
-        switch (update_more) {
-            case 0:
-            case 2:
-                sleep(600);
-                break;
+        if ((update_more != 2) && (time(NULL) - snapshot_time >= SNAPSHOT_INTERVAL)) {
+            save_file_entries();
+            snapshot_time = time(NULL);
+        }
+        if (update_more == 1) {
+            continue;
+        }
+        if (update_more == 2) {
+            sleep(DELTA_RETRY_INTERVAL);
+            continue;
+        }
+
+        int changes = 0;
+        while (changes == 0) {
+            long int backoff;
+            changes = dbapi_longpoll_delta(dbapi_curl, dbapi_cursor, &backoff);
+            if (changes < 0) {
+                // cursor may be invalid too, delta request resets it then
+                sleep(DELTA_RETRY_INTERVAL);
+            } else if (backoff > 0) {
+                sleep(backoff);
+            }
         }
     }
+    return NULL;
 }
 
+/// start_dbapi_thread()
+///     Starts thread that populates image in background, must be called after FUSE
+///     daemonizes as threads do not survive fork. Delta continues from the cursor of
+///     restored snapshot.
 void start_dbapi_thread() {
-    // instead of starting api thread just do deltas
     curl_global_init(CURL_GLOBAL_ALL);
+    cJSON_Hooks hooks = { request_arena_malloc, request_arena_free };
+    cJSON_InitHooks(&hooks);
     dbapi_curl = curl_easy_init();
-    dbapi_cursor = calloc(1, sizeof(char));
+    dbapi_cursor = get_delta_cursor();
 
     CONSUMER_KEY    = CONSUMER_KEY_APP_FOLDER;
     CONSUMER_SECRET = CONSUMER_SECRET_APP_FOLDER;
 
-    while (dbapi_update() == 1) {
-    }
-    //pthread_attr_t attr;
-    //pthread_attr_init(&attr);
-    //pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-    //pthread_attr_setstacksize(&attr, 128 * 1024);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, 128 * 1024);
 
-    //pthread_t thread;
-    //pthread_create(&thread, &attr, dbapi_thread, NULL);
+    pthread_t thread;
+    pthread_create(&thread, &attr, dbapi_thread, NULL);
 }
 
 void dbapi_test() {
     curl_global_init(CURL_GLOBAL_ALL);
+    cJSON_Hooks hooks = { request_arena_malloc, request_arena_free };
+    cJSON_InitHooks(&hooks);
     dbapi_curl = curl_easy_init();
     dbapi_cursor = calloc(1, sizeof(char));
 
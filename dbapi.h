@@ -7,6 +7,53 @@
 void start_dbapi_thread();
 void dbapi_test();
 
-int dbapi_get_file(CURL *curl, char *path, char *rev, long int range_start, long int range_end,
-        char **response_buffer, size_t *response_size);
+enum RequestType {
+    REQUEST_DELTA,
+    REQUEST_LONGPOLL,
+    REQUEST_FILE,
+    REQUEST_TYPES,
+};
+
+// Allocations made by requests of one type, they are all freed when request finishes
+struct RequestStats {
+    uint64_t requests;
+    uint64_t allocations;       // allocations from request arena
+    uint64_t allocated_bytes;
+    uint64_t heap_allocations;  // arena blocks that had to be allocated from heap
+};
+
+void get_request_stats(enum RequestType type, struct RequestStats *stats);
+
+// Called with every received chunk of file data, returns number of bytes consumed.
+// Returning less than size aborts the download.
+typedef size_t (*dbapi_write_callback)(char *data, size_t size, void *write_data);
+
+// Download of a range of file that is performed through curl multi interface, so
+// one thread can keep many of them in flight. Request is reused for any number of
+// downloads, one at a time.
+struct FileRequest;
+
+// Failures are classified by what retrying them can achieve
+enum RequestError {
+    REQUEST_OK = 0,
+    REQUEST_TRANSPORT_ERROR,    // connection failed, broke or timed out
+    REQUEST_SERVER_ERROR,       // 5xx or unexpected response, may succeed later
+    REQUEST_RATE_LIMITED,       // 429, or 503 with Retry-After, all requests should wait
+    REQUEST_CLIENT_ERROR,       // other 4xx, request fails the same way again
+};
+
+struct FileRequest *create_file_request();
+void destroy_file_request(struct FileRequest *request);
+
+// Returns handle to add to curl multi handle, the same one every time. Request fails
+// after timeout_msec. Hedged requests set fresh_connection, so they do not share
+// connection with the request they duplicate.
+CURL *start_file_request(struct FileRequest *request, char *path, char *rev, int64_t range_start, int64_t range_end,
+        long int timeout_msec, int fresh_connection, dbapi_write_callback write_function, void *write_data);
+// result is from CURLMSG_DONE message of the handle, retry_after is set to seconds
+// the server asks to wait, or 0
+enum RequestError finish_file_request(struct FileRequest *request, CURLcode result, long int *retry_after);
+// Ends request whose handle was removed from multi handle before it was done
+void cancel_file_request(struct FileRequest *request);
+
 #endif
@@ -16,7 +16,56 @@
 #include "dbfiles.h"
 
 const char *DBBOX_PATH = "/dbbox.img";
-const off_t DBBOX_SIZE = (off_t)BPB_TotalSectors * (off_t)BPB_BytesPerSector;
+off_t DBBOX_SIZE; // set once volume geometry is known
+
+// text file with cache counters, it is opened with direct_io so its size does not matter
+const char *DBBOX_STATS_PATH = "/dbbox.stats";
+#define DBBOX_STATS_SIZE 2048
+
+const char *REQUEST_TYPE_NAMES[REQUEST_TYPES] = { "delta", "longpoll", "file" };
+
+int format_dbbox_stats(char *buf, size_t size)
+{
+    struct FileCacheStats stats;
+    get_file_cache_stats(&stats);
+    int len = snprintf(buf, size,
+            "block_reads: %llu\n"
+            "block_misses: %llu\n"
+            "readahead_blocks: %llu\n"
+            "readahead_used: %llu\n"
+            "readahead_wasted: %llu\n"
+            "coalesced_blocks: %llu\n"
+            "retried_blocks: %llu\n"
+            "failed_blocks: %llu\n"
+            "hedged_requests: %llu\n"
+            "hedge_wins: %llu\n",
+            (unsigned long long)stats.block_reads,
+            (unsigned long long)stats.block_misses,
+            (unsigned long long)stats.readahead_blocks,
+            (unsigned long long)stats.readahead_used,
+            (unsigned long long)stats.readahead_wasted,
+            (unsigned long long)stats.coalesced_blocks,
+            (unsigned long long)stats.retried_blocks,
+            (unsigned long long)stats.failed_blocks,
+            (unsigned long long)stats.hedged_requests,
+            (unsigned long long)stats.hedge_wins);
+    for (int type = 0; type < REQUEST_TYPES; type++) {
+        struct RequestStats request_stats;
+        get_request_stats(type, &request_stats);
+        const char *name = REQUEST_TYPE_NAMES[type];
+        len += snprintf(&buf[len], size - len,
+                "%s_requests: %llu\n"
+                "%s_allocations: %llu\n"
+                "%s_allocated_bytes: %llu\n"
+                "%s_heap_allocations: %llu\n",
+                name, (unsigned long long)request_stats.requests,
+                name, (unsigned long long)request_stats.allocations,
+                name, (unsigned long long)request_stats.allocated_bytes,
+                name, (unsigned long long)request_stats.heap_allocations);
+    }
+    assert((len >= 0) && (len < size));
+    return len;
+}
 
 static int dbbox_getattr(const char *path, struct stat *stbuf)
 {
@@ -36,6 +85,11 @@ static int dbbox_getattr(const char *path, struct stat *stbuf)
         stbuf->st_atime = time(NULL);
         stbuf->st_mtime = time(NULL);
         stbuf->st_ctime = time(NULL);
+    } else if (strcmp(path, DBBOX_STATS_PATH) == 0) {
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = 0;
+        stbuf->st_mtime = time(NULL);
     } else {
         res = -ENOENT;
     }
@@ -60,12 +114,15 @@ static int dbbox_readdir(
     filler(buf, ".", NULL, 0);
     filler(buf, "..", NULL, 0);
     filler(buf, &DBBOX_PATH[1], NULL, 0);
+    filler(buf, &DBBOX_STATS_PATH[1], NULL, 0);
     return 0;
 }
 
 static int dbbox_open(const char *path, struct fuse_file_info *fi)
 {
-    if (strcmp(path, DBBOX_PATH) != 0) {
+    if (strcmp(path, DBBOX_STATS_PATH) == 0) {
+        fi->direct_io = 1;
+    } else if (strcmp(path, DBBOX_PATH) != 0) {
         return -ENOENT;
     }
 
@@ -84,6 +141,19 @@ static int dbbox_read(
         struct fuse_file_info *fi)
 {
     (void) fi;
+    if (strcmp(path, DBBOX_STATS_PATH) == 0) {
+        char stats[DBBOX_STATS_SIZE];
+        int len = format_dbbox_stats(stats, DBBOX_STATS_SIZE);
+        if (offset >= len) {
+            return 0;
+        }
+        if (offset + size > len) {
+            size = len - offset;
+        }
+        memcpy(buf, &stats[offset], size);
+        return size;
+    }
+
     if(strcmp(path, DBBOX_PATH) != 0) {
         return -ENOENT;
     }
@@ -92,11 +162,11 @@ static int dbbox_read(
         if (offset + size > DBBOX_SIZE) {
             size = DBBOX_SIZE - offset;
         }
-        int r = read_data((uint32_t)offset, (uint32_t)size, (uint8_t *)buf);
+        int r = read_data((uint64_t)offset, (uint32_t)size, (uint8_t *)buf);
         if (r != 0) {
-            // TODO(ZM): choose better error code, or maybe even customize error codes
-            // based on failure
-            return -EBUSY;
+            // download of the data was given up or did not finish before deadline,
+            // hosts retry EBUSY reads forever but report EIO to the user
+            return -EIO;
         }
     } else{
         size = 0;
@@ -105,7 +175,29 @@ static int dbbox_read(
     return size;
 }
 
+/// dbbox_init()
+///     Starts background threads, FUSE calls it after it daemonizes so that they are
+///     not lost in fork. Image is served from the start and fills in as delta pages
+///     are applied.
+static void *dbbox_init(struct fuse_conn_info *conn)
+{
+    (void) conn;
+    initialize_file_cache();
+    start_dbapi_thread();
+    return NULL;
+}
+
+/// dbbox_destroy()
+///     Saves snapshot of file entries on unmount for the next start
+static void dbbox_destroy(void *private_data)
+{
+    (void) private_data;
+    save_file_entries();
+}
+
 static struct fuse_operations dbbox_oper = {
+    .init    = dbbox_init,
+    .destroy = dbbox_destroy,
     .getattr = dbbox_getattr,
     .readdir = dbbox_readdir,
     .open    = dbbox_open,
@@ -118,8 +210,9 @@ int main(int argc, char *argv[])
     assert(sizeof(off_t) == 8);
 
     initialize_dbfat();
-    initialize_file_cache();
+    // image is served from the last saved state until delta catches up
+    load_file_entries();
+    DBBOX_SIZE = (off_t)BPB_TotalSectors * (off_t)BPB_BytesPerSector;
     //add_test_data();
-    start_dbapi_thread();
     return fuse_main(argc, argv, &dbbox_oper, NULL);
 }
@@ -5,33 +5,97 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include <iconv.h>
 #include <pthread.h>
 
 #include "dbapi.h"
 #include "dbfat.h"
 #include "dbfiles.h"
 #include "cluster.h"
+#include "epoch.h"
+#include "exfat.h"
+#include "snapshot.h"
+#include "utf.h"
 
 // Directory Entries
 struct DirEntry *ROOT_DIR_ENTRY;
-pthread_rwlock_t dbfat_rwlock;
+uint32_t NEXT_FILE_ID = 1;
+
+// Readers never lock, they read published image version in CURRENT_VIEW while
+// writer changes directory tree and cluster map for the next one. Entries changed
+// since last publish are linked in STALE_ENTRIES.
+pthread_mutex_t dbfat_write_lock;
+struct ImageView *CURRENT_VIEW = NULL;
+struct DirEntry *STALE_ENTRIES = NULL;
+// delta cursor of the last applied page, changed together with directory tree so
+// that snapshot always has cursor that matches its entries
+char *DELTA_CURSOR = NULL;
+// generation of delta pages being applied, entries listed by them are stamped with
+// it so that reset can drop the others. Reset listing spans pages until the one
+// without has_more, generation stays the same for all of them.
+uint32_t DELTA_GENERATION = 0;
+uint8_t RESET_PENDING = 0;
+
+// Directories on the path of the last added or removed entry. Delta pages list
+// siblings and children of a directory next to each other, so the next path usually
+// continues from one of these instead of from ROOT_DIR_ENTRY. Entries are only
+// retired when removed, so cursor stays valid until the next publish resets it.
+struct PathCursor {
+    utf16_t *path;                  // path of the last entry
+    uint32_t path_capacity;
+    struct DirEntry **dir_entries;  // directory at each depth, root is depth 0
+    uint32_t *path_ends;            // index of separator after directory at each depth
+    uint32_t depth;                 // number of directories below root on the path
+    uint32_t depth_capacity;
+};
+
+struct PathCursor PATH_CURSOR;
 
 void initialize_dbfat() {
+    initialize_geometry();
+
     // initialize DIR_ENTRIES and ROOT directory entry
     ROOT_DIR_ENTRY = (struct DirEntry *)malloc(sizeof(struct DirEntry));
     memset(ROOT_DIR_ENTRY, 0, sizeof(struct DirEntry));
     ROOT_DIR_ENTRY->first_cluster = BPB_RootCluster;
     ROOT_DIR_ENTRY->metadata.is_dir = 1;
     initialize_clusters(ROOT_DIR_ENTRY);
+    invalidate_entry_view(ROOT_DIR_ENTRY);
+    if (IMAGE_FORMAT == IMAGE_FORMAT_EXFAT) {
+        ROOT_DIR_ENTRY->metadata.size = EXFAT_ROOT_ENTRIES_SIZE;
+        initialize_exfat();
+    }
 
-    pthread_rwlock_init(&dbfat_rwlock, NULL);
+    pthread_mutex_init(&dbfat_write_lock, NULL);
+    DELTA_CURSOR = strdup("");
+    initialize_snapshot();
+    publish_file_entries();
 }
 
 void cleanup_dbfat() {
     remove_all_file_entries();
-    pthread_rwlock_destroy(&dbfat_rwlock);
+    publish_file_entries();
+    free(ROOT_DIR_ENTRY->view->dir_image);
+    free(ROOT_DIR_ENTRY->view);
+    ROOT_DIR_ENTRY->view = NULL;
+    free(ROOT_DIR_ENTRY->child_index);
+    ROOT_DIR_ENTRY->child_index = NULL;
+    free(CURRENT_VIEW->cluster_pages);
+    free(CURRENT_VIEW);
+    CURRENT_VIEW = NULL;
+    pthread_mutex_destroy(&dbfat_write_lock);
+    if (IMAGE_FORMAT == IMAGE_FORMAT_EXFAT) {
+        cleanup_exfat();
+    }
     cleanup_clusters();
+    free(PATH_CURSOR.path);
+    free(PATH_CURSOR.dir_entries);
+    free(PATH_CURSOR.path_ends);
+    memset(&PATH_CURSOR, 0, sizeof(struct PathCursor));
+    free(DELTA_CURSOR);
+    DELTA_CURSOR = NULL;
+    free(ROOT_DIR_ENTRY->extents);
+    ROOT_DIR_ENTRY->extents = NULL;
+    cleanup_epochs();
 }
 
 /// name_checksum()
@@ -62,9 +126,18 @@ uint16_t get_wrt_time(uint32_t epoch) {
 }
 
 uint32_t get_entry_size(struct EntryMetaData *metadata) {
+    if (IMAGE_FORMAT == IMAGE_FORMAT_EXFAT) {
+        return get_exfat_entry_size(metadata);
+    }
     return (((metadata->name_chars + LONG_NAME_CHARS_PER_ENTRY - 1) / LONG_NAME_CHARS_PER_ENTRY) + 1) * DIR_ENTRY_SIZE;
 }
 
+/// get_empty_dir_size()
+///     FAT32 directories start with "dot" and "dotdot" entries, exFAT ones are empty
+uint32_t get_empty_dir_size() {
+    return (IMAGE_FORMAT == IMAGE_FORMAT_EXFAT) ? 0 : 2 * DIR_ENTRY_SIZE;
+}
+
 void _short_name_helper(struct EntryMetaData *metadata, uint32_t *short_index, uint32_t *long_index, uint8_t max_short_index) {
     while ((*short_index < max_short_index) && (*long_index < metadata->name_chars)) {
         if (metadata->name[*long_index] == PATH_DOT) {
@@ -122,35 +195,215 @@ void set_short_name(struct DirEntry *dir_entry, struct EntryMetaData *metadata)
         short_index++;
     }
 
-    printf("[DEBUG] Generated Short Name: %.11s\n", metadata->short_name);
-
     metadata->name_checksum = name_checksum(metadata->short_name);
 }
 
-struct DirEntry * add_child_entry(struct DirEntry *dir_entry, struct EntryMetaData *metadata) {
-    // extend dir_entry if necessary to accomodate for extra entry_extra_size bytes
-    uint32_t entry_extra_size = get_entry_size(metadata);
-    uint32_t last_cluster_size = (dir_entry->metadata.size % BYTES_PER_CLUSTER);
-    dir_entry->metadata.size += entry_extra_size;
-    if ((last_cluster_size + entry_extra_size) > BYTES_PER_CLUSTER) {
-        // extend dir_entry cluster chain
+/// invalidate_entry_view()
+///     Marks view of dir_entry stale, it is rebuilt when next image version is published.
+///     Must be called whenever anything readers see in its view changes, including
+///     contents of directory.
+void invalidate_entry_view(struct DirEntry *dir_entry) {
+    if (!dir_entry->is_stale) {
+        dir_entry->is_stale = 1;
+        dir_entry->stale_next = STALE_ENTRIES;
+        STALE_ENTRIES = dir_entry;
+    }
+}
+
+/// invalidate_dir_entry()
+///     Marks stale view of dir_entry and of all directories whose images contain short
+///     entry of dir_entry, called when its first cluster, size or time changes. For
+///     directories that also includes their own "dot" entry and "dotdot" entries of
+///     their subdirectories.
+void invalidate_dir_entry(struct DirEntry *dir_entry) {
+    invalidate_entry_view(dir_entry);
+    if (dir_entry->parent != NULL) {
+        invalidate_entry_view(dir_entry->parent);
+    }
+    if (dir_entry->metadata.is_dir == 1) {
+        for (struct DirEntry *child = dir_entry->child; child != NULL; child = child->next) {
+            if (child->metadata.is_dir == 1) {
+                invalidate_entry_view(child);
+            }
+        }
+    }
+}
+
+void free_dir_entry(void *ptr) {
+    struct DirEntry *dir_entry = (struct DirEntry *)ptr;
+    free(dir_entry->metadata.name);
+    free(dir_entry->utf8path);
+    free(dir_entry);
+}
+
+/// retire_dir_entry()
+///     Frees removed dir_entry once readers of published versions that still have it
+///     are done. Until then they can use its name and path and even cache its path.
+void retire_dir_entry(struct DirEntry *dir_entry) {
+    dir_entry->is_removed = 1;
+    if (dir_entry->view != NULL) {
+        retire_memory(dir_entry->view->dir_image);
+        retire_memory(dir_entry->view);
+    }
+    free(dir_entry->child_index);
+    dir_entry->child_index = NULL;
+    retire_object(dir_entry, free_dir_entry);
+}
+
+uint32_t get_name_hash(uint8_t name_chars, utf16_t *name) {
+    // FNV-1a over case folded name
+    uint32_t hash = 2166136261u;
+    for (uint8_t i = 0; i < name_chars; i++) {
+        utf16_t c = utf16_fold_case(name[i]);
+        hash = (hash ^ (c & 0xFF)) * 16777619u;
+        hash = (hash ^ (c >> 8)) * 16777619u;
+    }
+    return hash;
+}
+
+int names_equal(uint8_t name_chars, utf16_t *name, uint8_t other_name_chars, utf16_t *other_name) {
+    if (name_chars != other_name_chars) {
+        return 0;
+    }
+    for (uint8_t i = 0; i < name_chars; i++) {
+        if ((name[i] != other_name[i]) &&
+                (utf16_fold_case(name[i]) != utf16_fold_case(other_name[i]))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/// index_child_entry()
+///     Adds child_entry to hash index of dir_entry, index doubles in size when it
+///     has more entries than buckets.
+void index_child_entry(struct DirEntry *dir_entry, struct DirEntry *child_entry) {
+    uint32_t bucket_count = (dir_entry->child_index == NULL) ? 0 : (dir_entry->child_index_mask + 1);
+    if (dir_entry->child_count + 1 > bucket_count) {
+        uint32_t new_bucket_count = (bucket_count == 0) ? 8 : (bucket_count * 2);
+        struct DirEntry **new_index = (struct DirEntry **)calloc(new_bucket_count, sizeof(struct DirEntry *));
+        assert(new_index != NULL);
+        for (uint32_t i = 0; i < bucket_count; i++) {
+            struct DirEntry *entry = dir_entry->child_index[i];
+            while (entry != NULL) {
+                struct DirEntry *entry_next = entry->hash_next;
+                struct DirEntry **bucket = &new_index[entry->name_hash & (new_bucket_count - 1)];
+                entry->hash_next = *bucket;
+                *bucket = entry;
+                entry = entry_next;
+            }
+        }
+        free(dir_entry->child_index);
+        dir_entry->child_index = new_index;
+        dir_entry->child_index_mask = new_bucket_count - 1;
+    }
+
+    struct DirEntry **bucket = &dir_entry->child_index[child_entry->name_hash & dir_entry->child_index_mask];
+    child_entry->hash_next = *bucket;
+    *bucket = child_entry;
+    dir_entry->child_count++;
+}
+
+void unindex_child_entry(struct DirEntry *dir_entry, struct DirEntry *child_entry) {
+    struct DirEntry **bucket = &dir_entry->child_index[child_entry->name_hash & dir_entry->child_index_mask];
+    while (*bucket != child_entry) {
+        assert(*bucket != NULL);
+        bucket = &(*bucket)->hash_next;
+    }
+    *bucket = child_entry->hash_next;
+    child_entry->hash_next = NULL;
+    dir_entry->child_count--;
+}
+
+/// resize_dir_entry()
+///     Fits cluster chain of directory to its size. Directories are resized only when
+///     image is published, a batch of entries added to a directory extends its chain once.
+void resize_dir_entry(struct DirEntry *dir_entry) {
+    struct ClusterExtent *last = &dir_entry->extents[dir_entry->extent_count - 1];
+    if (get_chain_clusters(dir_entry->metadata.size) != last->ordinal + last->clusters) {
+        // exFAT entry of directory also has size of its chain so the entry changes
+        // even if first cluster stays the same
         dir_entry->first_cluster = reallocate_cluster_chain(dir_entry->first_cluster, dir_entry->metadata.size);
+        invalidate_dir_entry(dir_entry);
     }
+}
 
-    struct DirEntry *new_dir_entry = (struct DirEntry *)malloc(sizeof(struct DirEntry));
-    memcpy(&new_dir_entry->metadata, metadata, sizeof(struct EntryMetaData));
-    set_short_name(dir_entry, &new_dir_entry->metadata);
+struct DirEntry * new_dir_entry(struct EntryMetaData *metadata, uint32_t file_id) {
+    struct DirEntry *dir_entry = (struct DirEntry *)malloc(sizeof(struct DirEntry));
+    assert(dir_entry != NULL);
+    memcpy(&dir_entry->metadata, metadata, sizeof(struct EntryMetaData));
+    dir_entry->file_id = file_id;
+    dir_entry->utf8path = NULL;
+    dir_entry->utf8path_size = 0;
+    dir_entry->view = NULL;
+    dir_entry->stale_next = NULL;
+    dir_entry->is_stale = 0;
+    dir_entry->is_removed = 0;
+    dir_entry->delta_generation = DELTA_GENERATION;
+    dir_entry->child_index = NULL;
+    dir_entry->child_index_mask = 0;
+    dir_entry->child_count = 0;
+    dir_entry->extents = NULL;
+    dir_entry->extent_count = 0;
+    dir_entry->parent = NULL;
+    dir_entry->next = NULL;
+    dir_entry->prev = NULL;
+    dir_entry->child = NULL;
+    dir_entry->name_hash = get_name_hash(metadata->name_chars, metadata->name);
+    return dir_entry;
+}
 
+/// link_child_entry()
+///     Adds child_entry to the front of children of dir_entry and to its index
+void link_child_entry(struct DirEntry *dir_entry, struct DirEntry *child_entry) {
     struct DirEntry *child = dir_entry->child;
-    dir_entry->child = new_dir_entry;
+    dir_entry->child = child_entry;
+    if (child != NULL) {
+        child->prev = child_entry;
+    }
+
+    child_entry->parent = dir_entry;
+    child_entry->next = child;
+    child_entry->prev = NULL;
+
+    index_child_entry(dir_entry, child_entry);
+}
+
+struct DirEntry * add_child_entry(struct DirEntry *dir_entry, struct EntryMetaData *metadata) {
+    // dir_entry is extended to fit the new entry when image is published
+    dir_entry->metadata.size += get_entry_size(metadata);
+    invalidate_entry_view(dir_entry);
 
-    new_dir_entry->parent = dir_entry;
-    new_dir_entry->next = child;
-    new_dir_entry->child = NULL;
+    struct DirEntry *child_entry = new_dir_entry(metadata, NEXT_FILE_ID++);
+    set_short_name(dir_entry, &child_entry->metadata);
+    link_child_entry(dir_entry, child_entry);
 
     // construct cluster chain
-    new_dir_entry->first_cluster = allocate_cluster_chain(new_dir_entry, new_dir_entry->metadata.size);
-    return new_dir_entry;
+    child_entry->first_cluster = allocate_cluster_chain(child_entry, child_entry->metadata.size);
+    invalidate_entry_view(child_entry);
+    return child_entry;
+}
+
+/// restore_child_entry()
+///     Adds child saved in snapshot. Unlike add_child_entry it keeps saved short name,
+///     file id and cluster chain so that image is the same as when it was saved, size
+///     of dir_entry must already include the child. Returns NULL if clusters of the
+///     chain are not free, metadata name is then still owned by caller.
+struct DirEntry * restore_child_entry(struct DirEntry *dir_entry, struct EntryMetaData *metadata, uint32_t file_id,
+        struct ClusterExtent *extents, uint32_t extent_count) {
+    struct DirEntry *child_entry = new_dir_entry(metadata, file_id);
+    if (restore_cluster_chain(child_entry, extents, extent_count) != 0) {
+        free(child_entry);
+        return NULL;
+    }
+    child_entry->first_cluster = child_entry->extents[0].first_cluster;
+    link_child_entry(dir_entry, child_entry);
+    invalidate_entry_view(dir_entry);
+    invalidate_entry_view(child_entry);
+    if (file_id >= NEXT_FILE_ID) {
+        NEXT_FILE_ID = file_id + 1;
+    }
+    return child_entry;
 }
 
 void remove_child_entry(struct DirEntry *dir_entry, struct DirEntry *child_entry) {
@@ -158,47 +411,46 @@ void remove_child_entry(struct DirEntry *dir_entry, struct DirEntry *child_entry
         // recursively remove all subfolders/files
         struct DirEntry *cc = child_entry->child;
         while (cc != NULL) {
+            struct DirEntry *cc_next = cc->next;
             remove_child_entry(child_entry, cc);
-            cc = cc->next;
+            cc = cc_next;
         }
     }
 
-    // TODO(zm): maybe directory structure should be doubly-linked list?
-    if (dir_entry->child == child_entry) {
-       dir_entry->child = child_entry->next;
+    if (child_entry->prev == NULL) {
+        assert(dir_entry->child == child_entry);
+        dir_entry->child = child_entry->next;
     } else {
-        struct DirEntry *cc = dir_entry->child;
-        while (cc->next != child_entry) {
-            assert(cc != NULL);
-            cc = cc->next;
-        }
-        cc->next = child_entry->next;
+        child_entry->prev->next = child_entry->next;
     }
-
-    // shrink dir_entry if necessary
-    uint32_t entry_extra_size = get_entry_size(&(child_entry->metadata));
-    uint32_t last_cluster_size = (dir_entry->metadata.size % BYTES_PER_CLUSTER);
-    dir_entry->metadata.size -= entry_extra_size;
-    if (last_cluster_size < entry_extra_size) {
-        // shrink dir_entry cluster chain
-        dir_entry->first_cluster = reallocate_cluster_chain(dir_entry->first_cluster, dir_entry->metadata.size);
+    if (child_entry->next != NULL) {
+        child_entry->next->prev = child_entry->prev;
     }
+    unindex_child_entry(dir_entry, child_entry);
+
+    // dir_entry is shrunk when image is published
+    dir_entry->metadata.size -= get_entry_size(&(child_entry->metadata));
+    invalidate_entry_view(dir_entry);
 
-    dir_entry->metadata.size += entry_extra_size;
     free_cluster_chain(child_entry->first_cluster);
-    free(child_entry->metadata.name);
-    free(child_entry);
+    retire_dir_entry(child_entry);
 }
 
+/// get_child_entry()
+///     Looks up child of dir_entry by name, names are compared case insensitively
+///     the same way as Dropbox and FAT compare them.
 struct DirEntry * get_child_entry(struct DirEntry *dir_entry, uint8_t name_chars, utf16_t *name) {
-    struct DirEntry *child_entry = dir_entry->child;
+    if (dir_entry->child_index == NULL) {
+        return NULL;
+    }
+    uint32_t name_hash = get_name_hash(name_chars, name);
+    struct DirEntry *child_entry = dir_entry->child_index[name_hash & dir_entry->child_index_mask];
     while (child_entry != NULL) {
-        if ((child_entry->metadata.name_chars == name_chars) &&
-            (memcmp(child_entry->metadata.name, name, name_chars * sizeof(utf16_t)) == 0)) {
+        if ((child_entry->name_hash == name_hash) &&
+                names_equal(child_entry->metadata.name_chars, child_entry->metadata.name, name_chars, name)) {
             return child_entry;
-        } else {
-            child_entry = child_entry->next;
         }
+        child_entry = child_entry->hash_next;
     }
     return NULL;
 }
@@ -250,8 +502,8 @@ uint32_t get_dir_contents(struct DirEntry *dir_entry, struct DirEntry *child_ent
         memcpy(&buf[buf_offset], long_entry, DIR_ENTRY_SIZE);
         buf_offset += DIR_ENTRY_SIZE;
 
-        name_offset -= LONG_NAME_CHARS_PER_ENTRY;
-        if (name_offset >= 0) {
+        if (entry_ord > 1) {
+            name_offset -= LONG_NAME_CHARS_PER_ENTRY;
             memcpy(wll, &child_entry->metadata.name[name_offset], LONG_NAME_CHARS_PER_ENTRY * sizeof(utf16_t));
         }
     }
@@ -278,23 +530,20 @@ uint32_t get_dir_contents(struct DirEntry *dir_entry, struct DirEntry *child_ent
     return buf_offset;
 }
 
-int read_dir_sector(struct DirEntry *dir_entry, uint32_t offset, uint8_t *buf) {
-    uint8_t tmp_buf[2 * BPB_BytesPerSector] = { 0x00 };
-    uint32_t buf_offset = 0;
-
-    // for non root dir_entry we have "dot" and "dotdot" entries
-    uint32_t child_offset = (dir_entry == ROOT_DIR_ENTRY) ? 0 : (2 * DIR_ENTRY_SIZE);
-    struct DirEntry *child_entry = dir_entry->child;
-    while ((child_entry != NULL) && (child_offset < offset)) {
-       uint32_t new_child_offset = child_offset + get_entry_size(&(child_entry->metadata));
-       if (new_child_offset > offset)
-           break;
-       child_offset = new_child_offset;
-       child_entry = child_entry->next;
-    }
-
-    if ((offset == 0) && (dir_entry != ROOT_DIR_ENTRY)) {
-        // write "dot" and "dotdot" entries
+/// render_dir_image()
+///     Builds contents of directory exactly as they are stored in its clusters
+uint8_t *render_dir_image(struct DirEntry *dir_entry) {
+    // empty root directory still needs an image to be read
+    uint8_t *image = (uint8_t *)malloc(dir_entry->metadata.size + 1);
+    assert(image != NULL);
+    uint32_t image_offset = 0;
+
+    if (IMAGE_FORMAT == IMAGE_FORMAT_EXFAT) {
+        if (dir_entry == ROOT_DIR_ENTRY) {
+            image_offset += get_exfat_root_contents(image);
+        }
+    } else if (dir_entry != ROOT_DIR_ENTRY) {
+        // for non root dir_entry we have "dot" and "dotdot" entries
         uint8_t dot_entry[DIR_ENTRY_SIZE] = {
             '.', ' ', ' ', ' ',
             ' ', ' ', ' ', ' ',
@@ -323,172 +572,266 @@ int read_dir_sector(struct DirEntry *dir_entry, uint32_t offset, uint8_t *buf) {
             UINT16_TOARRAY((dir_entry->parent == ROOT_DIR_ENTRY) ? 0 : (dir_entry->parent->first_cluster & 0xFFFF)),
             UINT32_TOARRAY(0x00),
         };
-        memcpy(&tmp_buf[buf_offset], dot_entry, DIR_ENTRY_SIZE);
-        buf_offset += DIR_ENTRY_SIZE;
-        memcpy(&tmp_buf[buf_offset], dotdot_entry, DIR_ENTRY_SIZE);
-        buf_offset += DIR_ENTRY_SIZE;
-    } else if ((child_entry != NULL) && (child_offset < offset)) {
-        const uint32_t offset_delta = offset - child_offset;
-        uint32_t entry_size = get_dir_contents(dir_entry, child_entry, tmp_buf);
-        assert(entry_size > offset_delta);
-
-        memmove(&tmp_buf[buf_offset], &tmp_buf[offset_delta], entry_size - offset_delta);
-        buf_offset += entry_size - offset_delta;
-        memset(&tmp_buf[buf_offset], 0, offset_delta);
-
-        child_entry = child_entry->next;
+        memcpy(&image[image_offset], dot_entry, DIR_ENTRY_SIZE);
+        image_offset += DIR_ENTRY_SIZE;
+        memcpy(&image[image_offset], dotdot_entry, DIR_ENTRY_SIZE);
+        image_offset += DIR_ENTRY_SIZE;
     }
 
-    while ((child_entry != NULL) && (buf_offset < BPB_BytesPerSector)) {
-        uint32_t entry_size = get_dir_contents(dir_entry, child_entry, &tmp_buf[buf_offset]);
-        buf_offset += entry_size;
-        child_entry = child_entry->next;
+    for (struct DirEntry *child_entry = dir_entry->child; child_entry != NULL; child_entry = child_entry->next) {
+        if (IMAGE_FORMAT == IMAGE_FORMAT_EXFAT) {
+            image_offset += get_exfat_dir_contents(child_entry, &image[image_offset]);
+        } else {
+            image_offset += get_dir_contents(dir_entry, child_entry, &image[image_offset]);
+        }
     }
-    printf("[DEBUG] Read Dir Sector: %u, %u, buf_offset: %u\n", dir_entry->first_cluster, offset, buf_offset);
-    memcpy(buf, tmp_buf, BPB_BytesPerSector);
-    return 0;
+    assert(image_offset == dir_entry->metadata.size);
+    return image;
 }
 
-void get_file_path(struct DirEntry *dir_entry, size_t *utf8path_size, char **utf8path) {
-    uint32_t path_chars = 0;
-    struct DirEntry *entry = dir_entry;
-    while (entry != ROOT_DIR_ENTRY) {
-        path_chars += (1 + entry->metadata.name_chars);
-        entry = entry->parent;
-    }
+/// get_file_path()
+///     Returns UTF-8 path of dir_entry. Path is built only once and then cached in
+///     dir_entry. Readers call it too, it only uses names and parents of entries
+///     which never change.
+char *get_file_path(struct DirEntry *dir_entry, size_t *utf8path_size) {
+    char *utf8path = __atomic_load_n(&dir_entry->utf8path, __ATOMIC_ACQUIRE);
+    if (utf8path == NULL) {
+        uint32_t path_chars = 0;
+        struct DirEntry *entry = dir_entry;
+        while (entry != ROOT_DIR_ENTRY) {
+            path_chars += (1 + entry->metadata.name_chars);
+            entry = entry->parent;
+        }
 
-    utf16_t *path = (utf16_t *)malloc(path_chars * sizeof(utf16_t));
+        utf16_t *path = (utf16_t *)malloc(path_chars * sizeof(utf16_t));
 
-    uint32_t current_pos = path_chars;
-    entry = dir_entry;
-    while (entry != ROOT_DIR_ENTRY) {
-        current_pos -= (1 + entry->metadata.name_chars);
-        path[current_pos] = PATH_SEPARATOR;
-        memcpy(&path[current_pos + 1], entry->metadata.name, entry->metadata.name_chars * sizeof(utf16_t));
-        entry = entry->parent;
-    }
+        uint32_t current_pos = path_chars;
+        entry = dir_entry;
+        while (entry != ROOT_DIR_ENTRY) {
+            current_pos -= (1 + entry->metadata.name_chars);
+            path[current_pos] = PATH_SEPARATOR;
+            memcpy(&path[current_pos + 1], entry->metadata.name, entry->metadata.name_chars * sizeof(utf16_t));
+            entry = entry->parent;
+        }
+
+        size_t path_size;
+        utf16_to_utf8(path_chars, path, &path_size, &utf8path);
+        free(path);
 
-    utf16_to_utf8(path_chars, path, utf8path_size, utf8path);
+        // concurrent readers could build the same path, all of them store the same size
+        dir_entry->utf8path_size = path_size;
+        if (!__sync_bool_compare_and_swap(&dir_entry->utf8path, NULL, utf8path)) {
+            free(utf8path);
+            utf8path = dir_entry->utf8path;
+        }
+    }
+    *utf8path_size = dir_entry->utf8path_size;
+    return utf8path;
 }
 
-int read_file_sector(struct DirEntry *dir_entry, uint32_t offset, uint8_t *buf) {
-    if (offset >= dir_entry->metadata.size) {
-        memset(buf, 0, BPB_BytesPerSector);
-        return 0;
+int read_dir_data(struct EntryView *entry_view, uint32_t offset, uint32_t size, uint8_t *buf) {
+    uint32_t read_size = 0;
+    if (offset < entry_view->size) {
+        read_size = (uint32_t)entry_view->size - offset;
+        if (read_size > size) {
+            read_size = size;
+        }
+        memcpy(buf, &entry_view->dir_image[offset], read_size);
     }
+    // unused space in last cluster of directory
+    memset(&buf[read_size], 0, size - read_size);
+    return 0;
+}
 
-    char *path;
-    size_t path_size;
-    get_file_path(dir_entry, &path_size, &path);
-    assert(path[path_size - 1] == 0);
+int read_file_data(struct EntryView *entry_view, uint64_t offset, uint32_t size, uint8_t *buf) {
+    uint32_t read_size = 0;
+    int ret = 0;
+    if (offset < entry_view->size) {
+        read_size = size;
+        if (entry_view->size - offset < size) {
+            read_size = (uint32_t)(entry_view->size - offset);
+        }
+
+        size_t path_size;
+        char *path = get_file_path(entry_view->dir_entry, &path_size);
+        assert(path[path_size - 1] == 0);
 
-    int ret = read_sector_from_cache(path_size, path, dir_entry->metadata.rev, offset, dir_entry->metadata.size, buf);
-    free(path);
+        ret = read_file_from_cache(entry_view->dir_entry->file_id, path_size, path, entry_view->rev,
+                offset, read_size, entry_view->size, buf);
+    }
+    // space between end of file and end of its last cluster
+    memset(&buf[read_size], 0, size - read_size);
     return ret;
 }
 
-int read_sector(uint32_t sector, uint8_t *buf) {
-    if (sector < BPB_ReservedSectorCount) {
+int read_reserved_data(uint32_t offset, uint32_t size, uint8_t *buf) {
+    if (IMAGE_FORMAT == IMAGE_FORMAT_EXFAT) {
+        return read_exfat_boot_data(offset, size, buf);
+    }
+
+    uint32_t buf_offset = 0;
+    while (buf_offset < size) {
+        uint32_t sector = (offset + buf_offset) / BPB_BytesPerSector;
+        uint32_t sector_index = (offset + buf_offset) % BPB_BytesPerSector;
+        uint32_t read_size = BPB_BytesPerSector - sector_index;
+        if (read_size > size - buf_offset) {
+            read_size = size - buf_offset;
+        }
+
         // Handle BOOT_SECTOR and FS_INFO regions
         if (sector == 0 || sector == BPB_BackupBootSector) {
-            memcpy(buf, BOOT_SECTOR, BPB_BytesPerSector);
+            memcpy(&buf[buf_offset], &BOOT_SECTOR[sector_index], read_size);
         } else if (sector == BPB_FSInfo) {
-            memcpy(buf, FS_INFO, BPB_BytesPerSector);
-        } else {
-            memset(buf, 0, BPB_BytesPerSector);
-        }
-        return 0;
-    } else if (sector < (BPB_ReservedSectorCount + 2 * BPB_FATSz32)) {
-        // Handle FAT Region
-        uint32_t fat_sector;
-        if (sector < (BPB_ReservedSectorCount + BPB_FATSz32)) {
-            fat_sector = sector - BPB_ReservedSectorCount;
+            memcpy(&buf[buf_offset], &FS_INFO[sector_index], read_size);
         } else {
-            fat_sector = sector - BPB_ReservedSectorCount - BPB_FATSz32;
+            memset(&buf[buf_offset], 0, read_size);
         }
+        buf_offset += read_size;
+    }
+    return 0;
+}
 
-        return read_fat_sector(fat_sector, buf);
-    } else {
-        // Handle Data Region
-        uint32_t cluster_n = 2 +
-            (sector - (BPB_ReservedSectorCount + 2 * BPB_FATSz32)) / BPB_SectorsPerCluster;
-        uint32_t sector_offset =
-            (sector - (BPB_ReservedSectorCount + 2 * BPB_FATSz32)) % BPB_SectorsPerCluster;
-
-        if (is_cluster_free(cluster_n)) {
-            memset(buf, 0, BPB_BytesPerSector);
-        } else {
-            // Get DirEntry and offset of sector
-            struct DirEntry *dir_entry =
-                get_cluster_dir_entry(cluster_n);
-            uint32_t offset =
-                get_cluster_chain_size(dir_entry->first_cluster, cluster_n) + sector_offset * BPB_BytesPerSector;
-
-            if (dir_entry->metadata.is_dir) {
-                return read_dir_sector(dir_entry, offset, buf);
-            } else {
-                return read_file_sector(dir_entry, offset, buf);
-            }
-        }
+/// read_cluster_data()
+///     Reads data region starting at data_offset up to the end of the cluster run that
+///     data_offset belongs to. On return *size is set to the number of bytes read.
+int read_cluster_data(struct ImageView *view, uint64_t data_offset, uint32_t *size, uint8_t *buf) {
+    uint32_t cluster_n = 2 + (uint32_t)(data_offset / BYTES_PER_CLUSTER);
+    uint32_t cluster_index = (uint32_t)(data_offset % BYTES_PER_CLUSTER);
+    uint32_t max_clusters = (uint32_t)(((uint64_t)cluster_index + *size + BYTES_PER_CLUSTER - 1) / BYTES_PER_CLUSTER);
+
+    uint64_t run_size = (uint64_t)get_cluster_run(view, cluster_n, max_clusters) * BYTES_PER_CLUSTER - cluster_index;
+    if (*size > run_size) {
+        *size = (uint32_t)run_size;
+    }
+
+    // Get view of DirEntry and offset of data_offset in it
+    uint64_t offset;
+    struct EntryView *entry_view = get_cluster_view(view, cluster_n, &offset);
+    if (entry_view == NULL) {
+        memset(buf, 0, *size);
         return 0;
     }
+    offset += cluster_index;
+    if ((IMAGE_FORMAT == IMAGE_FORMAT_EXFAT) && is_exfat_system_entry(entry_view->dir_entry)) {
+        return read_exfat_system_data(view, entry_view, offset, *size, buf);
+    } else if (entry_view->is_dir) {
+        return read_dir_data(entry_view, (uint32_t)offset, *size, buf);
+    } else {
+        return read_file_data(entry_view, offset, *size, buf);
+    }
 }
 
-int read_data(uint32_t offset, uint32_t size, uint8_t *buf) {
-    uint32_t sector = (offset / BPB_BytesPerSector);
-    uint32_t sector_index = (offset % BPB_BytesPerSector);
+/// read_data()
+///     Reads image data by splitting requested range into spans that each map to one
+///     region: reserved sectors, FATs, free space or a contiguous part of one DirEntry.
+///     Every span is resolved once and read directly into buf. Whole read uses the
+///     same published image version without taking any lock, so it never sees half
+///     applied changes and it never waits for the writer.
+int read_data(uint64_t offset, uint32_t size, uint8_t *buf) {
+    const uint64_t fat_start = (uint64_t)BPB_ReservedSectorCount * BPB_BytesPerSector;
+    const uint64_t fat_size = (uint64_t)BPB_FATSz32 * BPB_BytesPerSector;
+    const uint64_t data_start = fat_start + BPB_NumFATs * fat_size;
+
+    uint64_t epoch = enter_epoch();
+    struct ImageView *view = __atomic_load_n(&CURRENT_VIEW, __ATOMIC_ACQUIRE);
     uint32_t buf_offset = 0;
-
-    uint8_t tmp_sector[BPB_BytesPerSector];
-    int r;
-    while (buf_offset < size) {
-        uint32_t sector_endindex = (offset + size) - (sector * BPB_BytesPerSector + sector_index);
-        assert(sector_endindex > sector_index);
-
-        uint32_t read_size;
-        if ((sector_endindex - sector_index) < BPB_BytesPerSector) {
-            read_size = sector_endindex - sector_index;
-        } else{
-            read_size = BPB_BytesPerSector;
-        }
-
-        if ((sector_index == 0) && (read_size == BPB_BytesPerSector)) {
-            pthread_rwlock_rdlock(&dbfat_rwlock);
-            r = read_sector(sector, &buf[buf_offset]);
-            pthread_rwlock_unlock(&dbfat_rwlock);
-            if (r) {
-                return r;
+    int r = 0;
+    while ((buf_offset < size) && (r == 0)) {
+        uint64_t span_offset = offset + buf_offset;
+        uint32_t span_size = size - buf_offset;
+
+        if (span_offset < fat_start) {
+            // Handle Reserved Region
+            if (span_size > fat_start - span_offset) {
+                span_size = (uint32_t)(fat_start - span_offset);
             }
-        } else {
-            pthread_rwlock_rdlock(&dbfat_rwlock);
-            r = read_sector(sector, tmp_sector);
-            pthread_rwlock_unlock(&dbfat_rwlock);
-            if (r) {
-                return r;
+            r = read_reserved_data((uint32_t)span_offset, span_size, &buf[buf_offset]);
+        } else if (span_offset < data_start) {
+            // Handle FAT Region, FAT32 has two FATs with the same contents
+            uint32_t fat_offset = (uint32_t)((span_offset - fat_start) % fat_size);
+            if (span_size > fat_size - fat_offset) {
+                span_size = (uint32_t)(fat_size - fat_offset);
             }
-            memcpy(&buf[buf_offset], &tmp_sector[sector_index], read_size);
-            sector_index = 0;
+            r = read_fat_data(view, fat_offset, span_size, &buf[buf_offset]);
+        } else {
+            // Handle Data Region
+            r = read_cluster_data(view, span_offset - data_start, &span_size, &buf[buf_offset]);
         }
+        buf_offset += span_size;
+    }
+    leave_epoch(epoch);
+    return r;
+}
 
-        sector += 1;
-        buf_offset += read_size;
+void set_cursor_path(uint32_t path_chars, utf16_t *path) {
+    if (path_chars + 1 > PATH_CURSOR.path_capacity) {
+        PATH_CURSOR.path_capacity = (path_chars + 1) * 2;
+        PATH_CURSOR.path = (utf16_t *)realloc(PATH_CURSOR.path, PATH_CURSOR.path_capacity * sizeof(utf16_t));
+        assert(PATH_CURSOR.path != NULL);
     }
-    assert(buf_offset == size);
-    return 0;
+    memcpy(PATH_CURSOR.path, path, path_chars * sizeof(utf16_t));
+    // directory at the end of path is followed by separator as all the others
+    PATH_CURSOR.path[path_chars] = PATH_SEPARATOR;
 }
 
-struct DirEntry * add_file_entry(uint32_t path_chars, utf16_t *path, struct DBMetaData *dbmetadata) {
-    pthread_rwlock_wrlock(&dbfat_rwlock);
+void push_cursor_entry(struct DirEntry *dir_entry, uint32_t path_end) {
+    PATH_CURSOR.depth++;
+    if (PATH_CURSOR.depth >= PATH_CURSOR.depth_capacity) {
+        PATH_CURSOR.depth_capacity = (PATH_CURSOR.depth_capacity == 0) ? 16 : (PATH_CURSOR.depth_capacity * 2);
+        PATH_CURSOR.dir_entries = (struct DirEntry **)realloc(PATH_CURSOR.dir_entries,
+            PATH_CURSOR.depth_capacity * sizeof(struct DirEntry *));
+        PATH_CURSOR.path_ends = (uint32_t *)realloc(PATH_CURSOR.path_ends,
+            PATH_CURSOR.depth_capacity * sizeof(uint32_t));
+        assert((PATH_CURSOR.dir_entries != NULL) && (PATH_CURSOR.path_ends != NULL));
+    }
+    PATH_CURSOR.dir_entries[PATH_CURSOR.depth] = dir_entry;
+    PATH_CURSOR.path_ends[PATH_CURSOR.depth] = path_end;
+}
+
+void reset_path_cursor() {
+    PATH_CURSOR.depth = 0;
+}
+
+/// resolve_parent_entry()
+///     Returns directory that contains last entry of path and sets name_index to the
+///     start of its name. Walk starts from the deepest directory of PATH_CURSOR that is
+///     also on path. When dbmetadata is given missing directories are created, otherwise
+///     NULL is returned if some directory on path does not exist.
+struct DirEntry * resolve_parent_entry(uint32_t path_chars, utf16_t *path, struct DBMetaData *dbmetadata, uint32_t *name_index) {
     assert(path[0] == PATH_SEPARATOR);
-    uint32_t path_last_index = 0;
-    uint32_t path_index = 1;
+    uint32_t common_chars = 0;
+    uint32_t cursor_chars = (PATH_CURSOR.depth == 0) ? 0 : (PATH_CURSOR.path_ends[PATH_CURSOR.depth] + 1);
+    while ((common_chars < cursor_chars) && (common_chars < path_chars) &&
+            (path[common_chars] == PATH_CURSOR.path[common_chars])) {
+        common_chars++;
+    }
+    // directories removed since they were resolved are marked removed, as are all
+    // entries below them
+    while ((PATH_CURSOR.depth > 0) &&
+            ((PATH_CURSOR.path_ends[PATH_CURSOR.depth] >= common_chars) ||
+             PATH_CURSOR.dir_entries[PATH_CURSOR.depth]->is_removed)) {
+        PATH_CURSOR.depth--;
+    }
+    set_cursor_path(path_chars, path);
+    // directories reused from cursor are listed by this entry too, remove path pushes
+    // them to cursor without stamping
+    if (dbmetadata != NULL) {
+        for (uint32_t depth = 1; depth <= PATH_CURSOR.depth; depth++) {
+            PATH_CURSOR.dir_entries[depth]->delta_generation = DELTA_GENERATION;
+        }
+    }
 
-    struct DirEntry *current_entry = ROOT_DIR_ENTRY;
+    uint32_t path_last_index = (PATH_CURSOR.depth == 0) ? 0 : PATH_CURSOR.path_ends[PATH_CURSOR.depth];
+    uint32_t path_index = path_last_index + 1;
+    struct DirEntry *current_entry = (PATH_CURSOR.depth == 0) ? ROOT_DIR_ENTRY : PATH_CURSOR.dir_entries[PATH_CURSOR.depth];
 
-    while (path_index < path_chars) {
+    while (1) {
         while ((path_index < path_chars) && (path[path_index] != PATH_SEPARATOR)) {
             path_index += 1;
         }
+        if (path_index == path_chars) {
+            break;
+        }
 
         // path:  path[0:path_last_index+1]
         // entry: path[path_last_index+1:path_index]
@@ -496,36 +839,9 @@ struct DirEntry * add_file_entry(uint32_t path_chars, utf16_t *path, struct DBMe
         utf16_t *entry_name = &path[path_last_index + 1];
         struct DirEntry *child_entry = get_child_entry(current_entry, entry_name_chars, entry_name);
 
-        if (path_index == path_chars) {
-            if ((child_entry != NULL) && (child_entry->metadata.is_dir != dbmetadata->is_dir)) {
-                remove_child_entry(current_entry, child_entry);
-                child_entry = NULL;
-            }
-
-            if (child_entry == NULL) {
-                // if file or directory does not exist create new one
-                struct EntryMetaData metadata;
-                metadata.is_dir = dbmetadata->is_dir;
-                metadata.size = (dbmetadata->is_dir == 0) ? dbmetadata->size : 64;
-                metadata.DIR_WrtDate = get_wrt_date(dbmetadata->mtime);
-                metadata.DIR_WrtTime = get_wrt_time(dbmetadata->mtime);
-                memcpy(metadata.rev, dbmetadata->rev, DB_REV_SIZE);
-
-                metadata.name_chars = entry_name_chars;
-                metadata.name = (utf16_t *)malloc(entry_name_chars * sizeof(utf16_t));
-                memcpy(metadata.name, entry_name, entry_name_chars * sizeof(utf16_t));
-
-                child_entry = add_child_entry(current_entry, &metadata);
-            } else {
-                // if file or directory already exists need to update metadata with new information
-                if (child_entry->metadata.is_dir == 0) {
-                    // for files need to update size and reallocate cluster chain
-                    child_entry->metadata.size = dbmetadata->size;
-                    child_entry->first_cluster = reallocate_cluster_chain(child_entry->first_cluster, child_entry->metadata.size);
-                }
-                child_entry->metadata.DIR_WrtDate = get_wrt_date(dbmetadata->mtime);
-                child_entry->metadata.DIR_WrtTime = get_wrt_time(dbmetadata->mtime);
-                memcpy(child_entry->metadata.rev, dbmetadata->rev, DB_REV_SIZE);
+        if (dbmetadata == NULL) {
+            if ((child_entry == NULL) || (child_entry->metadata.is_dir == 0)) {
+                return NULL;
             }
         } else {
             // need to make sure that all parent directories in "path" exist if not
@@ -540,109 +856,327 @@ struct DirEntry * add_file_entry(uint32_t path_chars, utf16_t *path, struct DBMe
             if (child_entry == NULL) {
                 struct EntryMetaData metadata;
                 metadata.is_dir = 1;
-                metadata.size = 64;
+                metadata.size = get_empty_dir_size();
                 metadata.DIR_WrtDate = get_wrt_date(dbmetadata->mtime);
                 metadata.DIR_WrtTime = get_wrt_time(dbmetadata->mtime);
                 memcpy(metadata.rev, dbmetadata->rev, DB_REV_SIZE);
 
                 metadata.name_chars = entry_name_chars;
-                metadata.name = (utf16_t *)malloc((entry_name_chars + 1) * sizeof(utf16_t));
+                metadata.name = (utf16_t *)malloc(entry_name_chars * sizeof(utf16_t));
                 memcpy(metadata.name, entry_name, entry_name_chars * sizeof(utf16_t));
 
                 child_entry = add_child_entry(current_entry, &metadata);
             }
+            child_entry->delta_generation = DELTA_GENERATION;
         }
 
+        push_cursor_entry(child_entry, path_index);
         path_last_index = path_index;
         path_index += 1;
 
         current_entry = child_entry;
     }
-    pthread_rwlock_unlock(&dbfat_rwlock);
+    *name_index = path_last_index + 1;
     return current_entry;
 }
 
-void remove_file_entry(uint32_t path_chars, utf16_t *path) {
-    pthread_rwlock_wrlock(&dbfat_rwlock);
-    assert(path[0] == PATH_SEPARATOR);
-    uint32_t path_last_index = 0;
-    uint32_t path_index = 1;
+struct DirEntry * _add_file_entry(uint32_t path_chars, utf16_t *path, struct DBMetaData *dbmetadata) {
+    // trailing separator does not name another entry
+    while ((path_chars > 1) && (path[path_chars - 1] == PATH_SEPARATOR)) {
+        path_chars--;
+    }
+    if (path_chars <= 1) {
+        return ROOT_DIR_ENTRY;
+    }
 
-    struct DirEntry *current_entry = ROOT_DIR_ENTRY;
+    uint32_t name_index;
+    struct DirEntry *parent_entry = resolve_parent_entry(path_chars, path, dbmetadata, &name_index);
+    uint8_t entry_name_chars = path_chars - name_index;
+    utf16_t *entry_name = &path[name_index];
+    struct DirEntry *child_entry = get_child_entry(parent_entry, entry_name_chars, entry_name);
 
-    while (path_index < path_chars) {
-        while ((path_index < path_chars) && (path[path_index] != PATH_SEPARATOR)) {
-            path_index += 1;
-        }
+    if ((child_entry != NULL) && (child_entry->metadata.is_dir != dbmetadata->is_dir)) {
+        remove_child_entry(parent_entry, child_entry);
+        child_entry = NULL;
+    }
 
-        // path:  path[0:path_last_index+1]
-        // entry: path[path_last_index+1:path_index]
-        uint8_t entry_name_chars = path_index - (path_last_index + 1);
-        utf16_t *entry_name = &path[path_last_index + 1];
-        struct DirEntry *child_entry = get_child_entry(current_entry, entry_name_chars, entry_name);
+    if (child_entry == NULL) {
+        // if file or directory does not exist create new one
+        struct EntryMetaData metadata;
+        metadata.is_dir = dbmetadata->is_dir;
+        metadata.size = (dbmetadata->is_dir == 0) ? dbmetadata->size : get_empty_dir_size();
+        metadata.DIR_WrtDate = get_wrt_date(dbmetadata->mtime);
+        metadata.DIR_WrtTime = get_wrt_time(dbmetadata->mtime);
+        memcpy(metadata.rev, dbmetadata->rev, DB_REV_SIZE);
 
-        if ((child_entry == NULL) || (path_index < path_chars && child_entry->metadata.is_dir == 0)) {
-            break;
-        }
+        metadata.name_chars = entry_name_chars;
+        metadata.name = (utf16_t *)malloc(entry_name_chars * sizeof(utf16_t));
+        memcpy(metadata.name, entry_name, entry_name_chars * sizeof(utf16_t));
 
-        if (path_index == path_chars) {
-            remove_child_entry(current_entry, child_entry);
+        child_entry = add_child_entry(parent_entry, &metadata);
+    } else {
+        // if file or directory already exists need to update metadata with new information
+        if (child_entry->metadata.is_dir == 0) {
+            // for files need to update size and reallocate cluster chain
+            child_entry->metadata.size = dbmetadata->size;
+            child_entry->first_cluster = reallocate_cluster_chain(child_entry->first_cluster, child_entry->metadata.size);
         }
-        current_entry = child_entry;
+        child_entry->metadata.DIR_WrtDate = get_wrt_date(dbmetadata->mtime);
+        child_entry->metadata.DIR_WrtTime = get_wrt_time(dbmetadata->mtime);
+        memcpy(child_entry->metadata.rev, dbmetadata->rev, DB_REV_SIZE);
+        invalidate_dir_entry(child_entry);
+        child_entry->delta_generation = DELTA_GENERATION;
+    }
+
+    // delta lists contents of directory right after it
+    if (child_entry->metadata.is_dir == 1) {
+        push_cursor_entry(child_entry, path_chars);
+    }
+    return child_entry;
+}
+
+void _remove_file_entry(uint32_t path_chars, utf16_t *path) {
+    while ((path_chars > 1) && (path[path_chars - 1] == PATH_SEPARATOR)) {
+        path_chars--;
+    }
+    if (path_chars <= 1) {
+        return;
+    }
+
+    uint32_t name_index;
+    struct DirEntry *parent_entry = resolve_parent_entry(path_chars, path, NULL, &name_index);
+    if (parent_entry == NULL) {
+        return;
+    }
+    struct DirEntry *child_entry = get_child_entry(parent_entry, path_chars - name_index, &path[name_index]);
+    if (child_entry != NULL) {
+        remove_child_entry(parent_entry, child_entry);
     }
-    pthread_rwlock_unlock(&dbfat_rwlock);
+}
+
+struct DirEntry * add_file_entry(uint32_t path_chars, utf16_t *path, struct DBMetaData *dbmetadata) {
+    pthread_mutex_lock(&dbfat_write_lock);
+    struct DirEntry *dir_entry = _add_file_entry(path_chars, path, dbmetadata);
+    pthread_mutex_unlock(&dbfat_write_lock);
+    return dir_entry;
+}
+
+void remove_file_entry(uint32_t path_chars, utf16_t *path) {
+    pthread_mutex_lock(&dbfat_write_lock);
+    _remove_file_entry(path_chars, path);
+    pthread_mutex_unlock(&dbfat_write_lock);
 }
 
 void remove_all_file_entries() {
-    pthread_rwlock_wrlock(&dbfat_rwlock);
+    pthread_mutex_lock(&dbfat_write_lock);
     struct DirEntry *child = ROOT_DIR_ENTRY->child;
     while (child) {
+        struct DirEntry *child_next = child->next;
         remove_child_entry(ROOT_DIR_ENTRY, child);
-        child = child->next;
+        child = child_next;
     }
-    pthread_rwlock_unlock(&dbfat_rwlock);
+    pthread_mutex_unlock(&dbfat_write_lock);
 }
 
-void utf8_to_utf16(size_t utf8size, char *utf8string, size_t *utf16chars, utf16_t **utf16string) {
-    const size_t BUF_SIZE = 64 * 1024;
-    char OUTBUF[BUF_SIZE];
-    char *outbuf = OUTBUF;
-    size_t inbytesleft = utf8size;
-    size_t outbytesleft = BUF_SIZE;
+/// build_entry_view()
+///     Builds new view of dir_entry from its current state, directories are rendered
+///     here so that readers never look at the directory tree
+void build_entry_view(struct DirEntry *dir_entry) {
+    struct EntryView *view = (struct EntryView *)malloc(
+            sizeof(struct EntryView) + dir_entry->extent_count * sizeof(struct ClusterExtent));
+    assert(view != NULL);
+    view->dir_entry = dir_entry;
+    view->size = dir_entry->metadata.size;
+    memcpy(view->rev, dir_entry->metadata.rev, DB_REV_SIZE);
+    view->is_dir = dir_entry->metadata.is_dir;
+    view->dir_image = (view->is_dir == 1) ? render_dir_image(dir_entry) : NULL;
+    view->extent_count = dir_entry->extent_count;
+    memcpy(view->extents, dir_entry->extents, dir_entry->extent_count * sizeof(struct ClusterExtent));
+
+    if (dir_entry->view != NULL) {
+        retire_memory(dir_entry->view->dir_image);
+        retire_memory(dir_entry->view);
+    }
+    dir_entry->view = view;
+    update_extent_views(dir_entry);
+}
 
-    iconv_t utf8_to_utf16 = iconv_open("UTF-16LE", "UTF-8");
-    assert(utf8_to_utf16 != (iconv_t) -1);
+/// publish_stale_entries()
+///     Publishes all changes made since last call as a new image version. Directories
+///     are resized and views of stale entries rebuilt and then new version replaces the
+///     current one with a single store, so a batch of changes becomes visible to readers
+///     at once. Returns number of rebuilt views, caller must hold dbfat_write_lock.
+uint32_t publish_stale_entries() {
+    // resizing moves chains of directories, that makes more entries stale but they
+    // are added in front of those already checked
+    for (struct DirEntry *dir_entry = STALE_ENTRIES; dir_entry != NULL; dir_entry = dir_entry->stale_next) {
+        if ((dir_entry->metadata.is_dir == 1) && !dir_entry->is_removed) {
+            resize_dir_entry(dir_entry);
+        }
+    }
 
-    size_t r = iconv(utf8_to_utf16, &utf8string, &inbytesleft, &outbuf, &outbytesleft);
-    assert(r != (size_t) -1);
-    assert(inbytesleft == 0);
+    uint32_t rebuilt_entries = 0;
+    struct DirEntry *dir_entry = STALE_ENTRIES;
+    while (dir_entry != NULL) {
+        struct DirEntry *stale_next = dir_entry->stale_next;
+        dir_entry->is_stale = 0;
+        dir_entry->stale_next = NULL;
+        // removed entries are retired and not freed yet
+        if (!dir_entry->is_removed) {
+            build_entry_view(dir_entry);
+            rebuilt_entries++;
+        }
+        dir_entry = stale_next;
+    }
+    STALE_ENTRIES = NULL;
+
+    struct ImageView *view = (struct ImageView *)malloc(sizeof(struct ImageView));
+    assert(view != NULL);
+    view->cluster_pages = publish_cluster_pages();
+    struct ImageView *old_view = CURRENT_VIEW;
+    __atomic_store_n(&CURRENT_VIEW, view, __ATOMIC_SEQ_CST);
+    if (old_view != NULL) {
+        retire_memory(old_view->cluster_pages);
+        retire_memory(old_view);
+    }
+    // cursor may point to removed entries that can be freed now
+    reset_path_cursor();
+    reclaim_retired_memory();
+    return rebuilt_entries;
+}
 
-    assert(((BUF_SIZE - outbytesleft) % sizeof(utf16_t)) == 0);
-    *utf16chars = (BUF_SIZE - outbytesleft) / sizeof(utf16_t);
-    *utf16string = (utf16_t *)malloc((*utf16chars) * sizeof(utf16_t));
-    memcpy(*utf16string, OUTBUF, (*utf16chars) * sizeof(utf16_t));
-    iconv_close(utf8_to_utf16);
+void publish_file_entries() {
+    pthread_mutex_lock(&dbfat_write_lock);
+    uint32_t rebuilt_entries = publish_stale_entries();
+    pthread_mutex_unlock(&dbfat_write_lock);
+    printf("[DEBUG] Published image version, rebuilt entries: %u\n", rebuilt_entries);
 }
 
-void utf16_to_utf8(size_t utf16chars, utf16_t *utf16string, size_t *utf8size, char **utf8string) {
-    const size_t BUF_SIZE = 64 * 1024;
-    char OUTBUF[BUF_SIZE];
-    char *outbuf = OUTBUF;
-    size_t inbytesleft = utf16chars * sizeof(utf16_t);
-    size_t outbytesleft = BUF_SIZE;
+void _stage_file_entries(struct FileEntryChange *changes, uint32_t change_count) {
+    for (uint32_t i = 0; i < change_count; i++) {
+        if (changes[i].is_removed) {
+            _remove_file_entry(changes[i].path_chars, changes[i].path);
+        } else {
+            _add_file_entry(changes[i].path_chars, changes[i].path, &changes[i].metadata);
+        }
+    }
+}
+
+/// remove_unlisted_entries()
+///     Removes children of dir_entry that pages of current reset did not list
+void remove_unlisted_entries(struct DirEntry *dir_entry) {
+    struct DirEntry *child = dir_entry->child;
+    while (child) {
+        struct DirEntry *child_next = child->next;
+        if (child->delta_generation != DELTA_GENERATION) {
+            remove_child_entry(dir_entry, child);
+        } else if (child->metadata.is_dir == 1) {
+            remove_unlisted_entries(child);
+        }
+        child = child_next;
+    }
+}
+
+uint32_t _commit_file_entries(char *cursor, uint8_t reset, uint8_t has_more) {
+    if (reset) {
+        RESET_PENDING = 1;
+    }
+    // entries of later pages of reset listing must not be removed before they come
+    if (RESET_PENDING && !has_more) {
+        remove_unlisted_entries(ROOT_DIR_ENTRY);
+        RESET_PENDING = 0;
+    }
+    free(DELTA_CURSOR);
+    DELTA_CURSOR = strdup(cursor);
+    return publish_stale_entries();
+}
 
-    iconv_t utf16_to_utf8 = iconv_open("UTF-8", "UTF-16LE");
-    assert(utf16_to_utf8 != (iconv_t) -1);
+/// begin_file_entries()
+///     Starts a delta page that is applied in parts with stage_file_entries and then
+///     published with commit_file_entries, so that only a part of page has to be kept
+///     in memory. Readers see the whole page at once. Page that is not committed, e.g.
+///     because its download failed, stays applied and is published with the next one,
+///     its entries are listed again by the retried request anyway.
+void begin_file_entries() {
+    pthread_mutex_lock(&dbfat_write_lock);
+    if (!RESET_PENDING) {
+        DELTA_GENERATION++;
+    }
+    // directories on cursor are not stamped with the new generation yet
+    reset_path_cursor();
+    pthread_mutex_unlock(&dbfat_write_lock);
+}
+
+void stage_file_entries(struct FileEntryChange *changes, uint32_t change_count) {
+    pthread_mutex_lock(&dbfat_write_lock);
+    _stage_file_entries(changes, change_count);
+    pthread_mutex_unlock(&dbfat_write_lock);
+}
 
-    size_t r = iconv(utf16_to_utf8, (char **)&utf16string, &inbytesleft, &outbuf, &outbytesleft);
-    assert(r != (size_t) -1);
-    assert(inbytesleft == 0);
+/// commit_file_entries()
+///     Publishes staged entries of delta page. If page has reset flag, all entries that
+///     pages of the reset did not list are removed once its last page, without has_more,
+///     is committed. Page may set the flag after its entries so they are not removed up
+///     front. cursor is the delta cursor after the page.
+void commit_file_entries(char *cursor, uint8_t reset, uint8_t has_more) {
+    pthread_mutex_lock(&dbfat_write_lock);
+    uint32_t rebuilt_entries = _commit_file_entries(cursor, reset, has_more);
+    pthread_mutex_unlock(&dbfat_write_lock);
+    printf("[DEBUG] Committed delta page, reset: %u, rebuilt entries: %u\n", reset, rebuilt_entries);
+}
+
+/// get_delta_cursor()
+///     Returns copy of delta cursor that matches current entries, caller frees it
+char *get_delta_cursor() {
+    pthread_mutex_lock(&dbfat_write_lock);
+    char *cursor = strdup(DELTA_CURSOR);
+    pthread_mutex_unlock(&dbfat_write_lock);
+    return cursor;
+}
 
-    *utf8size = (BUF_SIZE - outbytesleft) + 1;
-    *utf8string = (char *)malloc(*utf8size);
-    memcpy(*utf8string, OUTBUF, *utf8size);
-    (*utf8string)[*utf8size - 1] = 0;
-    iconv_close(utf16_to_utf8);
+/// save_file_entries()
+///     Writes snapshot of published directory tree, cluster chains and delta cursor
+void save_file_entries() {
+    pthread_mutex_lock(&dbfat_write_lock);
+    if (RESET_PENDING) {
+        // restored snapshot would keep entries that the rest of reset removes
+        pthread_mutex_unlock(&dbfat_write_lock);
+        printf("[DEBUG] Snapshot is not saved during reset\n");
+        return;
+    }
+    if (STALE_ENTRIES != NULL) {
+        // snapshot has directories with their final size
+        publish_stale_entries();
+    }
+    write_snapshot(ROOT_DIR_ENTRY, DELTA_CURSOR);
+    pthread_mutex_unlock(&dbfat_write_lock);
+}
+
+/// load_file_entries()
+///     Restores directory tree saved by save_file_entries, called before image is served.
+///     If snapshot is missing or does not match volume geometry image stays empty.
+void load_file_entries() {
+    pthread_mutex_lock(&dbfat_write_lock);
+    uint64_t root_size = ROOT_DIR_ENTRY->metadata.size;
+    char *cursor = NULL;
+    int ret = read_snapshot(ROOT_DIR_ENTRY, &cursor);
+    if (ret == 0) {
+        free(DELTA_CURSOR);
+        DELTA_CURSOR = cursor;
+    } else if (ret < 0) {
+        // drop partially restored tree, root directory shrinks when published
+        struct DirEntry *child = ROOT_DIR_ENTRY->child;
+        while (child) {
+            struct DirEntry *child_next = child->next;
+            remove_child_entry(ROOT_DIR_ENTRY, child);
+            child = child_next;
+        }
+        ROOT_DIR_ENTRY->metadata.size = root_size;
+        invalidate_entry_view(ROOT_DIR_ENTRY);
+    }
+    uint32_t rebuilt_entries = publish_stale_entries();
+    pthread_mutex_unlock(&dbfat_write_lock);
+    printf("[DEBUG] Loaded file entries, rebuilt entries: %u\n", rebuilt_entries);
 }
 
 void add_test_file(char *path, uint8_t is_dir, uint32_t size, uint32_t mtime) {
@@ -664,5 +1198,6 @@ void add_test_data() {
     add_test_file("/t1/t2", 1, 0, 0);
     add_test_file("/t1/t2/t3", 0, 100, 0);
     add_test_file("/ttt1/ttt2/ttt3", 0, 1000, 0);
+    publish_file_entries();
 }
 
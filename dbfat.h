@@ -4,11 +4,13 @@
 #include <stdint.h>
 #include <wchar.h>
 
-typedef uint16_t utf16_t;
+#include "geometry.h"
+#include "utf.h"
+
 #define DB_REV_SIZE 11
 
 struct EntryMetaData {
-    uint32_t size;
+    uint64_t size;
     uint16_t DIR_WrtDate; // [9-15]/[5-8]/[0-4]
     uint16_t DIR_WrtTime; // [11-15]:[5-10]:[0-4]
 
@@ -16,37 +18,107 @@ struct EntryMetaData {
     uint8_t name_chars;
     uint8_t name_checksum;
     uint8_t short_name[11];
-    utf16_t *name;
+    utf16_t *name; // name_chars units, not NUL-terminated
+
+    char rev[DB_REV_SIZE];
+};
+
+// Contiguous part of cluster chain
+struct ClusterExtent {
+    uint32_t first_cluster;
+    uint32_t clusters;
+    uint32_t ordinal;   // position of first_cluster in chain
+};
 
+// Immutable copy of everything readers need from DirEntry, a new one is built
+// whenever entry changes and published together with the rest of image version
+struct EntryView {
+    struct DirEntry *dir_entry;     // only fields that never change are used by readers
+    uint64_t size;
     char rev[DB_REV_SIZE];
+    uint8_t is_dir;
+    uint8_t *dir_image;             // rendered contents of directory
+    uint32_t extent_count;
+    struct ClusterExtent extents[];
+};
+
+// Published version of image, readers use one for the whole read while writer
+// builds the next one
+struct ImageView {
+    struct ClusterPage **cluster_pages;
 };
 
 struct DirEntry {
     struct DirEntry *parent;
     struct DirEntry *child;
     struct DirEntry *next;
+    struct DirEntry *prev;
     uint32_t first_cluster;
+    // cluster chain in chain order, owned by cluster.c
+    struct ClusterExtent *extents;
+    uint32_t extent_count;
+
+    // children of directory are indexed by hash of their case folded name
+    uint32_t name_hash;
+    struct DirEntry *hash_next;    // next entry in parent's child_index bucket
+    struct DirEntry **child_index;
+    uint32_t child_index_mask;
+    uint32_t child_count;
+
+    // file_id is unique for every DirEntry, used to identify files in file cache
+    uint32_t file_id;
+    // full UTF-8 path of entry, built on first use
+    char *utf8path;
+    size_t utf8path_size;
+    // last built view, rebuilt on publish when entry is stale
+    struct EntryView *view;
+    struct DirEntry *stale_next;    // next entry in list of stale entries
+    uint8_t is_stale;
+    uint8_t is_removed;
+    // delta generation that last listed entry, or one of its descendants
+    uint32_t delta_generation;
 
     struct EntryMetaData metadata;
 };
 
 struct DBMetaData {
-    uint32_t size;
+    uint64_t size;
     uint32_t mtime;
     uint8_t is_dir;
     char rev[DB_REV_SIZE];
 };
 
+// Entry of delta page, metadata is not used for removed entries
+struct FileEntryChange {
+    uint32_t path_chars;
+    utf16_t *path;
+    uint8_t is_removed;
+    struct DBMetaData metadata;
+};
+
 // Interface to read dbbox image
 void initialize_dbfat();
 void cleanup_dbfat();
-int read_data(uint32_t offset, uint32_t size, uint8_t *buf);
+int read_data(uint64_t offset, uint32_t size, uint8_t *buf);
 struct DirEntry * add_file_entry(uint32_t path_chars, utf16_t *path, struct DBMetaData *dbmetadata);
 void remove_file_entry(uint32_t path_chars, utf16_t *path);
 void remove_all_file_entries();
+void publish_file_entries();
 
-void utf8_to_utf16(size_t utf8size, char *utf8string, size_t *utf16chars, utf16_t **utf16string);
-void utf16_to_utf8(size_t utf16chars, utf16_t *utf16string, size_t *utf8size, char **utf8string);
+// delta page applied in parts as it is received, nothing is published until commit
+void begin_file_entries();
+void stage_file_entries(struct FileEntryChange *changes, uint32_t change_count);
+void commit_file_entries(char *cursor, uint8_t reset, uint8_t has_more);
+char *get_delta_cursor();
+
+// snapshot of directory tree for warm start
+void save_file_entries();
+void load_file_entries();
+struct DirEntry * restore_child_entry(struct DirEntry *dir_entry, struct EntryMetaData *metadata, uint32_t file_id,
+        struct ClusterExtent *extents, uint32_t extent_count);
+
+// marks entry changed, for entries that are not part of directory tree
+void invalidate_entry_view(struct DirEntry *dir_entry);
 
 // functions for testing
 void add_test_data();
@@ -75,7 +147,7 @@ void add_test_data();
     ATTR_SYSTEM | \
     ATTR_VOLUME_ID)
 
-// BootSector and FSInfo constants
+// Little endian byte arrays
 #define UINT16_TOARRAY(x) \
     ((x) & 0xFF),      (((x) >> 8) & 0xFF)
 
@@ -85,293 +157,4 @@ void add_test_data();
 #define UINT32_TOARRAY(x) \
     UINT24_TOARRAY(x), (((x) >> 24) & 0xFF)
 
-#define BPB_BytesPerSector      512
-#define BPB_SectorsPerCluster   64
-#define BPB_ReservedSectorCount 32
-#define BPB_TotalSectors        0x10000000L
-#define tmpFATSz32_1 (BPB_TotalSectors - BPB_ReservedSectorCount)
-#define tmpFATSz32_2 (BPB_SectorsPerCluster * BPB_BytesPerSector / 32 + 2)
-#define BPB_FATSz32             ((uint32_t)((tmpFATSz32_1 + tmpFATSz32_2 - 1) / tmpFATSz32_2))
-#define BPB_RootCluster         2
-#define BPB_FSInfo              1
-#define BPB_BackupBootSector    6
-#define BS_VolumeID             111111
-
-#define N_CLUSTERS              ((BPB_TotalSectors - (BPB_ReservedSectorCount + (2 * BPB_FATSz32))) / BPB_SectorsPerCluster)
-#define BYTES_PER_CLUSTER       (BPB_SectorsPerCluster * BPB_BytesPerSector)
-
-#define FAT_MAX_FILE_SIZE       0xFFFFFFFF
-
-static const uint8_t BOOT_SECTOR[512] = {
-    0xEB, 0x00, 0x90,                       // BS_jmpBoot
-    'M', 'S', 'W', 'I', 'N', '4', '.', '1', // BS_OEMName
-
-    UINT16_TOARRAY(BPB_BytesPerSector),
-    BPB_SectorsPerCluster,
-    UINT16_TOARRAY(BPB_ReservedSectorCount),
-    0x02,                                   // BPB_NumFATs
-    0x00, 0x00,                             // BPB_RootEntCnt
-    0x00, 0x00,                             // BPB_TotSec16
-    0xF0,                                   // BPB_Media
-    0x00, 0x00,                             // BPB_FATSz16
-    0x00, 0x00,                             // BPB_SecPerTrk
-    0x00, 0x00,                             // BPB_NumHeads
-    0x00, 0x00, 0x00, 0x00,                 // BPB_HiddSec
-    UINT32_TOARRAY(BPB_TotalSectors),
-    UINT32_TOARRAY(BPB_FATSz32),
-    0x00, 0x00,                             // BPB_ExtFlags
-    0x00, 0x00,                             // BPB_FSVer
-    UINT32_TOARRAY(BPB_RootCluster),
-    UINT16_TOARRAY(BPB_FSInfo),
-    UINT16_TOARRAY(BPB_BackupBootSector),
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,                 // BPB_Reserved
-
-    0x00,                                   // BS_DrvNum
-    0x00,                                   // BS_Reserved1
-    0x29,                                   // BS_BootSig,
-    UINT32_TOARRAY(BS_VolumeID),
-    'D', 'R', 'O', 'P', 'B', 'O', 'X', ' ',
-    'B', 'O', 'X',                          // BS_VolLab
-    'F', 'A', 'T', '3', '2', ' ', ' ', ' ', // BS_FilSysType
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x55, 0xAA,                             // BS_TrailSig
-};
-
-static const uint8_t FS_INFO[512] = {
-    0x52, 0x52, 0x61, 0x41,                 // FSI_LeadSig
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,                 // FSI_Reserved1
-    0x72, 0x72, 0x41, 0x61,                 // FSI_StrucSig
-    0xFF, 0xFF, 0xFF, 0xFF,                 // FSI_Free_Count
-    0xFF, 0xFF, 0xFF, 0xFF,                 // FSI_Nxt_Free
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00,                 // FSI_Reserved2
-    0x00, 0x00, 0x55, 0xAA,                 // FSI_TrailSig
-};
-
 #endif
@@ -1,4 +1,8 @@
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,237 +10,1355 @@
 
 #include <curl/curl.h>
 #include <pthread.h>
-#include <sys/timeb.h>
+#include <time.h>
 
 #include "dbapi.h"
 #include "dbfat.h"
 #include "dbfiles.h"
+#include "diskcache.h"
 
-#define CACHE_BLOCK_SIZE  (1 << 21) // 2MB blocks
-#define CACHE_BLOCK_COUNT 8         // number of blocks must be more than (max_prefetched_blocks * fuse_threads + block_fetcher_thread_count)
+#define CACHE_BLOCK_SIZE        (1 << 21) // 2MB blocks
+#define CACHE_SHARD_COUNT       16        // number of independently locked parts of cache index
+#define DEFAULT_CACHE_SIZE_MB   16        // cache size if DBBOX_CACHE_SIZE_MB is not set
+#define DEFAULT_FETCH_TRANSFERS 32        // concurrent downloads if DBBOX_FETCH_TRANSFERS is not set
+#define DEFAULT_FETCH_COALESCE  4         // blocks per download if DBBOX_FETCH_COALESCE_BLOCKS is not set
 
-const int BLOCK_FETCHER_THREAD_COUNT = 8;  // number of threads that fetch file blocks
-const int MAX_BLOCK_PREFETCH = 2;          // maximum number of blocks to prefetch
 const int READ_SECTOR_TIMEOUT = 30 * 1000; // sector reading timeout in milli seconds
+const int PREFETCH_TIMEOUT = 60 * 1000;    // download timeout of each block no reader waits for
+
+// Failed downloads are retried after exponential backoff with jitter, for as long as
+// the retry can start before deadline of readers that wait for the block. Blocks
+// without readers are given up after RETRY_MAX_ATTEMPTS, errors that can't be fixed
+// by retrying right away.
+#define RETRY_BASE_DELAY        250       // milli seconds after the first failure, doubles with every failure
+#define RETRY_MAX_DELAY         (30 * 1000)
+#define RETRY_MAX_ATTEMPTS      5
+
+// Download of block that a reader waits for is duplicated on a new connection once it
+// takes longer than 95th percentile of recent downloads, whichever ends first wins
+#define HEDGE_LATENCY_SAMPLES   64        // recent downloads that percentile is taken from
+#define HEDGE_MIN_SAMPLES       16        // downloads are not hedged before there are as many samples
+#define HEDGE_MIN_DELAY         500       // milli seconds, downloads are never hedged sooner
+
+// number of blocks must be more than fuse_threads, blocks that are downloaded are
+// referenced by readers or readahead before they are scheduled
+const int MIN_CACHE_BLOCK_COUNT = 8;
+
+// Readahead, every file that is read is tracked as a stream. Readahead window of a
+// stream doubles every time sequential reads move to the next block and drops to
+// zero on a random read.
+#define READ_STREAM_COUNT       32              // number of tracked streams
+#define READ_STREAM_SLACK       (256 * 1024)    // reordering of parallel reads that is still sequential
+const uint32_t MAX_READAHEAD_BLOCKS = 16;       // readahead window limit, also limited to 1/4 of cache
 
 enum BlockState {
     CLEAN = 0,
     SCHEDULED = 1,
     DOWNLOADING = 2,
     COMPLETED = 3,
+    FAILED = 4,     // download was given up, readers fail and the next read schedules it again
 };
 
+struct CacheShard;
+
 struct CachedBlock {
-    volatile int ref_count;
-    volatile enum BlockState block_state;
-    volatile long long int last_access;
+    // ref_count, block_state and key are protected by lock of the shard that block
+    // is indexed in. Blocks with ref_count > 0 are never evicted so their shard can't change
+    int ref_count;
+    enum BlockState block_state;
+    volatile uint8_t demand;     // reader is waiting for this block, priority hint for fetch queue
+    uint8_t claimed;             // returned by evict_cache_block and not indexed yet
+    volatile uint8_t referenced; // CLOCK bit, set on every access and cleared by eviction
+    uint8_t prefetched;          // scheduled by readahead and not read yet
 
+    struct CacheShard *shard;       // NULL if block is not indexed
+    struct CachedBlock *hash_next;  // next block in shard bucket
+    struct CachedBlock *queue_next; // next block in fetch queue
+    uint32_t key_hash;
+
+    // blocks are identified by (file_id, rev, offset), utf8path is only used to download block
+    uint32_t file_id;
+    char rev[DB_REV_SIZE];
+    uint64_t offset;
     char *utf8path;
     size_t path_size;
-    char rev[DB_REV_SIZE];
-    uint32_t offset;
-    char buffer[CACHE_BLOCK_SIZE];
+
+    // Bytes [0, valid_size) of buffer are downloaded and never change while block is
+    // indexed, so readers can copy them without waiting for the rest of the block.
+    // valid_size and waiters are protected by shard lock.
+    uint32_t valid_size;
+    int waiters;
+    // signaled when valid_size grows or block_state changes to COMPLETED or FAILED
+    pthread_cond_t block_updated;
+    char *buffer;
+
+    // latest deadline of readers that wait for block, protected by shard lock
+    long long int deadline;
+    // failed downloads since block was scheduled and time of the next one, only used
+    // by fetch thread
+    uint32_t attempts;
+    long long int retry_time;
+
+    // disk cache state, only used by fetch or disk thread while it holds the block
+    uint8_t disk_checked;   // disk cache was searched for block since it was scheduled
+    uint32_t data_size;     // bytes of completed block before end of file, stored to disk cache
+};
+
+struct CacheShard {
+    pthread_mutex_t lock;
+    uint32_t bucket_mask;
+    struct CachedBlock **buckets;
 };
 
-struct CachedBlock **file_cache;
-pthread_mutex_t file_cache_lock;
+struct ReadStream {
+    uint32_t file_id;
+    uint64_t next_offset;    // end of the last read
+    uint64_t readahead_end;  // blocks before this offset are already scheduled
+    uint32_t window;         // number of blocks to read ahead of current block
+    long long int last_access;
+};
+
+int cache_block_count;
+struct CachedBlock *file_cache;
+struct CacheShard cache_shards[CACHE_SHARD_COUNT];
+
+// CLOCK eviction state
+pthread_mutex_t cache_evict_lock;
+int cache_clock_hand = 0;
+
+// Blocks waiting to be downloaded. Every queued block holds a reference that is
+// handed over to the transfer that downloads it.
+pthread_mutex_t fetch_queue_lock;
+struct CachedBlock *fetch_queue_head = NULL;
+struct CachedBlock *fetch_queue_tail = NULL;
+// fetch thread waits for sockets of its transfers and for read end of the pipe, a
+// byte is written to it when queue gets new blocks and fetch thread is not woken yet
+int fetch_wakeup_pipe[2];
+int fetch_wakeup_pending = 0;
+// failed blocks that wait for their retry_time, linked with queue_next and only used
+// by fetch thread
+struct CachedBlock *fetch_retry_head = NULL;
+
+// Disk cache reads and writes run on disk thread, so that fetch thread only waits for
+// network. Blocks to search for in disk cache and completed blocks to store in it are
+// linked with queue_next, each of them holds a reference. Blocks that are not in
+// disk cache go back to fetch queue.
+pthread_mutex_t disk_queue_lock;
+pthread_cond_t disk_queue_work; // signaled when blocks are added to the queue
+struct CachedBlock *disk_queue_head = NULL;
+struct CachedBlock *disk_queue_tail = NULL;
+// lookups collected by fetch thread while it empties fetch queue, handed over at once
+// so that blocks of one file come back together and can be coalesced
+struct CachedBlock *disk_lookup_head = NULL;
+struct CachedBlock *disk_lookup_tail = NULL;
+
+// Fetch thread downloads all blocks through one curl multi handle. Every transfer
+// has its own request and reuses it, connections are kept in connection cache of
+// the multi handle and shared by all transfers. Queued blocks that follow each other
+// in one file are downloaded by one transfer with a single range request.
+// Hedged download is a second transfer of the same blocks, both of them write bytes
+// that were not received yet by the other one.
+struct BlockTransfer {
+    struct FileRequest *request;
+    CURL *curl;                 // handle of request while it is added to multi handle
+    struct CachedBlock **blocks;
+    int block_count;            // 0 if transfer is free
+    uint64_t position;          // file offset of the next byte of response
+    long long int start_time;
+    struct BlockTransfer *hedge;    // other transfer of the same blocks
+    uint8_t hedged;                 // download of the blocks was hedged already
+};
+
+CURLM *fetch_multi;
+struct BlockTransfer *fetch_transfers;
+int fetch_transfer_count;
+int fetch_active_transfers = 0;
+int fetch_prefetch_limit;   // transfers that can download prefetched blocks
+uint32_t fetch_coalesce_blocks;
+long long int fetch_paused_until = 0;   // no downloads are started before, server asked to wait
+unsigned int fetch_random_seed;
+
+// per block latency of recent downloads, in milli seconds
+long long int hedge_latencies[HEDGE_LATENCY_SAMPLES];
+uint32_t hedge_latency_count = 0;
+long long int hedge_delay = 0;          // 0 until there are enough samples
+
+pthread_mutex_t read_streams_lock;
+struct ReadStream read_streams[READ_STREAM_COUNT];
+uint32_t readahead_limit;
+volatile int readahead_outstanding = 0; // blocks with prefetched flag set
+
+// counters are only updated with atomic increments
+struct FileCacheStats cache_stats;
 
 // forward declarations
-void *block_fetcher_thread(void *args);
+void *block_fetch_thread(void *args);
+void *disk_cache_thread(void *args);
 
 
 long long int time_msec() {
-    struct timeb t;
-    ftime(&t);
-    return (long long int)t.time * 1000 + (long long int)t.millitm;
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (long long int)t.tv_sec * 1000 + (long long int)t.tv_nsec / 1000000;
+}
+
+void init_monotonic_cond(pthread_cond_t *cond) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
 }
 
 void initialize_file_cache() {
-    file_cache = (struct CachedBlock **)calloc(CACHE_BLOCK_COUNT, sizeof(struct CachedBlock *));
+    long int cache_size_mb = DEFAULT_CACHE_SIZE_MB;
+    char *cache_size_env = getenv("DBBOX_CACHE_SIZE_MB");
+    if (cache_size_env != NULL) {
+        cache_size_mb = strtol(cache_size_env, NULL, 10);
+    }
+    cache_block_count = (int)((cache_size_mb << 20) / CACHE_BLOCK_SIZE);
+    if (cache_block_count < MIN_CACHE_BLOCK_COUNT) {
+        cache_block_count = MIN_CACHE_BLOCK_COUNT;
+    }
+    readahead_limit = cache_block_count / 4;
+    if (readahead_limit > MAX_READAHEAD_BLOCKS) {
+        readahead_limit = MAX_READAHEAD_BLOCKS;
+    }
+
+    long int transfer_count = DEFAULT_FETCH_TRANSFERS;
+    char *transfer_count_env = getenv("DBBOX_FETCH_TRANSFERS");
+    if (transfer_count_env != NULL) {
+        transfer_count = strtol(transfer_count_env, NULL, 10);
+    }
+    // every transfer downloads a different cache block
+    if (transfer_count > cache_block_count) {
+        transfer_count = cache_block_count;
+    }
+    if (transfer_count < 1) {
+        transfer_count = 1;
+    }
+    fetch_transfer_count = (int)transfer_count;
+    // a quarter of transfers is kept for blocks that readers wait for
+    fetch_prefetch_limit = fetch_transfer_count - fetch_transfer_count / 4;
+
+    long int coalesce_blocks = DEFAULT_FETCH_COALESCE;
+    char *coalesce_blocks_env = getenv("DBBOX_FETCH_COALESCE_BLOCKS");
+    if (coalesce_blocks_env != NULL) {
+        coalesce_blocks = strtol(coalesce_blocks_env, NULL, 10);
+    }
+    // readahead never queues more blocks of one file
+    if (coalesce_blocks > (long int)MAX_READAHEAD_BLOCKS + 1) {
+        coalesce_blocks = (long int)MAX_READAHEAD_BLOCKS + 1;
+    }
+    if (coalesce_blocks < 1) {
+        coalesce_blocks = 1;
+    }
+    fetch_coalesce_blocks = (uint32_t)coalesce_blocks;
+    printf("[DEBUG] DBFiles cache size: %d blocks (%d MB), readahead limit: %u blocks, transfers: %d, "
+            "blocks per transfer: %u\n", cache_block_count, cache_block_count * (CACHE_BLOCK_SIZE >> 20),
+            readahead_limit, fetch_transfer_count, fetch_coalesce_blocks);
+
+    // block buffers are only touched when first used so untouched part of cache
+    // does not take any memory
+    file_cache = (struct CachedBlock *)calloc(cache_block_count, sizeof(struct CachedBlock));
     assert(file_cache != NULL);
+    for (int i = 0; i < cache_block_count; i++) {
+        file_cache[i].buffer = (char *)calloc(1, CACHE_BLOCK_SIZE);
+        assert(file_cache[i].buffer != NULL);
+        init_monotonic_cond(&file_cache[i].block_updated);
+    }
 
-    for (int i = 0; i < CACHE_BLOCK_COUNT; i++) {
-        file_cache[i] = (struct CachedBlock *)calloc(1, sizeof(struct CachedBlock));
-        assert(file_cache[i] != NULL);
+    // size hash tables to keep about one block per bucket
+    uint32_t buckets_per_shard = 1;
+    while (buckets_per_shard * CACHE_SHARD_COUNT < cache_block_count) {
+        buckets_per_shard <<= 1;
+    }
+    for (int i = 0; i < CACHE_SHARD_COUNT; i++) {
+        pthread_mutex_init(&cache_shards[i].lock, NULL);
+        cache_shards[i].bucket_mask = buckets_per_shard - 1;
+        cache_shards[i].buckets = (struct CachedBlock **)calloc(buckets_per_shard, sizeof(struct CachedBlock *));
+        assert(cache_shards[i].buckets != NULL);
     }
 
-    curl_global_init(CURL_GLOBAL_ALL);
-    pthread_mutex_init(&file_cache_lock, NULL);
+    initialize_disk_cache();
 
-    // create block fetcher threads
-    for (int i = 0; i < BLOCK_FETCHER_THREAD_COUNT; i++) {
-        pthread_attr_t attr;
-        pthread_attr_init(&attr);
-        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-        pthread_attr_setstacksize(&attr, 128 * 1024);
+    curl_global_init(CURL_GLOBAL_ALL);
+    pthread_mutex_init(&cache_evict_lock, NULL);
+    pthread_mutex_init(&fetch_queue_lock, NULL);
+    pthread_mutex_init(&read_streams_lock, NULL);
+    pthread_mutex_init(&disk_queue_lock, NULL);
+    pthread_cond_init(&disk_queue_work, NULL);
+    fetch_random_seed = (unsigned int)time_msec();
 
-        pthread_t thread;
-        pthread_create(&thread, &attr, block_fetcher_thread, NULL);
+    int ret = pipe2(fetch_wakeup_pipe, O_NONBLOCK | O_CLOEXEC);
+    assert(ret == 0);
+    fetch_multi = curl_multi_init();
+    assert(fetch_multi != NULL);
+#ifdef CURLPIPE_MULTIPLEX
+    curl_multi_setopt(fetch_multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+    curl_multi_setopt(fetch_multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)fetch_transfer_count);
+    fetch_transfers = (struct BlockTransfer *)calloc(fetch_transfer_count, sizeof(struct BlockTransfer));
+    assert(fetch_transfers != NULL);
+    for (int i = 0; i < fetch_transfer_count; i++) {
+        fetch_transfers[i].request = create_file_request();
+        fetch_transfers[i].blocks = (struct CachedBlock **)calloc(fetch_coalesce_blocks, sizeof(struct CachedBlock *));
+        assert(fetch_transfers[i].blocks != NULL);
     }
+
+    // create block fetch and disk cache threads
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, 128 * 1024);
+
+    pthread_t thread;
+    pthread_create(&thread, &attr, block_fetch_thread, NULL);
+    pthread_create(&thread, &attr, disk_cache_thread, NULL);
 }
 
 void cleanup_file_cache() {
-    // TODO(ZM): for this function to actually cleanup stuff all block_fetcher_thread-s need
+    // TODO(ZM): for this function to actually cleanup stuff block_fetch_thread needs
     // to be terminated first!
-    pthread_mutex_destroy(&file_cache_lock);
-    for (int i = 0; i < CACHE_BLOCK_COUNT; i++) {
-        if (file_cache[i]->utf8path) {
-            free(file_cache[i]->utf8path);
+    pthread_mutex_destroy(&cache_evict_lock);
+    pthread_mutex_destroy(&fetch_queue_lock);
+    pthread_mutex_destroy(&read_streams_lock);
+    pthread_mutex_destroy(&disk_queue_lock);
+    pthread_cond_destroy(&disk_queue_work);
+    for (int i = 0; i < fetch_transfer_count; i++) {
+        if (fetch_transfers[i].block_count > 0) {
+            curl_multi_remove_handle(fetch_multi, fetch_transfers[i].curl);
+            cancel_file_request(fetch_transfers[i].request);
+        }
+        destroy_file_request(fetch_transfers[i].request);
+        free(fetch_transfers[i].blocks);
+    }
+    free(fetch_transfers);
+    curl_multi_cleanup(fetch_multi);
+    close(fetch_wakeup_pipe[0]);
+    close(fetch_wakeup_pipe[1]);
+    for (int i = 0; i < CACHE_SHARD_COUNT; i++) {
+        pthread_mutex_destroy(&cache_shards[i].lock);
+        free(cache_shards[i].buckets);
+    }
+    for (int i = 0; i < cache_block_count; i++) {
+        if (file_cache[i].utf8path) {
+            free(file_cache[i].utf8path);
         }
-        free(file_cache[i]);
+        pthread_cond_destroy(&file_cache[i].block_updated);
+        free(file_cache[i].buffer);
     }
     free(file_cache);
+    cleanup_disk_cache();
+}
+
+uint32_t block_key_hash(uint32_t file_id, char *rev, uint64_t block_offset) {
+    // FNV-1a over rev, mixed with file_id and block number
+    uint32_t hash = 2166136261u ^ (file_id * 0x85EBCA6Bu);
+    for (size_t i = 0; (i < DB_REV_SIZE) && (rev[i] != 0); i++) {
+        hash = (hash ^ (uint8_t)rev[i]) * 16777619u;
+    }
+    hash ^= (uint32_t)(block_offset / CACHE_BLOCK_SIZE) * 0x9E3779B1u;
+    return hash ^ (hash >> 16);
+}
+
+struct CacheShard *get_cache_shard(uint32_t key_hash) {
+    return &cache_shards[key_hash % CACHE_SHARD_COUNT];
+}
+
+struct CachedBlock **get_cache_bucket(struct CacheShard *shard, uint32_t key_hash) {
+    return &shard->buckets[(key_hash / CACHE_SHARD_COUNT) & shard->bucket_mask];
+}
+
+/// find_cache_block()
+///     Looks up block in shard hash index, shard lock must be held
+struct CachedBlock *find_cache_block(struct CacheShard *shard, uint32_t key_hash,
+        uint32_t file_id, char *rev, uint64_t block_offset) {
+    struct CachedBlock *block = *get_cache_bucket(shard, key_hash);
+    while (block != NULL) {
+        if ((block->key_hash == key_hash) &&
+                (block->file_id == file_id) &&
+                (block->offset == block_offset) &&
+                (memcmp(block->rev, rev, DB_REV_SIZE) == 0)) {
+            return block;
+        }
+        block = block->hash_next;
+    }
+    return NULL;
+}
+
+void unlink_cache_block(struct CachedBlock *block) {
+    struct CachedBlock **bucket = get_cache_bucket(block->shard, block->key_hash);
+    while (*bucket != block) {
+        assert(*bucket != NULL);
+        bucket = &(*bucket)->hash_next;
+    }
+    *bucket = block->hash_next;
+    block->hash_next = NULL;
+    block->shard = NULL;
 }
 
-int schedule_sector(size_t path_size, char *utf8path, char *rev, uint32_t offset) {
-    assert((offset & (BPB_BytesPerSector - 1)) == 0);
+/// evict_cache_block()
+///     Chooses unused block with CLOCK algorithm and removes it from the index.
+///     Prefetched blocks that were not read yet are only evicted if there is nothing
+///     else to evict. Returns NULL if every block is in use. Returned block must be
+///     passed to unclaim_cache_block once it is indexed again or not needed.
+struct CachedBlock *evict_cache_block() {
+    struct CachedBlock *victim = NULL;
+    pthread_mutex_lock(&cache_evict_lock);
+    // two sweeps are enough to clear all referenced bits, third one can take prefetched blocks
+    for (int i = 0; (i < 3 * cache_block_count) && (victim == NULL); i++) {
+        struct CachedBlock *block = &file_cache[cache_clock_hand];
+        cache_clock_hand = (cache_clock_hand + 1) % cache_block_count;
+        if (block->claimed) {
+            continue;
+        }
+        if (block->referenced) {
+            block->referenced = 0;
+            continue;
+        }
 
-    pthread_mutex_lock(&file_cache_lock);
-    uint32_t block_offset = offset & ~(CACHE_BLOCK_SIZE - 1);
-    int block_index = -1;
-    // check if block_offset is already in the cache
-    for (int i = 0; i < CACHE_BLOCK_COUNT; i++) {
-        if ((file_cache[i]->offset == block_offset) &&
-                (file_cache[i]->path_size == path_size) &&
-                (memcmp(file_cache[i]->utf8path, utf8path, file_cache[i]->path_size) == 0) &&
-                (memcmp(file_cache[i]->rev, rev, DB_REV_SIZE) == 0)) {
-            block_index = i;
+        struct CacheShard *shard = block->shard;
+        if (shard == NULL) {
+            victim = block;
             break;
         }
+        pthread_mutex_lock(&shard->lock);
+        if ((block->shard == shard) && (block->ref_count == 0) &&
+                (!block->prefetched || (i >= 2 * cache_block_count))) {
+            unlink_cache_block(block);
+            if (block->prefetched) {
+                block->prefetched = 0;
+                __sync_fetch_and_sub(&readahead_outstanding, 1);
+                __sync_fetch_and_add(&cache_stats.readahead_wasted, 1);
+            }
+            victim = block;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    if (victim != NULL) {
+        victim->claimed = 1;
+    }
+    pthread_mutex_unlock(&cache_evict_lock);
+    return victim;
+}
+
+void unclaim_cache_block(struct CachedBlock *block) {
+    pthread_mutex_lock(&cache_evict_lock);
+    block->claimed = 0;
+    pthread_mutex_unlock(&cache_evict_lock);
+}
+
+/// enqueue_fetch_list()
+///     Appends blocks linked with queue_next from first to last to the fetch queue
+void enqueue_fetch_list(struct CachedBlock *first, struct CachedBlock *last) {
+    pthread_mutex_lock(&fetch_queue_lock);
+    last->queue_next = NULL;
+    if (fetch_queue_tail == NULL) {
+        fetch_queue_head = first;
+    } else {
+        fetch_queue_tail->queue_next = first;
+    }
+    fetch_queue_tail = last;
+    int wakeup = !fetch_wakeup_pending;
+    fetch_wakeup_pending = 1;
+    pthread_mutex_unlock(&fetch_queue_lock);
+
+    if (wakeup) {
+        // pipe can only be full if fetch thread has not read it yet, it wakes up anyway
+        char c = 0;
+        if (write(fetch_wakeup_pipe[1], &c, 1) < 0) {
+            assert(errno == EAGAIN);
+        }
+    }
+}
+
+void enqueue_fetch(struct CachedBlock *block) {
+    enqueue_fetch_list(block, block);
+}
+
+/// dequeue_fetch()
+///     Removes scheduled block from the fetch queue, returns NULL if there is none.
+///     Blocks that readers are waiting for are downloaded before prefetched ones,
+///     which are only returned if allow_prefetch is set.
+struct CachedBlock *dequeue_fetch(int allow_prefetch) {
+    pthread_mutex_lock(&fetch_queue_lock);
+    // blocks enqueued from now on wake fetch thread again
+    fetch_wakeup_pending = 0;
+    if (fetch_queue_head == NULL) {
+        pthread_mutex_unlock(&fetch_queue_lock);
+        return NULL;
+    }
 
+    struct CachedBlock **it = &fetch_queue_head;
+    struct CachedBlock *prev = NULL;
+    while (((*it)->queue_next != NULL) && ((*it)->demand == 0)) {
+        prev = *it;
+        it = &(*it)->queue_next;
     }
+    if ((*it)->demand == 0) {
+        if (!allow_prefetch) {
+            pthread_mutex_unlock(&fetch_queue_lock);
+            return NULL;
+        }
+        // no demand blocks, take the oldest prefetched one
+        it = &fetch_queue_head;
+        prev = NULL;
+    }
+
+    struct CachedBlock *block = *it;
+    *it = block->queue_next;
+    if (fetch_queue_tail == block) {
+        fetch_queue_tail = prev;
+    }
+    block->queue_next = NULL;
+    pthread_mutex_unlock(&fetch_queue_lock);
+    return block;
+}
 
-    if (block_index == -1) {
-        // could not find block in the cache, so choose free block
-        // TODO(ZM): need to choose random block
-        for (int i = 0; i < CACHE_BLOCK_COUNT; i++) {
-            if ((file_cache[i]->ref_count == 0) &&
-                    ((block_index == -1) ||
-                     (file_cache[i]->last_access < file_cache[block_index]->last_access))) {
-                block_index = i;
+/// dequeue_next_fetch()
+///     Removes block that follows block in the same file from the fetch queue, returns
+///     NULL if it is not queued. Keys of queued blocks do not change, fetch queue
+///     holds their references.
+struct CachedBlock *dequeue_next_fetch(struct CachedBlock *block) {
+    pthread_mutex_lock(&fetch_queue_lock);
+    struct CachedBlock **it = &fetch_queue_head;
+    struct CachedBlock *prev = NULL;
+    while (*it != NULL) {
+        struct CachedBlock *next = *it;
+        if ((next->file_id == block->file_id) &&
+                (next->offset == block->offset + CACHE_BLOCK_SIZE) &&
+                (memcmp(next->rev, block->rev, DB_REV_SIZE) == 0)) {
+            *it = next->queue_next;
+            if (fetch_queue_tail == next) {
+                fetch_queue_tail = prev;
             }
+            next->queue_next = NULL;
+            pthread_mutex_unlock(&fetch_queue_lock);
+            return next;
+        }
+        prev = next;
+        it = &next->queue_next;
+    }
+    pthread_mutex_unlock(&fetch_queue_lock);
+    return NULL;
+}
+
+/// schedule_block()
+///     Returns referenced cache block for block_offset of file, scheduling its download
+///     if it is not in cache already. Returns NULL if there are no free blocks.
+struct CachedBlock *schedule_block(uint32_t file_id, size_t path_size, char *utf8path, char *rev,
+        uint64_t block_offset, uint8_t demand) {
+    assert((block_offset & (CACHE_BLOCK_SIZE - 1)) == 0);
+    uint32_t key_hash = block_key_hash(file_id, rev, block_offset);
+    struct CacheShard *shard = get_cache_shard(key_hash);
+
+    struct CachedBlock *new_block = NULL;
+    pthread_mutex_lock(&shard->lock);
+    struct CachedBlock *block = find_cache_block(shard, key_hash, file_id, rev, block_offset);
+    if (block == NULL) {
+        // evict outside of shard lock since eviction locks shards of other blocks
+        pthread_mutex_unlock(&shard->lock);
+        new_block = evict_cache_block();
+        if (new_block == NULL) {
+            printf("[ERROR] DBFiles no free cache blocks: %s, offset: %llu...\n", utf8path, (unsigned long long)block_offset);
+            return NULL;
         }
+        pthread_mutex_lock(&shard->lock);
 
-        // There should always be at least one free block
-        assert(block_index != -1);
+        // somebody else could have added the same block in the meantime, in that
+        // case new_block stays unindexed and is picked up by the next eviction
+        block = find_cache_block(shard, key_hash, file_id, rev, block_offset);
+        if (block == NULL) {
+            block = new_block;
+            block->key_hash = key_hash;
+            block->file_id = file_id;
+            block->offset = block_offset;
+            block->path_size = path_size;
+            block->utf8path = realloc(block->utf8path, path_size);
+            assert(block->utf8path != NULL);
+            memcpy(block->utf8path, utf8path, path_size);
+            memcpy(block->rev, rev, DB_REV_SIZE);
 
-        file_cache[block_index]->offset = block_offset;
-        file_cache[block_index]->path_size = path_size;
-        file_cache[block_index]->utf8path = realloc(file_cache[block_index]->utf8path, file_cache[block_index]->path_size);
-        assert(file_cache[block_index]->utf8path != NULL);
-        memcpy(file_cache[block_index]->utf8path, utf8path, file_cache[block_index]->path_size);
-        memcpy(file_cache[block_index]->rev, rev, DB_REV_SIZE);
+            struct CachedBlock **bucket = get_cache_bucket(shard, key_hash);
+            block->shard = shard;
+            block->hash_next = *bucket;
+            *bucket = block;
+
+            // reference held by fetch queue
+            block->ref_count = 1;
+            block->demand = 0;
+            block->prefetched = !demand;
+            block->valid_size = 0;
+            block->deadline = 0;
+            block->attempts = 0;
+            block->disk_checked = !is_disk_cache_enabled();
+            block->block_state = SCHEDULED;
+            if (block->prefetched) {
+                __sync_fetch_and_add(&readahead_outstanding, 1);
+            }
+            enqueue_fetch(block);
 
-        file_cache[block_index]->block_state = SCHEDULED;
+            __sync_fetch_and_add(demand ? &cache_stats.block_misses : &cache_stats.readahead_blocks, 1);
+        }
     }
 
-    file_cache[block_index]->last_access = time_msec();
-    file_cache[block_index]->ref_count++;
-    pthread_mutex_unlock(&file_cache_lock);
+    if (demand && (block->block_state == FAILED)) {
+        // download was given up before, new read tries again
+        block->attempts = 0;
+        block->block_state = SCHEDULED;
+        block->ref_count++;
+        enqueue_fetch(block);
+    }
+    if (demand) {
+        long long int deadline = time_msec() + READ_SECTOR_TIMEOUT;
+        if (block->deadline < deadline) {
+            block->deadline = deadline;
+        }
+        block->demand = 1;
+        if (block->prefetched) {
+            block->prefetched = 0;
+            __sync_fetch_and_sub(&readahead_outstanding, 1);
+            __sync_fetch_and_add(&cache_stats.readahead_used, 1);
+        }
+    }
+    block->referenced = 1;
+    block->ref_count++;
+    pthread_mutex_unlock(&shard->lock);
 
-    return block_index;
+    if (new_block != NULL) {
+        unclaim_cache_block(new_block);
+    }
+    return block;
 }
 
-void release_cache_block(int block_index) {
-    pthread_mutex_lock(&file_cache_lock);
-    file_cache[block_index]->ref_count--;
-    pthread_mutex_unlock(&file_cache_lock);
+void release_cache_block(struct CachedBlock *block) {
+    struct CacheShard *shard = block->shard;
+    pthread_mutex_lock(&shard->lock);
+    block->ref_count--;
+    pthread_mutex_unlock(&shard->lock);
 }
 
 
-int read_sector_from_cache(size_t path_size, char *utf8path, char *rev, uint32_t offset, uint32_t file_size, uint8_t *buf) {
-    int prefetch_count = (file_size - offset + CACHE_BLOCK_SIZE - 1) / CACHE_BLOCK_SIZE;
-    if (prefetch_count > MAX_BLOCK_PREFETCH) {
-        prefetch_count = MAX_BLOCK_PREFETCH;
+/// update_read_stream()
+///     Tracks reads of a file and returns range of blocks to read ahead, range is
+///     empty if nothing needs to be scheduled.
+void update_read_stream(uint32_t file_id, uint64_t offset, uint32_t size, uint64_t file_size,
+        uint64_t *readahead_start, uint64_t *readahead_end) {
+    uint64_t block_offset = offset & ~((uint64_t)CACHE_BLOCK_SIZE - 1);
+    *readahead_start = 0;
+    *readahead_end = 0;
+
+    pthread_mutex_lock(&read_streams_lock);
+    struct ReadStream *stream = NULL;
+    struct ReadStream *oldest = &read_streams[0];
+    for (int i = 0; i < READ_STREAM_COUNT; i++) {
+        if ((read_streams[i].last_access != 0) && (read_streams[i].file_id == file_id)) {
+            stream = &read_streams[i];
+            break;
+        }
+        if (read_streams[i].last_access < oldest->last_access) {
+            oldest = &read_streams[i];
+        }
     }
 
-    assert(prefetch_count <= 16);
-    int block_indexes[16] = { 0 };
+    if (stream == NULL) {
+        // new stream replaces least recently used one, files that are read from
+        // the beginning are likely to be read sequentially
+        stream = oldest;
+        stream->file_id = file_id;
+        stream->next_offset = offset + size;
+        stream->readahead_end = 0;
+        stream->window = (offset == 0) ? 1 : 0;
+    } else if ((offset + READ_STREAM_SLACK >= stream->next_offset) &&
+            (offset <= stream->next_offset + READ_STREAM_SLACK)) {
+        // sequential read, grow window when stream moves to the next block
+        uint64_t last_block_offset = (stream->next_offset - 1) & ~((uint64_t)CACHE_BLOCK_SIZE - 1);
+        if (block_offset > last_block_offset) {
+            stream->window = (stream->window == 0) ? 1 : stream->window * 2;
+        }
+        if (offset + size > stream->next_offset) {
+            stream->next_offset = offset + size;
+        }
+    } else {
+        stream->next_offset = offset + size;
+        stream->readahead_end = 0;
+        stream->window = 0;
+    }
+    if (stream->window > readahead_limit) {
+        stream->window = readahead_limit;
+    }
+    stream->last_access = time_msec();
 
-    for (int i = prefetch_count - 1; i >= 0; i--) {
-        // schedule blocks in reverse order since they get prioritized backwards
-        block_indexes[i] = schedule_sector(path_size, utf8path, rev, offset + CACHE_BLOCK_SIZE * i);
+    uint64_t window_end = block_offset + (uint64_t)(stream->window + 1) * CACHE_BLOCK_SIZE;
+    if (window_end > file_size) {
+        window_end = file_size;
+    }
+    // window is extended by several blocks at once so that they are downloaded with
+    // one request, unless the next block or end of file is not scheduled yet
+    uint64_t batch_size = (uint64_t)((stream->window + 1) / 2) * CACHE_BLOCK_SIZE;
+    if (batch_size > (uint64_t)fetch_coalesce_blocks * CACHE_BLOCK_SIZE) {
+        batch_size = (uint64_t)fetch_coalesce_blocks * CACHE_BLOCK_SIZE;
     }
+    // prefetched blocks that were not read yet can take at most a quarter of the cache,
+    // rest is left for blocks that readers are waiting for
+    if ((stream->window > 0) && (window_end > stream->readahead_end) &&
+            (readahead_outstanding < cache_block_count / 4)) {
+        uint64_t start = block_offset + CACHE_BLOCK_SIZE;
+        if (start < stream->readahead_end) {
+            start = stream->readahead_end;
+        }
+        if (start >= window_end) {
+            stream->readahead_end = window_end;
+        } else if ((window_end - start >= batch_size) || (window_end == file_size) ||
+                (start == block_offset + CACHE_BLOCK_SIZE)) {
+            *readahead_start = start;
+            *readahead_end = window_end;
+            stream->readahead_end = window_end;
+        }
+    }
+    pthread_mutex_unlock(&read_streams_lock);
+}
 
-    int block_index = block_indexes[0];
+/// read_block_from_cache()
+///     Reads size bytes at offset of a file, range must be within one cache block.
+///     Data is copied straight from the cache block into buf as soon as requested
+///     range is downloaded, even if rest of the block is still downloading.
+int read_block_from_cache(uint32_t file_id, size_t path_size, char *utf8path, char *rev,
+        uint64_t offset, uint32_t size, uint8_t *buf) {
+    assert((offset & (CACHE_BLOCK_SIZE - 1)) + size <= CACHE_BLOCK_SIZE);
+    uint64_t block_offset = offset & ~((uint64_t)CACHE_BLOCK_SIZE - 1);
 
-    long long int start_time = time_msec();
-    long long int current_time = start_time;
-    while ((file_cache[block_index]->block_state != COMPLETED) &&
-            (current_time - start_time <= READ_SECTOR_TIMEOUT)) {
-        usleep(100 * 1000);
-        current_time = time_msec();
+    __sync_fetch_and_add(&cache_stats.block_reads, 1);
+    struct CachedBlock *block = schedule_block(file_id, path_size, utf8path, rev, block_offset, 1);
+    uint32_t valid_size = 0;
+    uint32_t required_size = (uint32_t)(offset - block_offset) + size;
+    if (block != NULL) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += READ_SECTOR_TIMEOUT / 1000;
+
+        pthread_mutex_lock(&block->shard->lock);
+        block->waiters++;
+        int wait_ret = 0;
+        while ((block->valid_size < required_size) && (block->block_state != FAILED) && (wait_ret != ETIMEDOUT)) {
+            wait_ret = pthread_cond_timedwait(&block->block_updated, &block->shard->lock, &deadline);
+        }
+        block->waiters--;
+        valid_size = block->valid_size;
+        pthread_mutex_unlock(&block->shard->lock);
     }
 
     int ret;
-    if (file_cache[block_index]->block_state != COMPLETED) {
-        printf("[DEBUG] DBFiles failed to read sector: %s, offset: %u...\n", utf8path, offset);
+    if (valid_size < required_size) {
+        printf("[DEBUG] DBFiles failed to read data: %s, offset: %llu, size: %u...\n",
+                utf8path, (unsigned long long)offset, size);
         ret = -1;
     } else {
-        memcpy(buf, &(file_cache[block_index]->buffer[offset & (CACHE_BLOCK_SIZE - 1)]), BPB_BytesPerSector);
+        memcpy(buf, &(block->buffer[offset - block_offset]), size);
         ret = 0;
     }
 
-    for (int i = 0; i < prefetch_count; i++) {
-        release_cache_block(block_indexes[i]);
+    if (block != NULL) {
+        release_cache_block(block);
+    }
+    return ret;
+}
+
+int read_file_from_cache(uint32_t file_id, size_t path_size, char *utf8path, char *rev,
+        uint64_t offset, uint32_t size, uint64_t file_size, uint8_t *buf) {
+    assert(offset + size <= file_size);
+
+    // schedule requested block before readahead so it does not wait behind prefetched blocks
+    // for a free cache block
+    struct CachedBlock *first_block = schedule_block(
+            file_id, path_size, utf8path, rev, offset & ~((uint64_t)CACHE_BLOCK_SIZE - 1), 1);
+
+    uint64_t readahead_start, readahead_end;
+    update_read_stream(file_id, offset, size, file_size, &readahead_start, &readahead_end);
+    for (uint64_t block_offset = readahead_start; block_offset < readahead_end; block_offset += CACHE_BLOCK_SIZE) {
+        struct CachedBlock *block = schedule_block(file_id, path_size, utf8path, rev, block_offset, 0);
+        if (block == NULL) {
+            break;
+        }
+        release_cache_block(block);
+    }
+
+    int ret = 0;
+    uint32_t buf_offset = 0;
+    while (buf_offset < size) {
+        uint32_t block_index = (offset + buf_offset) & (CACHE_BLOCK_SIZE - 1);
+        uint32_t read_size = CACHE_BLOCK_SIZE - block_index;
+        if (read_size > size - buf_offset) {
+            read_size = size - buf_offset;
+        }
+
+        ret = read_block_from_cache(file_id, path_size, utf8path, rev, offset + buf_offset, read_size, &buf[buf_offset]);
+        if (ret) {
+            break;
+        }
+        buf_offset += read_size;
+    }
+
+    if (first_block != NULL) {
+        release_cache_block(first_block);
     }
     return ret;
 }
 
-void *block_fetcher_thread(void *args) {
-    CURL *curl = curl_easy_init();
-    int block_index;
+void get_file_cache_stats(struct FileCacheStats *stats) {
+    *stats = cache_stats;
+}
+
+/// write_block_data()
+///     Appends downloaded data to block and wakes up readers that wait for it
+size_t write_block_data(char *data, size_t size, void *write_data) {
+    struct CachedBlock *block = (struct CachedBlock *)write_data;
+    if (block->valid_size + size > CACHE_BLOCK_SIZE) {
+        printf("[ERROR] DBFiles received more data than requested: %s, offset: %llu...\n",
+                block->utf8path, (unsigned long long)block->offset);
+        return 0;
+    }
+    // only fetch thread writes valid_size so it can be read without lock here
+    memcpy(&block->buffer[block->valid_size], data, size);
 
+    pthread_mutex_lock(&block->shard->lock);
+    block->valid_size += size;
+    if (block->waiters > 0) {
+        pthread_cond_broadcast(&block->block_updated);
+    }
+    pthread_mutex_unlock(&block->shard->lock);
+    return size;
+}
+
+/// enqueue_disk_list()
+///     Appends blocks linked with queue_next from first to last to the disk queue
+void enqueue_disk_list(struct CachedBlock *first, struct CachedBlock *last) {
+    pthread_mutex_lock(&disk_queue_lock);
+    last->queue_next = NULL;
+    if (disk_queue_tail == NULL) {
+        disk_queue_head = first;
+    } else {
+        disk_queue_tail->queue_next = first;
+    }
+    disk_queue_tail = last;
+    pthread_cond_signal(&disk_queue_work);
+    pthread_mutex_unlock(&disk_queue_lock);
+}
+
+/// lookup_block_on_disk()
+///     Collects block for disk thread to search for in disk cache, lookups are handed
+///     over by flush_disk_lookups
+void lookup_block_on_disk(struct CachedBlock *block) {
+    block->queue_next = NULL;
+    if (disk_lookup_tail == NULL) {
+        disk_lookup_head = block;
+    } else {
+        disk_lookup_tail->queue_next = block;
+    }
+    disk_lookup_tail = block;
+}
+
+void flush_disk_lookups() {
+    if (disk_lookup_head != NULL) {
+        enqueue_disk_list(disk_lookup_head, disk_lookup_tail);
+        disk_lookup_head = NULL;
+        disk_lookup_tail = NULL;
+    }
+}
+
+/// complete_block_fetch()
+///     Marks downloaded block completed and releases reference of its download, block
+///     that was not read from disk cache is passed to disk thread to store it first
+void complete_block_fetch(struct CachedBlock *block, int from_disk, size_t block_size) {
+    // part of the block past end of file reads as zeros
+    memset(&block->buffer[block_size], 0, CACHE_BLOCK_SIZE - block_size);
+
+    pthread_mutex_lock(&block->shard->lock);
+    block->valid_size = CACHE_BLOCK_SIZE;
+    block->block_state = COMPLETED;
+    pthread_cond_broadcast(&block->block_updated);
+    pthread_mutex_unlock(&block->shard->lock);
+
+    // block buffer can't change while disk thread still holds its reference
+    if (!from_disk && is_disk_cache_enabled()) {
+        block->data_size = (uint32_t)block_size;
+        enqueue_disk_list(block, block);
+        return;
+    }
+    release_cache_block(block);
+}
+
+/// retry_block_fetch()
+///     Schedules download of failed block again after backoff. Block is given up if the
+///     error can't be fixed by retrying, if retry would start after deadline of readers
+///     that wait for it, or if nobody waits for it and it failed too many times.
+void retry_block_fetch(struct CachedBlock *block, enum RequestError error, long int retry_after) {
+    block->attempts++;
+    long long int delay = RETRY_MAX_DELAY;
+    if (block->attempts < 16) {
+        delay = (long long int)RETRY_BASE_DELAY << (block->attempts - 1);
+        if (delay > RETRY_MAX_DELAY) {
+            delay = RETRY_MAX_DELAY;
+        }
+    }
+    // random half of delay spreads retries of blocks that failed together
+    delay = delay / 2 + rand_r(&fetch_random_seed) % (delay / 2 + 1);
+    long long int now = time_msec();
+    if (error == REQUEST_RATE_LIMITED) {
+        if (delay < (long long int)retry_after * 1000) {
+            delay = (long long int)retry_after * 1000;
+        }
+        // limit is for all requests, not only this one
+        if (fetch_paused_until < now + delay) {
+            fetch_paused_until = now + delay;
+        }
+    }
+
+    pthread_mutex_lock(&block->shard->lock);
+    int give_up;
+    if (error == REQUEST_CLIENT_ERROR) {
+        give_up = 1;
+    } else if (block->waiters > 0) {
+        give_up = (now + delay >= block->deadline);
+    } else {
+        give_up = (block->attempts >= RETRY_MAX_ATTEMPTS);
+    }
+    block->block_state = give_up ? FAILED : SCHEDULED;
+    if (give_up) {
+        pthread_cond_broadcast(&block->block_updated);
+    }
+    pthread_mutex_unlock(&block->shard->lock);
+
+    if (give_up) {
+        printf("[ERROR] DBFiles gave up download of block: %s, offset: %llu, attempts: %u...\n",
+                block->utf8path, (unsigned long long)block->offset, block->attempts);
+        __sync_fetch_and_add(&cache_stats.failed_blocks, 1);
+        release_cache_block(block);
+    } else {
+        printf("[DEBUG] DBFiles retrying block: %s, offset: %llu, attempts: %u, in: %lld ms...\n",
+                block->utf8path, (unsigned long long)block->offset, block->attempts, delay);
+        __sync_fetch_and_add(&cache_stats.retried_blocks, 1);
+        // retry list keeps reference of the fetch queue
+        block->retry_time = now + delay;
+        block->queue_next = fetch_retry_head;
+        fetch_retry_head = block;
+    }
+}
+
+/// start_due_retries()
+///     Moves failed blocks whose retry time has come back to the fetch queue
+void start_due_retries(long long int now) {
+    struct CachedBlock **it = &fetch_retry_head;
+    while (*it != NULL) {
+        struct CachedBlock *block = *it;
+        if (block->retry_time <= now) {
+            *it = block->queue_next;
+            enqueue_fetch(block);
+        } else {
+            it = &block->queue_next;
+        }
+    }
+}
+
+long long int get_next_retry_time() {
+    long long int next_retry = 0;
+    for (struct CachedBlock *block = fetch_retry_head; block != NULL; block = block->queue_next) {
+        if ((next_retry == 0) || (block->retry_time < next_retry)) {
+            next_retry = block->retry_time;
+        }
+    }
+    return next_retry;
+}
+
+/// write_transfer_data()
+///     Splits downloaded data of transfer between its blocks in order of offsets. If
+///     download is hedged, bytes that the other transfer received first are skipped.
+///     Each of them starts at or before the end of valid data and block grows with the
+///     one that is ahead, so there are no gaps.
+size_t write_transfer_data(char *data, size_t size, void *write_data) {
+    struct BlockTransfer *transfer = (struct BlockTransfer *)write_data;
+    uint64_t first_offset = transfer->blocks[0]->offset;
+    if (transfer->position + size > first_offset + (uint64_t)transfer->block_count * CACHE_BLOCK_SIZE) {
+        printf("[ERROR] DBFiles received more data than requested: %s, offset: %llu...\n",
+                transfer->blocks[0]->utf8path, (unsigned long long)first_offset);
+        return 0;
+    }
+
+    size_t written = 0;
+    while (written < size) {
+        struct CachedBlock *block = transfer->blocks[(transfer->position - first_offset) / CACHE_BLOCK_SIZE];
+        uint32_t block_index = (uint32_t)(transfer->position - block->offset);
+        uint32_t chunk_size = CACHE_BLOCK_SIZE - block_index;
+        if (chunk_size > size - written) {
+            chunk_size = (uint32_t)(size - written);
+        }
+        assert(block_index <= block->valid_size);
+        if (block_index + chunk_size > block->valid_size) {
+            uint32_t skip = block->valid_size - block_index;
+            write_block_data(&data[written + skip], chunk_size - skip, block);
+        }
+        written += chunk_size;
+        transfer->position += chunk_size;
+    }
+    return size;
+}
+
+/// read_block_from_disk_cache()
+///     Completes block with data from disk cache, returns 0 if it was there
+int read_block_from_disk_cache(struct CachedBlock *block) {
+    size_t block_size;
+    if (read_block_from_disk(block->path_size, block->utf8path, block->rev,
+                block->offset, block->buffer, CACHE_BLOCK_SIZE, &block_size) != 0) {
+        return -1;
+    }
+    printf("[DEBUG] DBFiles read block from disk cache: %s, offset: %llu...\n",
+            block->utf8path, (unsigned long long)block->offset);
+    complete_block_fetch(block, 1, block_size);
+    return 0;
+}
+
+void set_block_state(struct CachedBlock *block, enum BlockState block_state) {
+    pthread_mutex_lock(&block->shard->lock);
+    block->block_state = block_state;
+    pthread_mutex_unlock(&block->shard->lock);
+}
+
+struct BlockTransfer *get_free_transfer() {
+    for (int i = 0; i < fetch_transfer_count; i++) {
+        if (fetch_transfers[i].block_count == 0) {
+            return &fetch_transfers[i];
+        }
+    }
+    assert(0);
+    return NULL;
+}
+
+/// start_transfer()
+///     Requests blocks of transfer from its position to the end of the last block.
+///     Request gets PREFETCH_TIMEOUT for every block. Reader that waits for one of the
+///     blocks only needs the blocks up to its own by its deadline, so the deadline
+///     limits the whole request in proportion to the number of blocks.
+void start_transfer(struct BlockTransfer *transfer, int fresh_connection) {
+    struct CachedBlock *first_block = transfer->blocks[0];
+    long long int now = time_msec();
+    long long int timeout = (long long int)PREFETCH_TIMEOUT * transfer->block_count;
+    for (int i = 0; i < transfer->block_count; i++) {
+        struct CachedBlock *block = transfer->blocks[i];
+        pthread_mutex_lock(&block->shard->lock);
+        if ((block->waiters > 0) && (block->deadline > now)) {
+            long long int reader_timeout = (block->deadline - now) * transfer->block_count / (i + 1);
+            if (reader_timeout < timeout) {
+                timeout = reader_timeout;
+            }
+        }
+        pthread_mutex_unlock(&block->shard->lock);
+    }
+
+    transfer->start_time = now;
+    transfer->curl = start_file_request(transfer->request,
+            first_block->utf8path,
+            first_block->rev,
+            (int64_t)transfer->position,
+            (int64_t)(first_block->offset + (uint64_t)transfer->block_count * CACHE_BLOCK_SIZE),
+            (long int)timeout, fresh_connection, write_transfer_data, transfer);
+    curl_easy_setopt(transfer->curl, CURLOPT_PRIVATE, transfer);
+    curl_multi_add_handle(fetch_multi, transfer->curl);
+    fetch_active_transfers++;
+}
+
+/// start_block_fetch()
+///     Takes over reference of block that was held by fetch queue and starts its
+///     download with transfer, block was searched for in disk cache before. Queued
+///     blocks that follow it in the same file are downloaded by the same request, up
+///     to fetch_coalesce_blocks in total.
+void start_block_fetch(struct BlockTransfer *transfer, struct CachedBlock *block) {
+    set_block_state(block, DOWNLOADING);
+
+    if (block->valid_size == CACHE_BLOCK_SIZE) {
+        complete_block_fetch(block, 0, CACHE_BLOCK_SIZE);
+        return;
+    }
+
+    transfer->blocks[0] = block;
+    transfer->block_count = 1;
+    while (transfer->block_count < fetch_coalesce_blocks) {
+        struct CachedBlock *next = dequeue_next_fetch(transfer->blocks[transfer->block_count - 1]);
+        if (next == NULL) {
+            break;
+        }
+        if (next->valid_size > 0) {
+            // resumes with request of its own
+            enqueue_fetch(next);
+            break;
+        }
+        if (!next->disk_checked) {
+            lookup_block_on_disk(next);
+            break;
+        }
+        set_block_state(next, DOWNLOADING);
+        transfer->blocks[transfer->block_count++] = next;
+        __sync_fetch_and_add(&cache_stats.coalesced_blocks, 1);
+    }
+
+    // download file blocks straight into block buffers
+    printf("[DEBUG] DBFiles downloading block: %s, offset: %llu, blocks: %d, resume at: %u, slot: %d...\n",
+            block->utf8path, (unsigned long long)block->offset, transfer->block_count, block->valid_size,
+            (int)(block - file_cache));
+    transfer->position = block->offset + block->valid_size;
+    transfer->hedge = NULL;
+    transfer->hedged = 0;
+    start_transfer(transfer, 0);
+}
+
+int compare_latencies(const void *a, const void *b) {
+    long long int latency_a = *(const long long int *)a;
+    long long int latency_b = *(const long long int *)b;
+    return (latency_a > latency_b) - (latency_a < latency_b);
+}
+
+/// add_hedge_latency()
+///     Adds per block latency of finished download and updates hedge_delay to 95th
+///     percentile of recent ones
+void add_hedge_latency(long long int latency) {
+    hedge_latencies[hedge_latency_count % HEDGE_LATENCY_SAMPLES] = latency;
+    hedge_latency_count++;
+    if (hedge_latency_count < HEDGE_MIN_SAMPLES) {
+        return;
+    }
+
+    uint32_t count = (hedge_latency_count < HEDGE_LATENCY_SAMPLES) ? hedge_latency_count : HEDGE_LATENCY_SAMPLES;
+    long long int sorted[HEDGE_LATENCY_SAMPLES];
+    memcpy(sorted, hedge_latencies, count * sizeof(long long int));
+    qsort(sorted, count, sizeof(long long int), compare_latencies);
+    hedge_delay = sorted[count * 95 / 100];
+    if (hedge_delay < HEDGE_MIN_DELAY) {
+        hedge_delay = HEDGE_MIN_DELAY;
+    }
+}
+
+/// hedge_slow_transfers()
+///     Duplicates first downloads of blocks that readers wait for if they take longer
+///     than hedge_delay per block. Returns time when the next download should be
+///     hedged, or 0.
+long long int hedge_slow_transfers(long long int now) {
+    long long int next_hedge = 0;
+    if (hedge_delay == 0) {
+        return 0;
+    }
+    for (int i = 0; i < fetch_transfer_count; i++) {
+        struct BlockTransfer *transfer = &fetch_transfers[i];
+        struct CachedBlock *first_block = transfer->blocks[0];
+        if ((transfer->block_count == 0) || transfer->hedged || !first_block->demand || (first_block->attempts > 0) ||
+                (transfer->position == first_block->offset + (uint64_t)transfer->block_count * CACHE_BLOCK_SIZE)) {
+            continue;
+        }
+        long long int hedge_time = transfer->start_time + hedge_delay * transfer->block_count;
+        if (hedge_time > now) {
+            if ((next_hedge == 0) || (hedge_time < next_hedge)) {
+                next_hedge = hedge_time;
+            }
+            continue;
+        }
+        if (fetch_active_transfers >= fetch_transfer_count) {
+            // checked again when a transfer finishes
+            break;
+        }
+
+        printf("[DEBUG] DBFiles hedging download of block: %s, offset: %llu, blocks: %d, after: %lld ms...\n",
+                first_block->utf8path, (unsigned long long)first_block->offset, transfer->block_count,
+                now - transfer->start_time);
+        __sync_fetch_and_add(&cache_stats.hedged_requests, 1);
+        struct BlockTransfer *hedge = get_free_transfer();
+        memcpy(hedge->blocks, transfer->blocks, transfer->block_count * sizeof(struct CachedBlock *));
+        hedge->block_count = transfer->block_count;
+        hedge->position = transfer->position;
+        hedge->hedge = transfer;
+        hedge->hedged = 1;
+        transfer->hedge = hedge;
+        transfer->hedged = 1;
+        start_transfer(hedge, 1);
+    }
+    return next_hedge;
+}
+
+/// finish_block_fetch()
+///     Completes blocks of finished transfer, or schedules retries of those that were
+///     not received. If download was hedged, the first transfer that succeeds cancels
+///     the other one and the first one that fails leaves blocks to the other one.
+void finish_block_fetch(struct BlockTransfer *transfer, CURLcode result) {
+    curl_multi_remove_handle(fetch_multi, transfer->curl);
+    fetch_active_transfers--;
+    long int retry_after;
+    enum RequestError error = finish_file_request(transfer->request, result, &retry_after);
+
+    struct BlockTransfer *hedge = transfer->hedge;
+    int block_count = transfer->block_count;
+    transfer->block_count = 0;
+    transfer->hedge = NULL;
+    if (hedge != NULL) {
+        hedge->hedge = NULL;
+        if (error != REQUEST_OK) {
+            return;
+        }
+        curl_multi_remove_handle(fetch_multi, hedge->curl);
+        cancel_file_request(hedge->request);
+        hedge->block_count = 0;
+        fetch_active_transfers--;
+    }
+
+    if (error == REQUEST_OK) {
+        // latency of hedged download is counted from its first request
+        long long int start_time = transfer->start_time;
+        if ((hedge != NULL) && (hedge->start_time < start_time)) {
+            start_time = hedge->start_time;
+            __sync_fetch_and_add(&cache_stats.hedge_wins, 1);
+        }
+        add_hedge_latency((time_msec() - start_time) / block_count);
+    }
+
+    for (int i = 0; i < block_count; i++) {
+        struct CachedBlock *block = transfer->blocks[i];
+        // blocks that were received whole are completed even if the rest failed
+        if ((error == REQUEST_OK) || (block->valid_size == CACHE_BLOCK_SIZE)) {
+            printf("[DEBUG] DBFiles successfully downloaded block: %s, offset: %llu...\n",
+                    block->utf8path, (unsigned long long)block->offset);
+            complete_block_fetch(block, 0, block->valid_size);
+        } else {
+            printf("[DEBUG] DBFiles failed to download block: %s, offset: %llu, downloaded: %u...\n",
+                    block->utf8path, (unsigned long long)block->offset, block->valid_size);
+            retry_block_fetch(block, error, retry_after);
+        }
+    }
+}
+
+/// block_fetch_thread()
+///     Runs all block downloads on curl multi handle, so number of downloads in flight
+///     is limited by fetch_transfer_count instead of number of threads. Starts queued
+///     blocks whenever transfers are free and sleeps until sockets of transfers, fetch
+///     queue, retries or hedging have something to do.
+void *block_fetch_thread(void *args) {
     while (1) {
-        pthread_mutex_lock(&file_cache_lock);
-        block_index = -1;
-        for (int i = 0; i < CACHE_BLOCK_COUNT; i++) {
-            // Prioritize block downloading first by ref_count then by offset
-            if ((file_cache[i]->block_state == SCHEDULED) &&
-                    ((block_index == -1) ||
-                     (file_cache[i]->ref_count > file_cache[block_index]->ref_count) ||
-                     ((file_cache[i]->ref_count == file_cache[block_index]->ref_count) &&
-                      (file_cache[i]->offset < file_cache[block_index]->offset)))) {
-                block_index = i;
+        long long int now = time_msec();
+        start_due_retries(now);
+        long long int next_hedge = 0;
+        if (now >= fetch_paused_until) {
+            while (fetch_active_transfers < fetch_transfer_count) {
+                struct CachedBlock *block = dequeue_fetch(fetch_active_transfers < fetch_prefetch_limit);
+                if (block == NULL) {
+                    break;
+                }
+                if (block->disk_checked) {
+                    start_block_fetch(get_free_transfer(), block);
+                } else {
+                    lookup_block_on_disk(block);
+                }
+            }
+            flush_disk_lookups();
+            next_hedge = hedge_slow_transfers(now);
+        }
+
+        int running;
+        curl_multi_perform(fetch_multi, &running);
+
+        CURLMsg *message;
+        int messages_left;
+        int finished = 0;
+        while ((message = curl_multi_info_read(fetch_multi, &messages_left)) != NULL) {
+            if (message->msg != CURLMSG_DONE) {
+                continue;
             }
+            // message is freed when its handle is removed
+            CURLcode result = message->data.result;
+            struct BlockTransfer *transfer;
+            curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, (char **)&transfer);
+            if (transfer->block_count > 0) {
+                finish_block_fetch(transfer, result);
+            }
+            finished = 1;
+        }
+        if (finished) {
+            // freed transfers can start blocks that stayed in queue
+            continue;
         }
-        if (block_index != -1) {
-            file_cache[block_index]->ref_count++;
-            file_cache[block_index]->block_state = DOWNLOADING;
+
+        // wake up for the earliest of curl timeouts, retries, hedges and end of pause,
+        // 0 if none of them is pending
+        long int curl_timeout;
+        curl_multi_timeout(fetch_multi, &curl_timeout);
+        long long int wake_time = (curl_timeout >= 0) ? time_msec() + curl_timeout : 0;
+        long long int next_retry = get_next_retry_time();
+        if ((next_retry != 0) && ((wake_time == 0) || (next_retry < wake_time))) {
+            wake_time = next_retry;
+        }
+        if ((next_hedge != 0) && ((wake_time == 0) || (next_hedge < wake_time))) {
+            wake_time = next_hedge;
+        }
+        if ((fetch_paused_until > now) && ((wake_time == 0) || (fetch_paused_until < wake_time))) {
+            wake_time = fetch_paused_until;
         }
-        pthread_mutex_unlock(&file_cache_lock);
 
-        if (block_index == -1) {
-            usleep(50 * 1000);
+        struct curl_waitfd wakeup = {
+            .fd = fetch_wakeup_pipe[0],
+            .events = CURL_WAIT_POLLIN,
+            .revents = 0,
+        };
+        if ((wake_time == 0) && (fetch_active_transfers == 0)) {
+            // idle until a block is queued, curl_multi_wait can't wait without timeout
+            struct pollfd wakeup_poll = { .fd = fetch_wakeup_pipe[0], .events = POLLIN, .revents = 0 };
+            poll(&wakeup_poll, 1, -1);
+            wakeup.revents = wakeup_poll.revents;
         } else {
-            // download file block
-            printf("[DEBUG] DBFiles downloading block: %s, offset: %u, slot: %d...\n",
-                    file_cache[block_index]->utf8path, file_cache[block_index]->offset, block_index);
-            char *tmp_buf;
-            size_t tmp_buf_size;
-
-            int ret = dbapi_get_file(curl,
-                    file_cache[block_index]->utf8path,
-                    file_cache[block_index]->rev,
-                    file_cache[block_index]->offset,
-                    file_cache[block_index]->offset + CACHE_BLOCK_SIZE,
-                    &tmp_buf, &tmp_buf_size);
-            if (ret == 0) {
-                assert(tmp_buf_size <= CACHE_BLOCK_SIZE);
-                memset(file_cache[block_index]->buffer, 0, CACHE_BLOCK_SIZE);
-                memcpy(file_cache[block_index]->buffer, tmp_buf, tmp_buf_size);
-                free(tmp_buf);
-                printf("[DEBUG] DBFiles successfully downloaded block: %s, offset: %u...\n",
-                        file_cache[block_index]->utf8path, file_cache[block_index]->offset);
-            } else {
-                printf("[DEBUG] DBFiles failed to download block: %s, offset: %u...\n",
-                        file_cache[block_index]->utf8path, file_cache[block_index]->offset);
+            long long int timeout = (wake_time == 0) ? INT_MAX : wake_time - time_msec();
+            curl_multi_wait(fetch_multi, &wakeup, 1, (timeout > 0) ? (int)timeout : 0, NULL);
+        }
+        if (wakeup.revents != 0) {
+            char buf[64];
+            while (read(fetch_wakeup_pipe[0], buf, sizeof(buf)) > 0) {
             }
+        }
+    }
+    return NULL;
+}
+
+/// disk_cache_thread()
+///     Searches disk cache for queued blocks and stores completed ones in it. Blocks
+///     that are not found are returned to fetch queue together, in the order they came.
+void *disk_cache_thread(void *args) {
+    while (1) {
+        pthread_mutex_lock(&disk_queue_lock);
+        while (disk_queue_head == NULL) {
+            pthread_cond_wait(&disk_queue_work, &disk_queue_lock);
+        }
+        struct CachedBlock *block = disk_queue_head;
+        disk_queue_head = NULL;
+        disk_queue_tail = NULL;
+        pthread_mutex_unlock(&disk_queue_lock);
 
-            pthread_mutex_lock(&file_cache_lock);
-            file_cache[block_index]->block_state = (ret == 0) ? COMPLETED : SCHEDULED;
-            file_cache[block_index]->ref_count--;
-            pthread_mutex_unlock(&file_cache_lock);
+        struct CachedBlock *missed_head = NULL;
+        struct CachedBlock *missed_tail = NULL;
+        while (block != NULL) {
+            struct CachedBlock *next = block->queue_next;
+            // state of queued block is only changed by thread that holds it
+            if (block->block_state == COMPLETED) {
+                write_block_to_disk(block->path_size, block->utf8path, block->rev,
+                        block->offset, block->buffer, block->data_size);
+                release_cache_block(block);
+            } else if (read_block_from_disk_cache(block) != 0) {
+                block->disk_checked = 1;
+                block->queue_next = NULL;
+                if (missed_tail == NULL) {
+                    missed_head = block;
+                } else {
+                    missed_tail->queue_next = block;
+                }
+                missed_tail = block;
+            }
+            block = next;
+        }
+        if (missed_head != NULL) {
+            enqueue_fetch_list(missed_head, missed_tail);
         }
     }
+    return NULL;
 }
@@ -1,10 +1,25 @@
 #ifndef __DBFILES_H
 #define __DBFILES_H
 
+struct FileCacheStats {
+    uint64_t block_reads;       // cache block lookups by readers
+    uint64_t block_misses;      // lookups that had to schedule a download
+    uint64_t readahead_blocks;  // blocks scheduled by readahead
+    uint64_t readahead_used;    // prefetched blocks that were read later
+    uint64_t readahead_wasted;  // prefetched blocks evicted before they were read
+    uint64_t coalesced_blocks;  // blocks downloaded by request of the block before them
+    uint64_t retried_blocks;    // failed downloads scheduled again after backoff
+    uint64_t failed_blocks;     // downloads that were given up
+    uint64_t hedged_requests;   // slow downloads duplicated on another connection
+    uint64_t hedge_wins;        // hedged downloads finished by the duplicate
+};
+
 void initialize_file_cache();
 void cleanup_file_cache();
 
-int read_sector_from_cache(size_t path_size, char *utf8path, char *rev, uint32_t offset, uint32_t file_size, uint8_t *buf);
+int read_file_from_cache(uint32_t file_id, size_t path_size, char *utf8path, char *rev,
+        uint64_t offset, uint32_t size, uint64_t file_size, uint8_t *buf);
+void get_file_cache_stats(struct FileCacheStats *stats);
 
 #endif
 
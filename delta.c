@@ -0,0 +1,587 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dbfat.h"
+#include "delta.h"
+#include "geometry.h"
+#include "utf.h"
+
+// Delta response is {"reset": bool, "cursor": string, "has_more": bool, "entries":
+// [[path, metadata or null], ...]}. Tokenizer keeps a stack of open containers and
+// the position of value in it tells what the value is, values that are not needed
+// are checked for syntax and dropped without being copied.
+
+enum {
+    STATE_VALUE,            // value expected
+    STATE_VALUE_OR_END,     // first value of array or ']'
+    STATE_KEY,              // key of object expected
+    STATE_KEY_OR_END,       // first key of object or '}'
+    STATE_COLON,
+    STATE_AFTER_VALUE,      // ',' or end of container
+    STATE_STRING,
+    STATE_ESCAPE,
+    STATE_UNICODE,          // hex digits of \uXXXX escape
+    STATE_NUMBER,
+    STATE_LITERAL,
+    STATE_END,              // top level object closed, only whitespace may follow
+};
+
+enum {
+    FIELD_OTHER,
+    FIELD_RESET,
+    FIELD_CURSOR,
+    FIELD_HAS_MORE,
+    FIELD_ENTRIES,
+    FIELD_IS_DIR,
+    FIELD_MODIFIED,
+    FIELD_REV,
+    FIELD_BYTES,
+};
+
+// depth of values inside the top level object, entries array, entry and metadata
+#define DEPTH_TOP      1
+#define DEPTH_ENTRIES  2
+#define DEPTH_ENTRY    3
+#define DEPTH_METADATA 4
+
+#define MAX_NUMBER_SIZE 64
+
+const char *LITERALS[] = { "true", "false", "null" };
+
+void init_delta_parser(struct DeltaParser *parser, delta_entries_callback callback, void *callback_data) {
+    memset(parser, 0, sizeof(struct DeltaParser));
+    parser->callback = callback;
+    parser->callback_data = callback_data;
+    parser->state = STATE_VALUE;
+}
+
+/// reset_delta_parser()
+///     Prepares parser for the next response, buffers grown by the previous ones are
+///     kept so that parsing a page usually does not allocate
+void reset_delta_parser(struct DeltaParser *parser) {
+    char *token = parser->token;
+    uint32_t token_capacity = parser->token_capacity;
+    char *entry_path = parser->entry_path;
+    uint32_t entry_path_capacity = parser->entry_path_capacity;
+    utf16_t *path_buffer = parser->path_buffer;
+    uint32_t path_buffer_capacity = parser->path_buffer_capacity;
+    free(parser->cursor);
+
+    init_delta_parser(parser, parser->callback, parser->callback_data);
+    parser->token = token;
+    parser->token_capacity = token_capacity;
+    parser->entry_path = entry_path;
+    parser->entry_path_capacity = entry_path_capacity;
+    parser->path_buffer = path_buffer;
+    parser->path_buffer_capacity = path_buffer_capacity;
+}
+
+void cleanup_delta_parser(struct DeltaParser *parser) {
+    free(parser->token);
+    free(parser->entry_path);
+    free(parser->path_buffer);
+    free(parser->cursor);
+    parser->token = NULL;
+    parser->entry_path = NULL;
+    parser->path_buffer = NULL;
+    parser->cursor = NULL;
+}
+
+int delta_error(struct DeltaParser *parser, const char *message) {
+    printf("[ERROR] Delta response is not valid at offset %llu: %s\n", (unsigned long long)parser->offset, message);
+    parser->error = 1;
+    return -1;
+}
+
+int reserve_token(struct DeltaParser *parser, uint32_t size) {
+    if ((uint64_t)parser->token_size + size > DELTA_MAX_STRING_SIZE) {
+        return delta_error(parser, "string is too long");
+    }
+    if (parser->token_size + size + 1 > parser->token_capacity) {
+        parser->token_capacity = (parser->token_size + size + 1) * 2;
+        parser->token = (char *)realloc(parser->token, parser->token_capacity);
+        assert(parser->token != NULL);
+    }
+    return 0;
+}
+
+int append_token(struct DeltaParser *parser, const char *data, uint32_t size) {
+    if (reserve_token(parser, size) < 0) {
+        return -1;
+    }
+    memcpy(&parser->token[parser->token_size], data, size);
+    parser->token_size += size;
+    return 0;
+}
+
+int append_code_point(struct DeltaParser *parser, uint32_t c) {
+    char buf[4];
+    uint32_t size;
+    if (c < 0x80) {
+        buf[0] = (char)c;
+        size = 1;
+    } else if (c < 0x800) {
+        buf[0] = (char)(0xC0 | (c >> 6));
+        buf[1] = (char)(0x80 | (c & 0x3F));
+        size = 2;
+    } else if (c < 0x10000) {
+        buf[0] = (char)(0xE0 | (c >> 12));
+        buf[1] = (char)(0x80 | ((c >> 6) & 0x3F));
+        buf[2] = (char)(0x80 | (c & 0x3F));
+        size = 3;
+    } else {
+        buf[0] = (char)(0xF0 | (c >> 18));
+        buf[1] = (char)(0x80 | ((c >> 12) & 0x3F));
+        buf[2] = (char)(0x80 | ((c >> 6) & 0x3F));
+        buf[3] = (char)(0x80 | (c & 0x3F));
+        size = 4;
+    }
+    return append_token(parser, buf, size);
+}
+
+// high surrogate that is not followed by a low one stands for a replacement char
+int flush_surrogate(struct DeltaParser *parser) {
+    if (parser->high_surrogate == 0) {
+        return 0;
+    }
+    parser->high_surrogate = 0;
+    return parser->collect ? append_code_point(parser, UTF_REPLACEMENT_CHAR) : 0;
+}
+
+int unicode_escape(struct DeltaParser *parser, uint32_t c) {
+    if ((c >= 0xD800) && (c <= 0xDBFF)) {
+        int r = flush_surrogate(parser);
+        parser->high_surrogate = c;
+        return r;
+    }
+    if ((c >= 0xDC00) && (c <= 0xDFFF)) {
+        if (parser->high_surrogate == 0) {
+            c = UTF_REPLACEMENT_CHAR;
+        } else {
+            c = 0x10000 + ((parser->high_surrogate - 0xD800) << 10) + (c - 0xDC00);
+            parser->high_surrogate = 0;
+        }
+    } else if (flush_surrogate(parser) < 0) {
+        return -1;
+    }
+    return parser->collect ? append_code_point(parser, c) : 0;
+}
+
+uint8_t get_field(const char *key, uint32_t key_size, uint32_t depth) {
+    const char *fields[] = { NULL, "reset", "cursor", "has_more", "entries", "is_dir", "modified", "rev", "bytes" };
+    uint8_t first = (depth == DEPTH_TOP) ? FIELD_RESET : FIELD_IS_DIR;
+    uint8_t last = (depth == DEPTH_TOP) ? FIELD_ENTRIES : FIELD_BYTES;
+    for (uint8_t field = first; field <= last; field++) {
+        if ((strlen(fields[field]) == key_size) && (memcmp(fields[field], key, key_size) == 0)) {
+            return field;
+        }
+    }
+    return FIELD_OTHER;
+}
+
+// position of value that is being parsed, it is in container at depth - 1
+int in_entries(struct DeltaParser *parser) {
+    return (parser->depth >= DEPTH_ENTRIES) && (parser->top_field == FIELD_ENTRIES) &&
+        (parser->containers[DEPTH_ENTRIES - 1] == 'a');
+}
+
+int in_entry(struct DeltaParser *parser) {
+    return (parser->depth >= DEPTH_ENTRY) && in_entries(parser) &&
+        (parser->containers[DEPTH_ENTRY - 1] == 'a');
+}
+
+int in_metadata(struct DeltaParser *parser) {
+    return (parser->depth >= DEPTH_METADATA) && in_entry(parser) &&
+        (parser->value_counts[DEPTH_ENTRY - 1] == 1) && (parser->containers[DEPTH_METADATA - 1] == 'o');
+}
+
+// strings are copied only where they are used
+uint8_t is_collected_string(struct DeltaParser *parser) {
+    if (parser->is_key) {
+        return (parser->depth == DEPTH_TOP) || ((parser->depth == DEPTH_METADATA) && in_metadata(parser));
+    }
+    if (parser->depth == DEPTH_TOP) {
+        return parser->top_field == FIELD_CURSOR;
+    }
+    if ((parser->depth == DEPTH_ENTRY) && in_entry(parser)) {
+        return parser->value_counts[DEPTH_ENTRY - 1] == 0;
+    }
+    if ((parser->depth == DEPTH_METADATA) && in_metadata(parser)) {
+        return parser->metadata_field == FIELD_REV;
+    }
+    return 0;
+}
+
+void flush_delta_entries(struct DeltaParser *parser) {
+    if (parser->change_count == 0) {
+        return;
+    }
+    // path buffer may have moved while batch was filled
+    for (uint32_t i = 0; i < parser->change_count; i++) {
+        parser->changes[i].path = &parser->path_buffer[parser->path_offsets[i]];
+    }
+    parser->callback(parser->changes, parser->change_count, parser->callback_data);
+    parser->change_count = 0;
+    parser->path_buffer_chars = 0;
+}
+
+void start_entry(struct DeltaParser *parser) {
+    memset(&parser->entry, 0, sizeof(struct FileEntryChange));
+    // entry without metadata is removed
+    parser->entry.is_removed = 1;
+    parser->entry_has_path = 0;
+}
+
+void end_entry(struct DeltaParser *parser) {
+    if (!parser->entry_has_path || (parser->entry_path_size == 0) || (parser->entry_path[0] != '/')) {
+        printf("[ERROR] Skipping delta entry %u without valid path\n", parser->entry_count);
+        parser->entry_count++;
+        return;
+    }
+    // utf16 path never has more chars than utf8 one has bytes
+    if (parser->path_buffer_chars + parser->entry_path_size > parser->path_buffer_capacity) {
+        parser->path_buffer_capacity = (parser->path_buffer_chars + parser->entry_path_size) * 2;
+        parser->path_buffer = (utf16_t *)realloc(parser->path_buffer, parser->path_buffer_capacity * sizeof(utf16_t));
+        assert(parser->path_buffer != NULL);
+    }
+    struct FileEntryChange *change = &parser->changes[parser->change_count];
+    memcpy(change, &parser->entry, sizeof(struct FileEntryChange));
+    change->path_chars = (uint32_t)utf8_to_utf16_buf(parser->entry_path_size, parser->entry_path,
+        &parser->path_buffer[parser->path_buffer_chars]);
+    parser->path_offsets[parser->change_count] = parser->path_buffer_chars;
+    parser->path_buffer_chars += change->path_chars;
+    parser->change_count++;
+    parser->entry_count++;
+    if (parser->change_count == DELTA_BATCH_ENTRIES) {
+        flush_delta_entries(parser);
+    }
+}
+
+// literal index is 0 for true, 1 for false and 2 for null
+void scalar_value(struct DeltaParser *parser, char type, int literal) {
+    uint32_t depth = parser->depth;
+    if (parser->is_key) {
+        if (depth == DEPTH_TOP) {
+            parser->top_field = get_field(parser->token, parser->token_size, depth);
+        } else if ((depth == DEPTH_METADATA) && in_metadata(parser)) {
+            parser->metadata_field = get_field(parser->token, parser->token_size, depth);
+        }
+        return;
+    }
+
+    if (depth == DEPTH_TOP) {
+        if ((parser->top_field == FIELD_CURSOR) && (type == 's')) {
+            free(parser->cursor);
+            parser->cursor = strndup(parser->token, parser->token_size);
+        } else if ((parser->top_field == FIELD_RESET) && (type == 'l')) {
+            parser->reset = (literal == 0);
+        } else if ((parser->top_field == FIELD_HAS_MORE) && (type == 'l')) {
+            parser->has_more = (literal == 0);
+        }
+    } else if ((depth == DEPTH_ENTRY) && in_entry(parser)) {
+        if ((parser->value_counts[DEPTH_ENTRY - 1] == 0) && (type == 's')) {
+            if (parser->token_size > parser->entry_path_capacity) {
+                parser->entry_path_capacity = parser->token_size * 2;
+                parser->entry_path = (char *)realloc(parser->entry_path, parser->entry_path_capacity);
+                assert(parser->entry_path != NULL);
+            }
+            memcpy(parser->entry_path, parser->token, parser->token_size);
+            parser->entry_path_size = parser->token_size;
+            parser->entry_has_path = 1;
+        }
+    } else if ((depth == DEPTH_METADATA) && in_metadata(parser)) {
+        struct DBMetaData *metadata = &parser->entry.metadata;
+        if ((parser->metadata_field == FIELD_IS_DIR) && (type == 'l')) {
+            metadata->is_dir = (literal == 0);
+        } else if ((parser->metadata_field == FIELD_MODIFIED) && (type == 'n')) {
+            metadata->mtime = (uint32_t)strtod(parser->token, NULL);
+        } else if ((parser->metadata_field == FIELD_REV) && (type == 's')) {
+            uint32_t rev_size = (parser->token_size < DB_REV_SIZE - 1) ? parser->token_size : (DB_REV_SIZE - 1);
+            memcpy(metadata->rev, parser->token, rev_size);
+            metadata->rev[rev_size] = 0;
+        } else if ((parser->metadata_field == FIELD_BYTES) && (type == 'n')) {
+            double size_double = strtod(parser->token, NULL);
+            if (size_double > MAX_FILE_SIZE) {
+                // truncate files that are larger than what is supported by image format
+                metadata->size = MAX_FILE_SIZE;
+            } else {
+                metadata->size = (size_double > 0) ? (uint64_t)size_double : 0;
+            }
+        }
+    }
+}
+
+int open_container(struct DeltaParser *parser, char type) {
+    if (parser->depth == DELTA_MAX_DEPTH) {
+        return delta_error(parser, "values are nested too deep");
+    }
+    parser->containers[parser->depth] = type;
+    parser->value_counts[parser->depth] = 0;
+    parser->depth++;
+
+    if ((parser->depth == DEPTH_ENTRY) && (type == 'a') && in_entries(parser)) {
+        start_entry(parser);
+    } else if ((parser->depth == DEPTH_METADATA) && (type == 'o') && in_metadata(parser)) {
+        parser->entry.is_removed = 0;
+        parser->metadata_field = FIELD_OTHER;
+    }
+    parser->state = (type == 'o') ? STATE_KEY_OR_END : STATE_VALUE_OR_END;
+    return 0;
+}
+
+int close_container(struct DeltaParser *parser, char c) {
+    char type = (c == '}') ? 'o' : 'a';
+    if ((parser->depth == 0) || (parser->containers[parser->depth - 1] != type)) {
+        return delta_error(parser, "unexpected end of container");
+    }
+    if ((parser->depth == DEPTH_ENTRY) && in_entry(parser)) {
+        end_entry(parser);
+    }
+    parser->depth--;
+    return 0;
+}
+
+// value at depth is complete, the next char continues its container
+void end_value(struct DeltaParser *parser) {
+    if (parser->depth == 0) {
+        parser->state = STATE_END;
+        return;
+    }
+    uint32_t index = parser->depth - 1;
+    if (parser->containers[index] == 'o') {
+        if (parser->is_key) {
+            parser->is_key = 0;
+            parser->state = STATE_COLON;
+            return;
+        }
+        if (parser->depth == DEPTH_METADATA) {
+            parser->metadata_field = FIELD_OTHER;
+        }
+    }
+    parser->value_counts[index]++;
+    parser->state = STATE_AFTER_VALUE;
+}
+
+int start_value(struct DeltaParser *parser, char c) {
+    if ((parser->depth == 0) && (c != '{')) {
+        return delta_error(parser, "response is not an object");
+    }
+    if (c == '{' || c == '[') {
+        return open_container(parser, (c == '{') ? 'o' : 'a');
+    }
+    if (c == '"') {
+        parser->state = STATE_STRING;
+        parser->token_size = 0;
+        parser->high_surrogate = 0;
+        parser->collect = is_collected_string(parser);
+        // collected string is terminated even if empty
+        return parser->collect ? reserve_token(parser, 0) : 0;
+    }
+    if (c == '-' || (c >= '0' && c <= '9')) {
+        parser->state = STATE_NUMBER;
+        parser->token_size = 0;
+        return append_token(parser, &c, 1);
+    }
+    for (uint8_t i = 0; i < 3; i++) {
+        if (c == LITERALS[i][0]) {
+            parser->state = STATE_LITERAL;
+            parser->literal = i;
+            parser->literal_size = 1;
+            return 0;
+        }
+    }
+    return delta_error(parser, "unexpected character");
+}
+
+int is_whitespace(char c) {
+    return (c == ' ') || (c == '\n') || (c == '\r') || (c == '\t');
+}
+
+int is_number_char(char c) {
+    return (c >= '0' && c <= '9') || (c == '-') || (c == '+') || (c == '.') || (c == 'e') || (c == 'E');
+}
+
+int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/// feed_delta_parser()
+///     Parses next chunk of response body, chunks may split it anywhere. Entries are
+///     passed to callback as soon as a batch of them is complete.
+int feed_delta_parser(struct DeltaParser *parser, const char *data, size_t size) {
+    size_t i = 0;
+    while ((i < size) && !parser->error) {
+        char c = data[i];
+        switch (parser->state) {
+        case STATE_STRING: {
+            // copy run of plain chars at once
+            size_t run_end = i;
+            while ((run_end < size) && (data[run_end] != '"') && (data[run_end] != '\\') &&
+                    ((uint8_t)data[run_end] >= 0x20)) {
+                run_end++;
+            }
+            if (run_end > i) {
+                if ((flush_surrogate(parser) < 0) ||
+                        (parser->collect && (append_token(parser, &data[i], (uint32_t)(run_end - i)) < 0))) {
+                    break;
+                }
+                parser->offset += run_end - i;
+                i = run_end;
+                continue;
+            }
+            if (c == '\\') {
+                parser->state = STATE_ESCAPE;
+            } else if (c == '"') {
+                if (flush_surrogate(parser) < 0) {
+                    break;
+                }
+                if (parser->collect) {
+                    parser->token[parser->token_size] = 0;
+                }
+                scalar_value(parser, 's', 0);
+                end_value(parser);
+            } else {
+                delta_error(parser, "control character in string");
+            }
+            break;
+        }
+        case STATE_ESCAPE: {
+            const char *escapes = "\"\\/bfnrt";
+            const char *values = "\"\\/\b\f\n\r\t";
+            const char *escape = (c != 0) ? strchr(escapes, c) : NULL;
+            if (c == 'u') {
+                parser->state = STATE_UNICODE;
+                parser->unicode_char = 0;
+                parser->unicode_digits = 0;
+            } else if (escape != NULL) {
+                char value = values[escape - escapes];
+                if ((flush_surrogate(parser) == 0) && (!parser->collect || (append_token(parser, &value, 1) == 0))) {
+                    parser->state = STATE_STRING;
+                }
+            } else {
+                delta_error(parser, "invalid escape");
+            }
+            break;
+        }
+        case STATE_UNICODE: {
+            int digit = hex_value(c);
+            if (digit < 0) {
+                delta_error(parser, "invalid unicode escape");
+                break;
+            }
+            parser->unicode_char = (parser->unicode_char << 4) | (uint32_t)digit;
+            parser->unicode_digits++;
+            if (parser->unicode_digits == 4) {
+                if (unicode_escape(parser, parser->unicode_char) == 0) {
+                    parser->state = STATE_STRING;
+                }
+            }
+            break;
+        }
+        case STATE_NUMBER:
+            if (is_number_char(c)) {
+                if (parser->token_size == MAX_NUMBER_SIZE) {
+                    delta_error(parser, "number is too long");
+                } else {
+                    append_token(parser, &c, 1);
+                }
+                break;
+            }
+            parser->token[parser->token_size] = 0;
+            scalar_value(parser, 'n', 0);
+            end_value(parser);
+            // char after number is handled in the next state
+            continue;
+        case STATE_LITERAL:
+            if (c != LITERALS[parser->literal][parser->literal_size]) {
+                delta_error(parser, "invalid literal");
+                break;
+            }
+            parser->literal_size++;
+            if (LITERALS[parser->literal][parser->literal_size] == 0) {
+                scalar_value(parser, 'l', parser->literal);
+                end_value(parser);
+            }
+            break;
+        default:
+            if (is_whitespace(c)) {
+                break;
+            }
+            switch (parser->state) {
+            case STATE_VALUE:
+                start_value(parser, c);
+                break;
+            case STATE_VALUE_OR_END:
+                if (c == ']') {
+                    if (close_container(parser, c) == 0) {
+                        end_value(parser);
+                    }
+                } else {
+                    start_value(parser, c);
+                }
+                break;
+            case STATE_KEY:
+            case STATE_KEY_OR_END:
+                if (c == '"') {
+                    parser->is_key = 1;
+                    start_value(parser, c);
+                } else if ((c == '}') && (parser->state == STATE_KEY_OR_END)) {
+                    if (close_container(parser, c) == 0) {
+                        end_value(parser);
+                    }
+                } else {
+                    delta_error(parser, "key expected");
+                }
+                break;
+            case STATE_COLON:
+                if (c == ':') {
+                    parser->state = STATE_VALUE;
+                } else {
+                    delta_error(parser, "colon expected");
+                }
+                break;
+            case STATE_AFTER_VALUE:
+                if (c == ',') {
+                    parser->state = (parser->containers[parser->depth - 1] == 'o') ? STATE_KEY : STATE_VALUE;
+                } else if ((c == '}') || (c == ']')) {
+                    if (close_container(parser, c) == 0) {
+                        end_value(parser);
+                    }
+                } else {
+                    delta_error(parser, "comma expected");
+                }
+                break;
+            case STATE_END:
+                delta_error(parser, "data after end of response");
+                break;
+            }
+            break;
+        }
+        i++;
+        parser->offset++;
+    }
+    return parser->error ? -1 : 0;
+}
+
+/// finish_delta_parser()
+///     Ends the body, remaining entries are passed to callback even if body is not
+///     complete, they are valid entries of the page
+int finish_delta_parser(struct DeltaParser *parser) {
+    flush_delta_entries(parser);
+    if (parser->error) {
+        return -1;
+    }
+    if (parser->state != STATE_END) {
+        return delta_error(parser, "response is incomplete");
+    }
+    if (parser->cursor == NULL) {
+        return delta_error(parser, "response has no cursor");
+    }
+    return 0;
+}
@@ -0,0 +1,89 @@
+#ifndef __DELTA_H
+#define __DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dbfat.h"
+
+// Streaming parser of delta response, it is fed with chunks of body as they are
+// received and passes entries to callback in batches of DELTA_BATCH_ENTRIES, so
+// memory use does not depend on size of the page. Fields of the top level object may
+// come in any order, reset, has_more and cursor are only known once body ends.
+
+#define DELTA_BATCH_ENTRIES 1024
+
+// longest string of response, longer ones fail the parse
+#define DELTA_MAX_STRING_SIZE (1024 * 1024)
+
+// nesting of JSON containers that is tracked, values nested deeper are skipped
+#define DELTA_MAX_DEPTH 64
+
+// Called with every full batch and with the rest of entries when body ends. Paths
+// of changes are only valid during the call.
+typedef void (*delta_entries_callback)(struct FileEntryChange *changes, uint32_t change_count, void *callback_data);
+
+struct DeltaParser {
+    delta_entries_callback callback;
+    void *callback_data;
+
+    // tokenizer state
+    uint8_t state;
+    uint8_t is_key;         // string is key of object
+    uint8_t collect;        // string is copied to token
+    uint8_t literal;
+    uint8_t literal_size;   // chars of literal matched so far
+    uint8_t unicode_digits;
+    uint32_t unicode_char;
+    uint32_t high_surrogate;
+    int error;
+    uint64_t offset;                // of the next byte of body, for errors
+
+    // containers that are open, 'o' for object and 'a' for array, and number of
+    // values seen in each of them
+    uint32_t depth;
+    uint8_t containers[DELTA_MAX_DEPTH];
+    uint32_t value_counts[DELTA_MAX_DEPTH];
+    // field of the top level object and of entry metadata the next value belongs to
+    uint8_t top_field;
+    uint8_t metadata_field;
+
+    // string or number being parsed
+    char *token;
+    uint32_t token_size;
+    uint32_t token_capacity;
+
+    // entry being parsed
+    char *entry_path;
+    uint32_t entry_path_size;
+    uint32_t entry_path_capacity;
+    uint8_t entry_has_path;
+    struct FileEntryChange entry;
+
+    // batch of parsed entries, paths are stored one after another in path_buffer
+    struct FileEntryChange changes[DELTA_BATCH_ENTRIES];
+    uint32_t path_offsets[DELTA_BATCH_ENTRIES];
+    uint32_t change_count;
+    utf16_t *path_buffer;
+    uint32_t path_buffer_chars;
+    uint32_t path_buffer_capacity;
+    uint32_t entry_count;
+
+    // top level fields, reset and has_more are 0 unless set
+    int reset;
+    int has_more;
+    char *cursor;
+};
+
+void init_delta_parser(struct DeltaParser *parser, delta_entries_callback callback, void *callback_data);
+void reset_delta_parser(struct DeltaParser *parser);
+void cleanup_delta_parser(struct DeltaParser *parser);
+
+// Returns 0 or -1 if body is not a valid delta response, parser stops at first error
+int feed_delta_parser(struct DeltaParser *parser, const char *data, size_t size);
+
+// Passes remaining entries to callback, returns 0 if body was a complete delta
+// response and -1 otherwise
+int finish_delta_parser(struct DeltaParser *parser);
+
+#endif
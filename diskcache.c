@@ -0,0 +1,414 @@
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "dbfat.h"
+#include "diskcache.h"
+
+// Disk cache keeps downloaded file blocks in DBBOX_DISK_CACHE_DIR, one file per block.
+// Every file is self describing, so the cache index is rebuilt from directory listing
+// on startup and a block is only trusted if its header and checksum match. Blocks are
+// written to a temporary file first and renamed into place so that a crash never
+// leaves a partially written block under its final name.
+
+#define DISK_BLOCK_MAGIC           0x314B4C4258424244ULL // "DBBXBLK1"
+#define DISK_BLOCK_VERSION         2
+#define DEFAULT_DISK_CACHE_SIZE_MB 1024
+
+struct DiskBlockHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint64_t offset;
+    uint64_t path_size;
+    uint64_t data_size;
+    uint64_t checksum; // checksum of path and data
+    char rev[DB_REV_SIZE];
+};
+
+struct DiskBlock {
+    uint64_t key;
+    uint64_t file_size;
+    time_t mtime; // only used to order blocks when loading cache
+
+    struct DiskBlock *hash_next;
+    struct DiskBlock *lru_prev;
+    struct DiskBlock *lru_next;
+};
+
+char *disk_cache_dir = NULL; // NULL if disk cache is disabled
+uint64_t disk_cache_capacity;
+uint64_t disk_cache_size = 0;
+
+uint32_t disk_cache_bucket_mask;
+struct DiskBlock **disk_cache_buckets;
+// LRU list sentinel, lru_next is the most recently used block
+struct DiskBlock disk_cache_lru;
+pthread_mutex_t disk_cache_lock;
+volatile uint32_t disk_cache_tmp_counter = 0;
+
+uint64_t disk_block_key(size_t path_size, char *utf8path, char *rev, uint64_t offset) {
+    // FNV-1a 64
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < path_size; i++) {
+        hash = (hash ^ (uint8_t)utf8path[i]) * 1099511628211ULL;
+    }
+    for (size_t i = 0; (i < DB_REV_SIZE) && (rev[i] != 0); i++) {
+        hash = (hash ^ (uint8_t)rev[i]) * 1099511628211ULL;
+    }
+    for (size_t i = 0; i < sizeof(offset); i++) {
+        hash = (hash ^ ((offset >> (8 * i)) & 0xFF)) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+uint64_t disk_block_checksum(uint64_t checksum, char *buf, size_t size) {
+    // word at a time FNV style checksum, only used to detect corrupted blocks
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, &buf[i], sizeof(uint64_t));
+        checksum = (checksum ^ word) * 1099511628211ULL;
+    }
+    for (; i < size; i++) {
+        checksum = (checksum ^ (uint8_t)buf[i]) * 1099511628211ULL;
+    }
+    return checksum;
+}
+
+void disk_block_path(uint64_t key, char *path) {
+    sprintf(path, "%s/%016llx.blk", disk_cache_dir, (unsigned long long)key);
+}
+
+int write_all(int fd, const void *buf, size_t size) {
+    size_t written = 0;
+    while (written < size) {
+        ssize_t r = write(fd, (const char *)buf + written, size - written);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return -1;
+        }
+        written += r;
+    }
+    return 0;
+}
+
+int read_all(int fd, void *buf, size_t size) {
+    size_t read_size = 0;
+    while (read_size < size) {
+        ssize_t r = read(fd, (char *)buf + read_size, size - read_size);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return -1;
+        }
+        read_size += r;
+    }
+    return 0;
+}
+
+void lru_unlink(struct DiskBlock *block) {
+    block->lru_prev->lru_next = block->lru_next;
+    block->lru_next->lru_prev = block->lru_prev;
+}
+
+void lru_push_front(struct DiskBlock *block) {
+    block->lru_prev = &disk_cache_lru;
+    block->lru_next = disk_cache_lru.lru_next;
+    disk_cache_lru.lru_next->lru_prev = block;
+    disk_cache_lru.lru_next = block;
+}
+
+struct DiskBlock **get_disk_bucket(uint64_t key) {
+    return &disk_cache_buckets[(uint32_t)(key ^ (key >> 32)) & disk_cache_bucket_mask];
+}
+
+/// find_disk_block()
+///     Looks up block in the index, disk_cache_lock must be held
+struct DiskBlock *find_disk_block(uint64_t key) {
+    struct DiskBlock *block = *get_disk_bucket(key);
+    while ((block != NULL) && (block->key != key)) {
+        block = block->hash_next;
+    }
+    return block;
+}
+
+/// remove_disk_block()
+///     Removes block from the index and deletes its file, disk_cache_lock must be held
+void remove_disk_block(struct DiskBlock *block) {
+    struct DiskBlock **bucket = get_disk_bucket(block->key);
+    while (*bucket != block) {
+        assert(*bucket != NULL);
+        bucket = &(*bucket)->hash_next;
+    }
+    *bucket = block->hash_next;
+    lru_unlink(block);
+    disk_cache_size -= block->file_size;
+
+    char path[PATH_MAX];
+    disk_block_path(block->key, path);
+    unlink(path);
+    free(block);
+}
+
+/// add_disk_block()
+///     Adds block to the index as the most recently used one and evicts least recently
+///     used blocks until cache fits in its capacity, disk_cache_lock must be held
+void add_disk_block(uint64_t key, uint64_t file_size, time_t mtime) {
+    struct DiskBlock *block = find_disk_block(key);
+    if (block != NULL) {
+        lru_unlink(block);
+        disk_cache_size -= block->file_size;
+    } else {
+        block = (struct DiskBlock *)calloc(1, sizeof(struct DiskBlock));
+        assert(block != NULL);
+        struct DiskBlock **bucket = get_disk_bucket(key);
+        block->key = key;
+        block->hash_next = *bucket;
+        *bucket = block;
+    }
+    block->file_size = file_size;
+    block->mtime = mtime;
+    disk_cache_size += file_size;
+    lru_push_front(block);
+
+    while ((disk_cache_size > disk_cache_capacity) && (disk_cache_lru.lru_prev != block)) {
+        remove_disk_block(disk_cache_lru.lru_prev);
+    }
+}
+
+int compare_disk_block_mtime(const void *a, const void *b) {
+    time_t mtime_a = (*(struct DiskBlock **)a)->mtime;
+    time_t mtime_b = (*(struct DiskBlock **)b)->mtime;
+    return (mtime_a > mtime_b) - (mtime_a < mtime_b);
+}
+
+void load_disk_cache() {
+    DIR *dir = opendir(disk_cache_dir);
+    if (dir == NULL) {
+        printf("[ERROR] DiskCache failed to open: %s, error: %s\n", disk_cache_dir, strerror(errno));
+        return;
+    }
+
+    size_t blocks_capacity = 1024;
+    size_t nblocks = 0;
+    struct DiskBlock **blocks = (struct DiskBlock **)malloc(blocks_capacity * sizeof(struct DiskBlock *));
+    assert(blocks != NULL);
+
+    struct dirent *dirent;
+    while ((dirent = readdir(dir)) != NULL) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", disk_cache_dir, dirent->d_name);
+
+        size_t name_len = strlen(dirent->d_name);
+        if ((name_len > 4) && (strcmp(&dirent->d_name[name_len - 4], ".tmp") == 0)) {
+            // leftover of an interrupted write
+            unlink(path);
+            continue;
+        }
+
+        unsigned long long key;
+        char suffix[8];
+        struct stat st;
+        if ((name_len != 20) ||
+                (sscanf(dirent->d_name, "%16llx%7s", &key, suffix) != 2) ||
+                (strcmp(suffix, ".blk") != 0) ||
+                (stat(path, &st) != 0)) {
+            continue;
+        }
+
+        if (nblocks == blocks_capacity) {
+            blocks_capacity *= 2;
+            blocks = (struct DiskBlock **)realloc(blocks, blocks_capacity * sizeof(struct DiskBlock *));
+            assert(blocks != NULL);
+        }
+        blocks[nblocks] = (struct DiskBlock *)calloc(1, sizeof(struct DiskBlock));
+        assert(blocks[nblocks] != NULL);
+        blocks[nblocks]->key = key;
+        blocks[nblocks]->file_size = st.st_size;
+        blocks[nblocks]->mtime = st.st_mtime;
+        nblocks++;
+    }
+    closedir(dir);
+
+    // add blocks from oldest to newest so that LRU list matches their write order
+    qsort(blocks, nblocks, sizeof(struct DiskBlock *), compare_disk_block_mtime);
+    pthread_mutex_lock(&disk_cache_lock);
+    for (size_t i = 0; i < nblocks; i++) {
+        add_disk_block(blocks[i]->key, blocks[i]->file_size, blocks[i]->mtime);
+        free(blocks[i]);
+    }
+    pthread_mutex_unlock(&disk_cache_lock);
+    free(blocks);
+
+    printf("[DEBUG] DiskCache loaded %zu blocks, size: %llu bytes\n", nblocks, (unsigned long long)disk_cache_size);
+}
+
+void initialize_disk_cache() {
+    char *cache_dir_env = getenv("DBBOX_DISK_CACHE_DIR");
+    if ((cache_dir_env == NULL) || (cache_dir_env[0] == 0)) {
+        printf("[DEBUG] DiskCache is disabled\n");
+        return;
+    }
+
+    long int cache_size_mb = DEFAULT_DISK_CACHE_SIZE_MB;
+    char *cache_size_env = getenv("DBBOX_DISK_CACHE_SIZE_MB");
+    if (cache_size_env != NULL) {
+        cache_size_mb = strtol(cache_size_env, NULL, 10);
+    }
+    disk_cache_capacity = (uint64_t)cache_size_mb << 20;
+
+    if ((mkdir(cache_dir_env, 0700) != 0) && (errno != EEXIST)) {
+        printf("[ERROR] DiskCache failed to create: %s, error: %s\n", cache_dir_env, strerror(errno));
+        return;
+    }
+    disk_cache_dir = strdup(cache_dir_env);
+
+    // size hash table to keep about one 2MB block per bucket
+    uint32_t bucket_count = 1024;
+    while ((uint64_t)bucket_count << 21 < disk_cache_capacity) {
+        bucket_count <<= 1;
+    }
+    disk_cache_bucket_mask = bucket_count - 1;
+    disk_cache_buckets = (struct DiskBlock **)calloc(bucket_count, sizeof(struct DiskBlock *));
+    assert(disk_cache_buckets != NULL);
+    disk_cache_lru.lru_prev = &disk_cache_lru;
+    disk_cache_lru.lru_next = &disk_cache_lru;
+    pthread_mutex_init(&disk_cache_lock, NULL);
+
+    load_disk_cache();
+}
+
+void cleanup_disk_cache() {
+    if (disk_cache_dir == NULL) {
+        return;
+    }
+    struct DiskBlock *block = disk_cache_lru.lru_next;
+    while (block != &disk_cache_lru) {
+        struct DiskBlock *next_block = block->lru_next;
+        free(block);
+        block = next_block;
+    }
+    free(disk_cache_buckets);
+    pthread_mutex_destroy(&disk_cache_lock);
+    free(disk_cache_dir);
+    disk_cache_dir = NULL;
+}
+
+int is_disk_cache_enabled() {
+    return disk_cache_dir != NULL;
+}
+
+/// read_block_from_disk()
+///     Reads cached block into buf, returns 0 and sets *size to the number of bytes
+///     read if block is in the disk cache and is not corrupted
+int read_block_from_disk(size_t path_size, char *utf8path, char *rev, uint64_t offset, char *buf, size_t buf_size, size_t *size) {
+    if (disk_cache_dir == NULL) {
+        return -1;
+    }
+
+    uint64_t key = disk_block_key(path_size, utf8path, rev, offset);
+    pthread_mutex_lock(&disk_cache_lock);
+    struct DiskBlock *block = find_disk_block(key);
+    if (block != NULL) {
+        lru_unlink(block);
+        lru_push_front(block);
+    }
+    pthread_mutex_unlock(&disk_cache_lock);
+    if (block == NULL) {
+        return -1;
+    }
+
+    char path[PATH_MAX];
+    disk_block_path(key, path);
+    int fd = open(path, O_RDONLY);
+    int valid = 0;
+    if (fd >= 0) {
+        struct DiskBlockHeader header;
+        char *block_path = NULL;
+        if ((read_all(fd, &header, sizeof(header)) == 0) &&
+                (header.magic == DISK_BLOCK_MAGIC) &&
+                (header.version == DISK_BLOCK_VERSION) &&
+                (header.offset == offset) &&
+                (header.path_size == path_size) &&
+                (header.data_size <= buf_size) &&
+                (memcmp(header.rev, rev, DB_REV_SIZE) == 0)) {
+            block_path = (char *)malloc(path_size);
+            assert(block_path != NULL);
+            valid = (read_all(fd, block_path, path_size) == 0) &&
+                (memcmp(block_path, utf8path, path_size) == 0) &&
+                (read_all(fd, buf, header.data_size) == 0) &&
+                (disk_block_checksum(disk_block_checksum(0, block_path, path_size), buf, header.data_size) == header.checksum);
+            free(block_path);
+        }
+        if (valid) {
+            *size = header.data_size;
+        }
+        close(fd);
+    }
+
+    if (!valid) {
+        printf("[ERROR] DiskCache dropping invalid block: %s, offset: %llu\n", utf8path, (unsigned long long)offset);
+        pthread_mutex_lock(&disk_cache_lock);
+        block = find_disk_block(key);
+        if (block != NULL) {
+            remove_disk_block(block);
+        }
+        pthread_mutex_unlock(&disk_cache_lock);
+        return -1;
+    }
+    return 0;
+}
+
+void write_block_to_disk(size_t path_size, char *utf8path, char *rev, uint64_t offset, char *buf, size_t size) {
+    if (disk_cache_dir == NULL) {
+        return;
+    }
+
+    uint64_t key = disk_block_key(path_size, utf8path, rev, offset);
+    struct DiskBlockHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = DISK_BLOCK_MAGIC;
+    header.version = DISK_BLOCK_VERSION;
+    header.offset = offset;
+    header.path_size = path_size;
+    header.data_size = size;
+    header.checksum = disk_block_checksum(disk_block_checksum(0, utf8path, path_size), buf, size);
+    memcpy(header.rev, rev, DB_REV_SIZE);
+
+    char tmp_path[PATH_MAX + 16];
+    char path[PATH_MAX];
+    disk_block_path(key, path);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%u.tmp", path, __sync_fetch_and_add(&disk_cache_tmp_counter, 1));
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        printf("[ERROR] DiskCache failed to create: %s, error: %s\n", tmp_path, strerror(errno));
+        return;
+    }
+    int ret = write_all(fd, &header, sizeof(header));
+    ret = ret || write_all(fd, utf8path, path_size);
+    ret = ret || write_all(fd, buf, size);
+    ret = close(fd) || ret;
+    if (ret || (rename(tmp_path, path) != 0)) {
+        printf("[ERROR] DiskCache failed to write: %s, error: %s\n", path, strerror(errno));
+        unlink(tmp_path);
+        return;
+    }
+
+    pthread_mutex_lock(&disk_cache_lock);
+    add_disk_block(key, sizeof(header) + path_size + size, time(NULL));
+    pthread_mutex_unlock(&disk_cache_lock);
+}
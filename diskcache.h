@@ -0,0 +1,14 @@
+#ifndef __DISKCACHE_H
+#define __DISKCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+void initialize_disk_cache();
+void cleanup_disk_cache();
+int is_disk_cache_enabled();
+
+int read_block_from_disk(size_t path_size, char *utf8path, char *rev, uint64_t offset, char *buf, size_t buf_size, size_t *size);
+void write_block_to_disk(size_t path_size, char *utf8path, char *rev, uint64_t offset, char *buf, size_t size);
+
+#endif
@@ -0,0 +1,112 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "epoch.h"
+
+// Readers of epoch e are counted in EPOCH_READERS[e % 2]. Writer starts the next
+// epoch only when nobody is left in the previous one, so readers are always in the
+// current epoch or in the one before it. Memory retired before an epoch started is
+// not reachable for its readers and it is freed once the previous epoch drains.
+uint64_t EPOCH = 0;
+uint64_t EPOCH_READERS[2] = { 0, 0 };
+
+struct RetiredMemory {
+    void *ptr;
+    void (*free_function)(void *ptr);
+};
+
+struct RetiredList {
+    struct RetiredMemory *retired;
+    uint32_t count;
+    uint32_t capacity;
+};
+
+// memory retired in the current epoch and memory waiting for previous epoch to drain
+struct RetiredList RETIRED;
+struct RetiredList RETIRED_PREVIOUS;
+
+uint64_t enter_epoch() {
+    while (1) {
+        uint64_t epoch = __atomic_load_n(&EPOCH, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&EPOCH_READERS[epoch % 2], 1, __ATOMIC_SEQ_CST);
+        // writer may have started the next epoch before this reader was counted,
+        // then it does not wait for it and reader has to join the new epoch
+        if (__atomic_load_n(&EPOCH, __ATOMIC_SEQ_CST) == epoch) {
+            return epoch;
+        }
+        __atomic_sub_fetch(&EPOCH_READERS[epoch % 2], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+void leave_epoch(uint64_t epoch) {
+    __atomic_sub_fetch(&EPOCH_READERS[epoch % 2], 1, __ATOMIC_SEQ_CST);
+}
+
+/// retire_object()
+///     Frees ptr with free_function once no reader can see it, for objects that
+///     readers can still change, e.g. by caching something in them
+void retire_object(void *ptr, void (*free_function)(void *ptr)) {
+    if (ptr == NULL) {
+        return;
+    }
+    if (RETIRED.count == RETIRED.capacity) {
+        RETIRED.capacity = (RETIRED.capacity == 0) ? 256 : (RETIRED.capacity * 2);
+        RETIRED.retired = (struct RetiredMemory *)realloc(RETIRED.retired, RETIRED.capacity * sizeof(struct RetiredMemory));
+        assert(RETIRED.retired != NULL);
+    }
+    RETIRED.retired[RETIRED.count].ptr = ptr;
+    RETIRED.retired[RETIRED.count].free_function = free_function;
+    RETIRED.count++;
+}
+
+void retire_memory(void *ptr) {
+    retire_object(ptr, free);
+}
+
+void free_retired_list(struct RetiredList *list) {
+    for (uint32_t i = 0; i < list->count; i++) {
+        list->retired[i].free_function(list->retired[i].ptr);
+    }
+    list->count = 0;
+}
+
+/// reclaim_retired_memory()
+///     Frees memory that no reader can see anymore and starts the next epoch if there
+///     is newly retired memory. Never waits for readers, if the previous epoch still
+///     has some, memory stays retired until a later call.
+void reclaim_retired_memory() {
+    uint64_t epoch = __atomic_load_n(&EPOCH, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&EPOCH_READERS[(epoch + 1) % 2], __ATOMIC_SEQ_CST) != 0) {
+        return;
+    }
+    free_retired_list(&RETIRED_PREVIOUS);
+    if (RETIRED.count == 0) {
+        return;
+    }
+
+    struct RetiredList list = RETIRED_PREVIOUS;
+    RETIRED_PREVIOUS = RETIRED;
+    RETIRED = list;
+    __atomic_store_n(&EPOCH, epoch + 1, __ATOMIC_SEQ_CST);
+
+    // short reads are usually done by now
+    if (__atomic_load_n(&EPOCH_READERS[epoch % 2], __ATOMIC_SEQ_CST) == 0) {
+        free_retired_list(&RETIRED_PREVIOUS);
+    }
+}
+
+/// cleanup_epochs()
+///     Frees all retired memory, there must be no readers left
+void cleanup_epochs() {
+    assert(EPOCH_READERS[0] == 0);
+    assert(EPOCH_READERS[1] == 0);
+    free_retired_list(&RETIRED_PREVIOUS);
+    free_retired_list(&RETIRED);
+    free(RETIRED_PREVIOUS.retired);
+    free(RETIRED.retired);
+    RETIRED_PREVIOUS.retired = NULL;
+    RETIRED_PREVIOUS.capacity = 0;
+    RETIRED.retired = NULL;
+    RETIRED.capacity = 0;
+}
@@ -0,0 +1,20 @@
+#ifndef __EPOCH_H
+#define __EPOCH_H
+
+#include <stdint.h>
+
+// Epoch based reclamation of memory shared with lock free readers. Readers enter
+// an epoch for as long as they use published data, writer retires memory that is
+// no longer reachable from newly published data and it is freed only once every
+// reader that could still see it has left its epoch.
+
+uint64_t enter_epoch();
+void leave_epoch(uint64_t epoch);
+
+// writer side, callers must serialize these
+void retire_memory(void *ptr);
+void retire_object(void *ptr, void (*free_function)(void *ptr));
+void reclaim_retired_memory();
+void cleanup_epochs();
+
+#endif
@@ -0,0 +1,316 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cluster.h"
+#include "dbfat.h"
+#include "exfat.h"
+#include "utf.h"
+
+// Boot region is 12 sectors: boot sector, 8 extended boot sectors, OEM parameters,
+// reserved sector and checksum sector. Backup boot region follows the main one.
+#define BOOT_REGION_SECTORS   12
+#define CHECKSUM_SECTOR       11
+
+// Directory entry types
+#define ENTRY_TYPE_BITMAP     0x81
+#define ENTRY_TYPE_UPCASE     0x82
+#define ENTRY_TYPE_LABEL      0x83
+#define ENTRY_TYPE_FILE       0x85
+#define ENTRY_TYPE_STREAM     0xC0
+#define ENTRY_TYPE_NAME       0xC1
+
+// GeneralSecondaryFlags of stream extension entry
+#define FLAG_ALLOCATION_POSSIBLE 0x01
+#define FLAG_NO_FAT_CHAIN        0x02
+
+#define NAME_CHARS_PER_ENTRY  15
+#define UPCASE_TABLE_CHARS    0x10000
+#define UPCASE_IDENTITY_MARK  0xFFFF  // followed by number of characters that map to themselves
+
+const utf16_t VOLUME_LABEL[] = { 'D', 'R', 'O', 'P', 'B', 'O', 'X', ' ', 'B', 'O', 'X' };
+#define VOLUME_LABEL_CHARS (sizeof(VOLUME_LABEL) / sizeof(VOLUME_LABEL[0]))
+
+uint8_t EXFAT_BOOT_REGION[BOOT_REGION_SECTORS * BPB_BytesPerSector];
+
+// UPCASE[c] is upper case of c, UPCASE_TABLE is the same table as stored on volume
+utf16_t *UPCASE;
+uint8_t *UPCASE_TABLE;
+uint32_t UPCASE_TABLE_SIZE;
+uint32_t UPCASE_TABLE_CHECKSUM;
+
+// allocation bitmap and up-case table own their clusters like files, but they are
+// not part of the directory tree and their data is generated here
+struct DirEntry *BITMAP_DIR_ENTRY;
+struct DirEntry *UPCASE_DIR_ENTRY;
+
+uint32_t boot_checksum(uint32_t checksum, uint8_t *buf, uint32_t size, int skip_volume_fields) {
+    for (uint32_t i = 0; i < size; i++) {
+        // VolumeFlags and PercentInUse can change without updating the checksum
+        if (skip_volume_fields && ((i == 106) || (i == 107) || (i == 112))) {
+            continue;
+        }
+        checksum = ((checksum & 1) ? 0x80000000 : 0) + (checksum >> 1) + buf[i];
+    }
+    return checksum;
+}
+
+uint16_t entry_set_checksum(uint8_t *buf, uint32_t size) {
+    uint16_t checksum = 0;
+    for (uint32_t i = 0; i < size; i++) {
+        // SetChecksum field itself
+        if ((i == 2) || (i == 3)) {
+            continue;
+        }
+        checksum = ((checksum & 1) ? 0x8000 : 0) + (checksum >> 1) + buf[i];
+    }
+    return checksum;
+}
+
+uint16_t name_hash(uint8_t name_chars, utf16_t *name) {
+    uint16_t hash = 0;
+    for (uint8_t i = 0; i < name_chars; i++) {
+        utf16_t c = UPCASE[name[i]];
+        hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (c & 0xFF);
+        hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (c >> 8);
+    }
+    return hash;
+}
+
+void build_exfat_boot_region() {
+    uint8_t *boot_sector = EXFAT_BOOT_REGION;
+    memset(EXFAT_BOOT_REGION, 0, sizeof(EXFAT_BOOT_REGION));
+    boot_sector[0] = 0xEB;                                          // JumpBoot
+    boot_sector[1] = 0x76;
+    boot_sector[2] = 0x90;
+    memcpy(&boot_sector[3], "EXFAT   ", 8);                         // FileSystemName
+    put_uint64(boot_sector, 72, BPB_TotalSectors);                  // VolumeLength
+    put_uint32(boot_sector, 80, BPB_ReservedSectorCount);           // FatOffset
+    put_uint32(boot_sector, 84, BPB_FATSz32);                       // FatLength
+    put_uint32(boot_sector, 88, BPB_ReservedSectorCount + BPB_NumFATs * BPB_FATSz32); // ClusterHeapOffset
+    put_uint32(boot_sector, 92, N_CLUSTERS - 2);                    // ClusterCount
+    put_uint32(boot_sector, 96, BPB_RootCluster);                   // FirstClusterOfRootDirectory
+    put_uint32(boot_sector, 100, BS_VolumeID);                      // VolumeSerialNumber
+    put_uint16(boot_sector, 104, 0x0100);                           // FileSystemRevision
+    boot_sector[108] = __builtin_ctz(BPB_BytesPerSector);           // BytesPerSectorShift
+    boot_sector[109] = __builtin_ctz(BPB_SectorsPerCluster);        // SectorsPerClusterShift
+    boot_sector[110] = BPB_NumFATs;                                 // NumberOfFats
+    boot_sector[111] = 0x80;                                        // DriveSelect
+    boot_sector[112] = 0xFF;                                        // PercentInUse, unknown
+    boot_sector[510] = 0x55;                                        // BootSignature
+    boot_sector[511] = 0xAA;
+
+    // extended boot sectors only carry their signature
+    for (uint32_t sector = 1; sector <= 8; sector++) {
+        put_uint32(&EXFAT_BOOT_REGION[sector * BPB_BytesPerSector], BPB_BytesPerSector - 4, 0xAA550000);
+    }
+
+    uint32_t checksum = boot_checksum(0, boot_sector, BPB_BytesPerSector, 1);
+    checksum = boot_checksum(checksum, &EXFAT_BOOT_REGION[BPB_BytesPerSector],
+            (CHECKSUM_SECTOR - 1) * BPB_BytesPerSector, 0);
+    for (uint32_t i = 0; i < BPB_BytesPerSector; i += 4) {
+        put_uint32(&EXFAT_BOOT_REGION[CHECKSUM_SECTOR * BPB_BytesPerSector], i, checksum);
+    }
+}
+
+/// build_upcase_table()
+///     Builds up-case table from utf16_fold_case, so that the volume compares names
+///     the same way as directory lookups do. Runs of characters that map to themselves
+///     are stored compressed.
+void build_upcase_table() {
+    UPCASE = (utf16_t *)malloc(UPCASE_TABLE_CHARS * sizeof(utf16_t));
+    assert(UPCASE != NULL);
+    for (uint32_t c = 0; c < UPCASE_TABLE_CHARS; c++) {
+        UPCASE[c] = c;
+    }
+    for (uint32_t c = 0; c < UPCASE_TABLE_CHARS; c++) {
+        utf16_t lower = utf16_fold_case(c);
+        if (lower != c) {
+            UPCASE[lower] = c;
+        }
+    }
+
+    utf16_t *table = (utf16_t *)malloc(UPCASE_TABLE_CHARS * sizeof(utf16_t));
+    assert(table != NULL);
+    uint32_t table_chars = 0;
+    uint32_t c = 0;
+    while (c < UPCASE_TABLE_CHARS) {
+        uint32_t run = 0;
+        while ((c + run < UPCASE_TABLE_CHARS) && (UPCASE[c + run] == c + run) && (run < 0xFFFF)) {
+            run++;
+        }
+        if (run > 2) {
+            table[table_chars++] = UPCASE_IDENTITY_MARK;
+            table[table_chars++] = run;
+            c += run;
+        } else {
+            // identity mapping of the mark itself is always part of the last run
+            assert(UPCASE[c] != UPCASE_IDENTITY_MARK);
+            table[table_chars++] = UPCASE[c];
+            c++;
+        }
+    }
+
+    UPCASE_TABLE_SIZE = table_chars * sizeof(utf16_t);
+    UPCASE_TABLE = (uint8_t *)malloc(UPCASE_TABLE_SIZE);
+    assert(UPCASE_TABLE != NULL);
+    for (uint32_t i = 0; i < table_chars; i++) {
+        put_uint16(UPCASE_TABLE, i * sizeof(utf16_t), table[i]);
+    }
+    free(table);
+    UPCASE_TABLE_CHECKSUM = boot_checksum(0, UPCASE_TABLE, UPCASE_TABLE_SIZE, 0);
+    printf("[DEBUG] exFAT up-case table: %u bytes\n", UPCASE_TABLE_SIZE);
+}
+
+struct DirEntry *create_system_entry(uint64_t size) {
+    struct DirEntry *dir_entry = (struct DirEntry *)malloc(sizeof(struct DirEntry));
+    assert(dir_entry != NULL);
+    memset(dir_entry, 0, sizeof(struct DirEntry));
+    dir_entry->metadata.size = size;
+    dir_entry->first_cluster = allocate_cluster_chain(dir_entry, size);
+    invalidate_entry_view(dir_entry);
+    return dir_entry;
+}
+
+void initialize_exfat() {
+    build_exfat_boot_region();
+    build_upcase_table();
+    BITMAP_DIR_ENTRY = create_system_entry((N_CLUSTERS - 2 + 7) / 8);
+    UPCASE_DIR_ENTRY = create_system_entry(UPCASE_TABLE_SIZE);
+}
+
+void cleanup_exfat() {
+    free_cluster_chain(BITMAP_DIR_ENTRY->first_cluster);
+    free_cluster_chain(UPCASE_DIR_ENTRY->first_cluster);
+    free(BITMAP_DIR_ENTRY->view);
+    free(UPCASE_DIR_ENTRY->view);
+    free(BITMAP_DIR_ENTRY);
+    free(UPCASE_DIR_ENTRY);
+    free(UPCASE);
+    free(UPCASE_TABLE);
+}
+
+uint32_t get_exfat_entry_size(struct EntryMetaData *metadata) {
+    // file and stream extension entries followed by name entries
+    return (2 + (metadata->name_chars + NAME_CHARS_PER_ENTRY - 1) / NAME_CHARS_PER_ENTRY) * DIR_ENTRY_SIZE;
+}
+
+void put_system_entry(uint8_t *buf, uint8_t entry_type, struct DirEntry *dir_entry) {
+    memset(buf, 0, DIR_ENTRY_SIZE);
+    buf[0] = entry_type;
+    put_uint32(buf, 20, dir_entry->first_cluster);                  // FirstCluster
+    put_uint64(buf, 24, dir_entry->metadata.size);                  // DataLength
+}
+
+/// get_exfat_root_contents()
+///     Writes entries that are only in root directory, returns their size
+uint32_t get_exfat_root_contents(uint8_t *buf) {
+    memset(buf, 0, DIR_ENTRY_SIZE);
+    buf[0] = ENTRY_TYPE_LABEL;
+    buf[1] = VOLUME_LABEL_CHARS;                                    // CharacterCount
+    for (uint32_t i = 0; i < VOLUME_LABEL_CHARS; i++) {
+        put_uint16(buf, 2 + i * sizeof(utf16_t), VOLUME_LABEL[i]);
+    }
+
+    put_system_entry(&buf[DIR_ENTRY_SIZE], ENTRY_TYPE_BITMAP, BITMAP_DIR_ENTRY);
+    put_system_entry(&buf[2 * DIR_ENTRY_SIZE], ENTRY_TYPE_UPCASE, UPCASE_DIR_ENTRY);
+    put_uint32(&buf[2 * DIR_ENTRY_SIZE], 4, UPCASE_TABLE_CHECKSUM); // TableChecksum
+    return EXFAT_ROOT_ENTRIES_SIZE;
+}
+
+/// get_exfat_dir_contents()
+///     Writes entry set of child_entry: file entry, stream extension and names.
+///     Files that are one contiguous extent are marked NoFatChain, so hosts read
+///     them without looking at FAT.
+uint32_t get_exfat_dir_contents(struct DirEntry *child_entry, uint8_t *buf) {
+    struct EntryMetaData *metadata = &child_entry->metadata;
+    uint32_t entry_set_size = get_exfat_entry_size(metadata);
+    memset(buf, 0, entry_set_size);
+
+    uint32_t timestamp = ((uint32_t)metadata->DIR_WrtDate << 16) | metadata->DIR_WrtTime;
+    uint8_t *file_entry = buf;
+    file_entry[0] = ENTRY_TYPE_FILE;
+    file_entry[1] = entry_set_size / DIR_ENTRY_SIZE - 1;           // SecondaryCount
+    put_uint16(file_entry, 4, (metadata->is_dir == 1) ? (ATTR_READ_ONLY | ATTR_DIRECTORY) : ATTR_READ_ONLY);
+    put_uint32(file_entry, 8, timestamp);                           // CreateTimestamp
+    put_uint32(file_entry, 12, timestamp);                          // LastModifiedTimestamp
+    put_uint32(file_entry, 16, timestamp);                          // LastAccessedTimestamp
+
+    // directories are read up to the end of their last cluster, empty files have
+    // no clusters as far as exFAT is concerned
+    uint64_t data_length = metadata->size;
+    uint32_t first_cluster = child_entry->first_cluster;
+    uint8_t flags = FLAG_ALLOCATION_POSSIBLE;
+    if (metadata->is_dir == 1) {
+        data_length = (uint64_t)get_chain_clusters(metadata->size) * BYTES_PER_CLUSTER;
+    }
+    if (data_length == 0) {
+        first_cluster = 0;
+    } else if (child_entry->extent_count == 1) {
+        flags |= FLAG_NO_FAT_CHAIN;
+    }
+
+    uint8_t *stream_entry = &buf[DIR_ENTRY_SIZE];
+    stream_entry[0] = ENTRY_TYPE_STREAM;
+    stream_entry[1] = flags;                                        // GeneralSecondaryFlags
+    stream_entry[3] = metadata->name_chars;                         // NameLength
+    put_uint16(stream_entry, 4, name_hash(metadata->name_chars, metadata->name));
+    put_uint64(stream_entry, 8, data_length);                       // ValidDataLength
+    put_uint32(stream_entry, 20, first_cluster);                    // FirstCluster
+    put_uint64(stream_entry, 24, data_length);                      // DataLength
+
+    for (uint32_t i = 0; i < metadata->name_chars; i++) {
+        uint8_t *name_entry = &buf[(2 + i / NAME_CHARS_PER_ENTRY) * DIR_ENTRY_SIZE];
+        name_entry[0] = ENTRY_TYPE_NAME;
+        put_uint16(name_entry, 2 + (i % NAME_CHARS_PER_ENTRY) * sizeof(utf16_t), metadata->name[i]);
+    }
+
+    put_uint16(file_entry, 2, entry_set_checksum(buf, entry_set_size));
+    return entry_set_size;
+}
+
+int is_exfat_system_entry(struct DirEntry *dir_entry) {
+    return (dir_entry == BITMAP_DIR_ENTRY) || (dir_entry == UPCASE_DIR_ENTRY);
+}
+
+/// read_exfat_system_data()
+///     Reads allocation bitmap or up-case table, bitmap is built from cluster map of
+///     view on every read so it never needs to be invalidated
+int read_exfat_system_data(struct ImageView *view, struct EntryView *entry_view, uint64_t offset, uint32_t size, uint8_t *buf) {
+    uint32_t read_size = 0;
+    if (offset < entry_view->size) {
+        read_size = (entry_view->size - offset < size) ? (uint32_t)(entry_view->size - offset) : size;
+        if (entry_view->dir_entry == BITMAP_DIR_ENTRY) {
+            read_allocation_bitmap(view, (uint32_t)offset, read_size, buf);
+        } else {
+            memcpy(buf, &UPCASE_TABLE[offset], read_size);
+        }
+    }
+    memset(&buf[read_size], 0, size - read_size);
+    return 0;
+}
+
+/// read_exfat_boot_data()
+///     Reads reserved sectors before FAT, they start with main and backup boot regions
+int read_exfat_boot_data(uint32_t offset, uint32_t size, uint8_t *buf) {
+    uint32_t buf_offset = 0;
+    while (buf_offset < size) {
+        uint32_t sector = (offset + buf_offset) / BPB_BytesPerSector;
+        uint32_t sector_index = (offset + buf_offset) % BPB_BytesPerSector;
+        uint32_t read_size = BPB_BytesPerSector - sector_index;
+        if (read_size > size - buf_offset) {
+            read_size = size - buf_offset;
+        }
+
+        if (sector < 2 * BOOT_REGION_SECTORS) {
+            memcpy(&buf[buf_offset],
+                    &EXFAT_BOOT_REGION[(sector % BOOT_REGION_SECTORS) * BPB_BytesPerSector + sector_index], read_size);
+        } else {
+            memset(&buf[buf_offset], 0, read_size);
+        }
+        buf_offset += read_size;
+    }
+    return 0;
+}
@@ -0,0 +1,26 @@
+#ifndef __EXFAT_H
+#define __EXFAT_H
+
+#include <stdint.h>
+
+#include "dbfat.h"
+
+// exFAT image generator, used instead of FAT32 directory entries and boot sector
+// when IMAGE_FORMAT is IMAGE_FORMAT_EXFAT. Directory tree and cluster chains are
+// the same for both formats.
+
+// root directory starts with volume label, allocation bitmap and up-case table entries
+#define EXFAT_ROOT_ENTRIES_SIZE (3 * DIR_ENTRY_SIZE)
+
+void initialize_exfat();
+void cleanup_exfat();
+
+uint32_t get_exfat_entry_size(struct EntryMetaData *metadata);
+uint32_t get_exfat_root_contents(uint8_t *buf);
+uint32_t get_exfat_dir_contents(struct DirEntry *child_entry, uint8_t *buf);
+
+int is_exfat_system_entry(struct DirEntry *dir_entry);
+int read_exfat_system_data(struct ImageView *view, struct EntryView *entry_view, uint64_t offset, uint32_t size, uint8_t *buf);
+int read_exfat_boot_data(uint32_t offset, uint32_t size, uint8_t *buf);
+
+#endif
@@ -0,0 +1,171 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "geometry.h"
+
+// FAT32 needs at least 65525 clusters, otherwise it is treated as FAT16, and
+// cluster numbers only have 28 bits
+#define MIN_FAT32_CLUSTERS 65525
+#define MAX_FAT32_CLUSTERS 0x0FFFFFF5
+#define MAX_EXFAT_CLUSTERS 0xFFFFFFF5
+// enough for root directory, allocation bitmap and up-case table
+#define MIN_EXFAT_CLUSTERS 16
+
+enum ImageFormat IMAGE_FORMAT;
+uint32_t BPB_NumFATs;
+uint32_t BPB_SectorsPerCluster;
+uint32_t BPB_TotalSectors;
+uint32_t BPB_FATSz32;
+uint32_t N_CLUSTERS;
+uint32_t BYTES_PER_CLUSTER;
+uint64_t MAX_FILE_SIZE;
+
+uint8_t BOOT_SECTOR[BPB_BytesPerSector];
+uint8_t FS_INFO[BPB_BytesPerSector];
+
+void put_uint16(uint8_t *buf, uint32_t offset, uint16_t value) {
+    buf[offset] = value & 0xFF;
+    buf[offset + 1] = (value >> 8) & 0xFF;
+}
+
+void put_uint32(uint8_t *buf, uint32_t offset, uint32_t value) {
+    put_uint16(buf, offset, value & 0xFFFF);
+    put_uint16(buf, offset + 2, (value >> 16) & 0xFFFF);
+}
+
+void put_uint64(uint8_t *buf, uint32_t offset, uint64_t value) {
+    put_uint32(buf, offset, value & 0xFFFFFFFF);
+    put_uint32(buf, offset + 4, (value >> 32) & 0xFFFFFFFF);
+}
+
+void build_boot_sector() {
+    memset(BOOT_SECTOR, 0, sizeof(BOOT_SECTOR));
+    BOOT_SECTOR[0] = 0xEB;                              // BS_jmpBoot
+    BOOT_SECTOR[1] = 0x00;
+    BOOT_SECTOR[2] = 0x90;
+    memcpy(&BOOT_SECTOR[3], "MSWIN4.1", 8);             // BS_OEMName
+
+    put_uint16(BOOT_SECTOR, 11, BPB_BytesPerSector);
+    BOOT_SECTOR[13] = BPB_SectorsPerCluster;
+    put_uint16(BOOT_SECTOR, 14, BPB_ReservedSectorCount);
+    BOOT_SECTOR[16] = BPB_NumFATs;
+    BOOT_SECTOR[21] = 0xF0;                             // BPB_Media
+    put_uint32(BOOT_SECTOR, 32, BPB_TotalSectors);
+    put_uint32(BOOT_SECTOR, 36, BPB_FATSz32);
+    put_uint32(BOOT_SECTOR, 44, BPB_RootCluster);
+    put_uint16(BOOT_SECTOR, 48, BPB_FSInfo);
+    put_uint16(BOOT_SECTOR, 50, BPB_BackupBootSector);
+
+    BOOT_SECTOR[66] = 0x29;                             // BS_BootSig
+    put_uint32(BOOT_SECTOR, 67, BS_VolumeID);
+    memcpy(&BOOT_SECTOR[71], "DROPBOX BOX", 11);        // BS_VolLab
+    memcpy(&BOOT_SECTOR[82], "FAT32   ", 8);            // BS_FilSysType
+    BOOT_SECTOR[510] = 0x55;                            // BS_TrailSig
+    BOOT_SECTOR[511] = 0xAA;
+}
+
+void build_fs_info() {
+    memset(FS_INFO, 0, sizeof(FS_INFO));
+    put_uint32(FS_INFO, 0, 0x41615252);                 // FSI_LeadSig
+    put_uint32(FS_INFO, 484, 0x61417272);               // FSI_StrucSig
+    put_uint32(FS_INFO, 488, 0xFFFFFFFF);               // FSI_Free_Count, unknown
+    put_uint32(FS_INFO, 492, 0xFFFFFFFF);               // FSI_Nxt_Free, unknown
+    put_uint32(FS_INFO, 508, 0xAA550000);               // FSI_TrailSig
+}
+
+/// set_geometry()
+///     Computes volume layout for given format, volume and cluster sizes and builds
+///     BOOT_SECTOR and FS_INFO for FAT32. Returns 0 on success, -1 if geometry is not
+///     valid for the format in which case nothing is changed.
+int set_geometry(enum ImageFormat format, uint64_t volume_size_mb, uint32_t cluster_size_kb) {
+    if ((cluster_size_kb == 0) || (cluster_size_kb > 64) || ((cluster_size_kb & (cluster_size_kb - 1)) != 0)) {
+        printf("[ERROR] Cluster size must be power of 2 between 1 and 64 KB, got: %u KB\n", cluster_size_kb);
+        return -1;
+    }
+    uint64_t total_sectors = volume_size_mb * (1024 * 1024 / BPB_BytesPerSector);
+    if (total_sectors > 0xFFFFFFFF) {
+        printf("[ERROR] Volume size is too large: %llu MB\n", (unsigned long long)volume_size_mb);
+        return -1;
+    }
+    uint32_t sectors_per_cluster = cluster_size_kb * 1024 / BPB_BytesPerSector;
+    uint32_t num_fats = (format == IMAGE_FORMAT_EXFAT) ? 1 : 2;
+
+    // FAT is sized for all sectors after reserved ones being clusters, so it always
+    // covers the clusters that are left once it is placed
+    uint64_t data_sectors = (total_sectors > BPB_ReservedSectorCount) ? (total_sectors - BPB_ReservedSectorCount) : 0;
+    uint64_t fat_entries = data_sectors / sectors_per_cluster + 2;
+    uint64_t fat_sectors = (fat_entries * sizeof(uint32_t) + BPB_BytesPerSector - 1) / BPB_BytesPerSector;
+    if (data_sectors < num_fats * fat_sectors) {
+        printf("[ERROR] Volume size is too small: %llu MB\n", (unsigned long long)volume_size_mb);
+        return -1;
+    }
+    uint64_t clusters = (data_sectors - num_fats * fat_sectors) / sectors_per_cluster;
+    uint64_t min_clusters = (format == IMAGE_FORMAT_EXFAT) ? MIN_EXFAT_CLUSTERS : MIN_FAT32_CLUSTERS;
+    uint64_t max_clusters = (format == IMAGE_FORMAT_EXFAT) ? MAX_EXFAT_CLUSTERS : MAX_FAT32_CLUSTERS;
+    if ((clusters < min_clusters) || (clusters > max_clusters)) {
+        printf("[ERROR] Volume of %llu MB with %u KB clusters has %llu clusters, %s needs %llu to %llu\n",
+                (unsigned long long)volume_size_mb, cluster_size_kb, (unsigned long long)clusters,
+                (format == IMAGE_FORMAT_EXFAT) ? "exFAT" : "FAT32",
+                (unsigned long long)min_clusters, (unsigned long long)max_clusters);
+        return -1;
+    }
+
+    IMAGE_FORMAT = format;
+    BPB_NumFATs = num_fats;
+    BPB_SectorsPerCluster = sectors_per_cluster;
+    BPB_TotalSectors = (uint32_t)total_sectors;
+    BPB_FATSz32 = (uint32_t)fat_sectors;
+    N_CLUSTERS = (uint32_t)clusters;
+    BYTES_PER_CLUSTER = sectors_per_cluster * BPB_BytesPerSector;
+    if (format == IMAGE_FORMAT_EXFAT) {
+        // clusters 0 and 1 are not part of the volume, so all other ones can be one file
+        MAX_FILE_SIZE = (uint64_t)(N_CLUSTERS - 2) * BYTES_PER_CLUSTER;
+        memset(BOOT_SECTOR, 0, sizeof(BOOT_SECTOR));
+        memset(FS_INFO, 0, sizeof(FS_INFO));
+    } else {
+        MAX_FILE_SIZE = FAT_MAX_FILE_SIZE;
+        build_boot_sector();
+        build_fs_info();
+    }
+    return 0;
+}
+
+/// initialize_geometry()
+///     Sets geometry from DBBOX_IMAGE_FORMAT, DBBOX_VOLUME_SIZE_MB and DBBOX_CLUSTER_SIZE_KB,
+///     falls back to defaults if they are not set or not valid
+void initialize_geometry() {
+    enum ImageFormat format = IMAGE_FORMAT_FAT32;
+    char *format_env = getenv("DBBOX_IMAGE_FORMAT");
+    if ((format_env != NULL) && (strcasecmp(format_env, "exfat") == 0)) {
+        format = IMAGE_FORMAT_EXFAT;
+    } else if ((format_env != NULL) && (strcasecmp(format_env, "fat32") != 0)) {
+        printf("[ERROR] Unknown image format: %s, using FAT32\n", format_env);
+    }
+
+    long long int volume_size_mb = DEFAULT_VOLUME_SIZE_MB;
+    long int cluster_size_kb = DEFAULT_CLUSTER_SIZE_KB;
+    char *volume_size_env = getenv("DBBOX_VOLUME_SIZE_MB");
+    if (volume_size_env != NULL) {
+        volume_size_mb = strtoll(volume_size_env, NULL, 10);
+    }
+    char *cluster_size_env = getenv("DBBOX_CLUSTER_SIZE_KB");
+    if (cluster_size_env != NULL) {
+        cluster_size_kb = strtol(cluster_size_env, NULL, 10);
+    }
+
+    if ((volume_size_mb <= 0) || (cluster_size_kb <= 0) ||
+            (set_geometry(format, (uint64_t)volume_size_mb, (uint32_t)cluster_size_kb) != 0)) {
+        printf("[ERROR] Invalid volume geometry, using default: %u MB, %u KB clusters\n",
+                DEFAULT_VOLUME_SIZE_MB, DEFAULT_CLUSTER_SIZE_KB);
+        int r = set_geometry(format, DEFAULT_VOLUME_SIZE_MB, DEFAULT_CLUSTER_SIZE_KB);
+        assert(r == 0);
+    }
+    printf("[DEBUG] Image format: %s\n", (IMAGE_FORMAT == IMAGE_FORMAT_EXFAT) ? "exFAT" : "FAT32");
+    printf("[DEBUG] Volume size: %u sectors (%u MB), cluster size: %u bytes, clusters: %u, FAT size: %u sectors\n",
+            BPB_TotalSectors, BPB_TotalSectors / (1024 * 1024 / BPB_BytesPerSector), BYTES_PER_CLUSTER,
+            N_CLUSTERS, BPB_FATSz32);
+}
@@ -0,0 +1,48 @@
+#ifndef __GEOMETRY_H
+#define __GEOMETRY_H
+
+#include <stdint.h>
+
+// Fixed part of volume geometry
+#define BPB_BytesPerSector      512
+#define BPB_ReservedSectorCount 32
+#define BPB_RootCluster         2
+#define BPB_FSInfo              1
+#define BPB_BackupBootSector    6
+#define BS_VolumeID             111111
+
+#define FAT_MAX_FILE_SIZE       0xFFFFFFFF
+
+#define DEFAULT_VOLUME_SIZE_MB  (128 * 1024)  // volume size if DBBOX_VOLUME_SIZE_MB is not set
+#define DEFAULT_CLUSTER_SIZE_KB 32            // cluster size if DBBOX_CLUSTER_SIZE_KB is not set
+
+// Image file system, selected with DBBOX_IMAGE_FORMAT set to "fat32" or "exfat".
+// Both use the same layout: reserved sectors, FATs and clusters starting at 2,
+// exFAT boot region fits into reserved sectors and it has only one FAT.
+enum ImageFormat {
+    IMAGE_FORMAT_FAT32 = 0,
+    IMAGE_FORMAT_EXFAT = 1,
+};
+
+// Volume geometry and everything derived from it, computed at startup
+extern enum ImageFormat IMAGE_FORMAT;
+extern uint32_t BPB_NumFATs;
+extern uint32_t BPB_SectorsPerCluster;
+extern uint32_t BPB_TotalSectors;
+extern uint32_t BPB_FATSz32;
+extern uint32_t N_CLUSTERS;
+extern uint32_t BYTES_PER_CLUSTER;
+extern uint64_t MAX_FILE_SIZE;      // larger files are truncated
+
+extern uint8_t BOOT_SECTOR[BPB_BytesPerSector];
+extern uint8_t FS_INFO[BPB_BytesPerSector];
+
+// little endian stores used to build on-disk structures
+void put_uint16(uint8_t *buf, uint32_t offset, uint16_t value);
+void put_uint32(uint8_t *buf, uint32_t offset, uint32_t value);
+void put_uint64(uint8_t *buf, uint32_t offset, uint64_t value);
+
+void initialize_geometry();
+int set_geometry(enum ImageFormat format, uint64_t volume_size_mb, uint32_t cluster_size_kb);
+
+#endif
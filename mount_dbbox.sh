@@ -10,6 +10,9 @@ fi
 
 DBBOX_IMG=/tmp/dbbox_img
 DBBOX=/tmp/dbbox
+DBBOX_CACHE_SIZE_MB=${DBBOX_CACHE_SIZE_MB:-16}
+DBBOX_DISK_CACHE_DIR=${DBBOX_DISK_CACHE_DIR:-}
+DBBOX_DISK_CACHE_SIZE_MB=${DBBOX_DISK_CACHE_SIZE_MB:-1024}
 
 umount -f $DBBOX || true
 umount -f $DBBOX_IMG || true
@@ -17,7 +20,11 @@ umount -f $DBBOX_IMG || true
 mkdir -p $DBBOX
 mkdir -p $DBBOX_IMG
 
-env FUSE_THREAD_STACK=262144 ./dbbox $DBBOX_IMG -d &
+env FUSE_THREAD_STACK=262144 \
+    DBBOX_CACHE_SIZE_MB=$DBBOX_CACHE_SIZE_MB \
+    DBBOX_DISK_CACHE_DIR=$DBBOX_DISK_CACHE_DIR \
+    DBBOX_DISK_CACHE_SIZE_MB=$DBBOX_DISK_CACHE_SIZE_MB \
+    ./dbbox $DBBOX_IMG -d &
 FUSE_PID=$!
 echo "DBBOX FUSE running, pid: $FUSE_PID"
 
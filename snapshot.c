@@ -0,0 +1,369 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cluster.h"
+#include "dbfat.h"
+#include "geometry.h"
+#include "snapshot.h"
+
+// Snapshot file is a header followed by body with delta cursor and entry records.
+// Records are in preorder, every entry follows its parent and children of directory
+// are stored from the last to the first one, so adding each of them to the front of
+// its parent's list restores the original order. All parts of body are padded to 8
+// bytes and the file is read in place through mmap. It is written to a temporary
+// file and renamed into place, so a crash never leaves a partial snapshot.
+
+#define SNAPSHOT_MAGIC   0x31504E5358424244ULL // "DBBXSNP1"
+#define SNAPSHOT_VERSION 1
+
+struct SnapshotHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    // geometry image was built for, snapshot of another one is ignored
+    uint32_t image_format;
+    uint32_t total_sectors;
+    uint32_t bytes_per_cluster;
+    uint32_t allocation_start;
+    uint32_t entry_count;
+    uint32_t cursor_size;       // including terminating zero
+    uint64_t body_size;
+    uint64_t checksum;          // checksum of body
+};
+
+struct SnapshotEntry {
+    uint64_t size;
+    uint32_t parent;            // index of parent record, root is record 0
+    uint32_t file_id;
+    uint32_t extent_count;
+    uint16_t wrt_date;
+    uint16_t wrt_time;
+    uint8_t is_dir;
+    uint8_t name_chars;
+    uint8_t name_checksum;
+    uint8_t short_name[11];
+    char rev[DB_REV_SIZE];
+    // followed by name_chars of name and extent_count of struct ClusterExtent
+};
+
+#define SNAPSHOT_ALIGN(x) (((x) + 7) & ~(uint64_t)7)
+
+char *snapshot_path = NULL; // NULL if snapshots are disabled
+
+// buffer that records are built in and checksum of everything written so far
+struct SnapshotWriter {
+    FILE *file;
+    uint8_t *buf;
+    size_t buf_capacity;
+    uint64_t body_size;
+    uint64_t checksum;
+    uint32_t entry_count;
+    int error;
+};
+
+uint64_t snapshot_checksum(uint64_t checksum, const uint8_t *buf, size_t size) {
+    // word at a time FNV style checksum, size is always multiple of 8
+    assert(size % sizeof(uint64_t) == 0);
+    for (size_t i = 0; i < size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, &buf[i], sizeof(uint64_t));
+        checksum = (checksum ^ word) * 1099511628211ULL;
+    }
+    return checksum;
+}
+
+void initialize_snapshot() {
+    char *snapshot_path_env = getenv("DBBOX_SNAPSHOT_PATH");
+    if ((snapshot_path_env == NULL) || (snapshot_path_env[0] == 0)) {
+        printf("[DEBUG] Snapshot is disabled\n");
+        return;
+    }
+    free(snapshot_path);
+    snapshot_path = strdup(snapshot_path_env);
+}
+
+uint8_t *get_writer_buffer(struct SnapshotWriter *writer, size_t size) {
+    if (size > writer->buf_capacity) {
+        writer->buf_capacity = size * 2;
+        writer->buf = (uint8_t *)realloc(writer->buf, writer->buf_capacity);
+        assert(writer->buf != NULL);
+    }
+    memset(writer->buf, 0, size);
+    return writer->buf;
+}
+
+void write_snapshot_data(struct SnapshotWriter *writer, size_t size) {
+    writer->checksum = snapshot_checksum(writer->checksum, writer->buf, size);
+    writer->body_size += size;
+    if (fwrite(writer->buf, 1, size, writer->file) != size) {
+        writer->error = 1;
+    }
+}
+
+/// write_snapshot_entry()
+///     Writes record of dir_entry and then records of all entries below it
+void write_snapshot_entry(struct SnapshotWriter *writer, struct DirEntry *dir_entry, uint32_t parent) {
+    struct EntryMetaData *metadata = &dir_entry->metadata;
+    uint8_t name_chars = (parent == UINT32_MAX) ? 0 : metadata->name_chars;
+    size_t name_size = name_chars * sizeof(utf16_t);
+    size_t extents_size = dir_entry->extent_count * sizeof(struct ClusterExtent);
+    size_t size = SNAPSHOT_ALIGN(sizeof(struct SnapshotEntry) + name_size + extents_size);
+    uint8_t *buf = get_writer_buffer(writer, size);
+
+    struct SnapshotEntry *entry = (struct SnapshotEntry *)buf;
+    entry->size = metadata->size;
+    entry->parent = (parent == UINT32_MAX) ? 0 : parent;
+    entry->file_id = dir_entry->file_id;
+    entry->extent_count = dir_entry->extent_count;
+    entry->wrt_date = metadata->DIR_WrtDate;
+    entry->wrt_time = metadata->DIR_WrtTime;
+    entry->is_dir = metadata->is_dir;
+    entry->name_chars = name_chars;
+    entry->name_checksum = metadata->name_checksum;
+    memcpy(entry->short_name, metadata->short_name, sizeof(entry->short_name));
+    memcpy(entry->rev, metadata->rev, DB_REV_SIZE);
+    memcpy(&buf[sizeof(struct SnapshotEntry)], metadata->name, name_size);
+    memcpy(&buf[sizeof(struct SnapshotEntry) + name_size], dir_entry->extents, extents_size);
+    write_snapshot_data(writer, size);
+
+    uint32_t index = writer->entry_count++;
+    struct DirEntry *child = dir_entry->child;
+    while ((child != NULL) && (child->next != NULL)) {
+        child = child->next;
+    }
+    for (; child != NULL; child = child->prev) {
+        write_snapshot_entry(writer, child, index);
+    }
+}
+
+/// write_snapshot()
+///     Saves tree under root_entry together with cursor, tree must be published so
+///     that sizes of directories match their cluster chains
+int write_snapshot(struct DirEntry *root_entry, char *cursor) {
+    if (snapshot_path == NULL) {
+        return -1;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", snapshot_path);
+    struct SnapshotWriter writer;
+    memset(&writer, 0, sizeof(struct SnapshotWriter));
+    writer.file = fopen(tmp_path, "wb");
+    if (writer.file == NULL) {
+        printf("[ERROR] Snapshot failed to create: %s, error: %s\n", tmp_path, strerror(errno));
+        return -1;
+    }
+    writer.checksum = 14695981039346656037ULL;
+
+    // header is written again once checksum is known
+    struct SnapshotHeader header;
+    memset(&header, 0, sizeof(struct SnapshotHeader));
+    if (fwrite(&header, 1, sizeof(struct SnapshotHeader), writer.file) != sizeof(struct SnapshotHeader)) {
+        writer.error = 1;
+    }
+
+    size_t cursor_size = strlen(cursor) + 1;
+    memcpy(get_writer_buffer(&writer, SNAPSHOT_ALIGN(cursor_size)), cursor, cursor_size);
+    write_snapshot_data(&writer, SNAPSHOT_ALIGN(cursor_size));
+    write_snapshot_entry(&writer, root_entry, UINT32_MAX);
+
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+    header.header_size = sizeof(struct SnapshotHeader);
+    header.image_format = IMAGE_FORMAT;
+    header.total_sectors = BPB_TotalSectors;
+    header.bytes_per_cluster = BYTES_PER_CLUSTER;
+    header.allocation_start = get_allocation_start();
+    header.entry_count = writer.entry_count;
+    header.cursor_size = cursor_size;
+    header.body_size = writer.body_size;
+    header.checksum = writer.checksum;
+    if ((fseek(writer.file, 0, SEEK_SET) != 0) ||
+            (fwrite(&header, 1, sizeof(struct SnapshotHeader), writer.file) != sizeof(struct SnapshotHeader)) ||
+            (fflush(writer.file) != 0) ||
+            (fsync(fileno(writer.file)) != 0)) {
+        writer.error = 1;
+    }
+    if ((fclose(writer.file) != 0) || writer.error || (rename(tmp_path, snapshot_path) != 0)) {
+        printf("[ERROR] Snapshot failed to write: %s, error: %s\n", snapshot_path, strerror(errno));
+        unlink(tmp_path);
+        free(writer.buf);
+        return -1;
+    }
+    free(writer.buf);
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("[DEBUG] Snapshot saved, entries: %u, size: %llu bytes, time: %.1f ms\n", writer.entry_count,
+            (unsigned long long)(sizeof(struct SnapshotHeader) + writer.body_size),
+            (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+    return 0;
+}
+
+/// check_snapshot_header()
+///     Returns 0 if snapshot of size bytes is complete, is not corrupted and was saved
+///     for the current volume geometry
+int check_snapshot_header(uint8_t *data, uint64_t size) {
+    struct SnapshotHeader *header = (struct SnapshotHeader *)data;
+    if ((size < sizeof(struct SnapshotHeader)) ||
+            (header->magic != SNAPSHOT_MAGIC) ||
+            (header->version != SNAPSHOT_VERSION) ||
+            (header->header_size != sizeof(struct SnapshotHeader)) ||
+            (header->body_size != size - sizeof(struct SnapshotHeader)) ||
+            (header->body_size % 8 != 0) ||
+            (header->cursor_size == 0) ||
+            (SNAPSHOT_ALIGN(header->cursor_size) > header->body_size) ||
+            (header->entry_count == 0)) {
+        printf("[ERROR] Snapshot is not valid: %s\n", snapshot_path);
+        return -1;
+    }
+    if ((header->image_format != IMAGE_FORMAT) ||
+            (header->total_sectors != BPB_TotalSectors) ||
+            (header->bytes_per_cluster != BYTES_PER_CLUSTER)) {
+        printf("[DEBUG] Snapshot is for another volume geometry, ignoring it\n");
+        return -1;
+    }
+    uint8_t *body = &data[sizeof(struct SnapshotHeader)];
+    if (snapshot_checksum(14695981039346656037ULL, body, header->body_size) != header->checksum) {
+        printf("[ERROR] Snapshot checksum does not match: %s\n", snapshot_path);
+        return -1;
+    }
+    uint8_t *cursor = &body[0];
+    if (cursor[header->cursor_size - 1] != 0) {
+        printf("[ERROR] Snapshot is not valid: %s\n", snapshot_path);
+        return -1;
+    }
+    return 0;
+}
+
+/// restore_snapshot_entries()
+///     Restores entries from records in body, returns -1 if some record is not valid
+int restore_snapshot_entries(struct SnapshotHeader *header, uint8_t *body, struct DirEntry *root_entry) {
+    struct DirEntry **entries = (struct DirEntry **)malloc(header->entry_count * sizeof(struct DirEntry *));
+    assert(entries != NULL);
+    struct ClusterExtent *extents = NULL;
+    uint32_t extents_capacity = 0;
+
+    uint64_t offset = SNAPSHOT_ALIGN(header->cursor_size);
+    uint32_t index;
+    for (index = 0; index < header->entry_count; index++) {
+        struct SnapshotEntry entry;
+        if (offset + sizeof(struct SnapshotEntry) > header->body_size) {
+            break;
+        }
+        memcpy(&entry, &body[offset], sizeof(struct SnapshotEntry));
+        size_t name_size = entry.name_chars * sizeof(utf16_t);
+        uint64_t extents_size = (uint64_t)entry.extent_count * sizeof(struct ClusterExtent);
+        uint64_t size = SNAPSHOT_ALIGN(sizeof(struct SnapshotEntry) + name_size + extents_size);
+        if ((offset + size > header->body_size) ||
+                ((index == 0) && ((entry.name_chars != 0) || (entry.is_dir != 1))) ||
+                ((index > 0) && ((entry.parent >= index) || (entry.name_chars == 0) ||
+                                 (entries[entry.parent]->metadata.is_dir != 1)))) {
+            break;
+        }
+        if (entry.extent_count > extents_capacity) {
+            extents_capacity = entry.extent_count * 2;
+            extents = (struct ClusterExtent *)realloc(extents, extents_capacity * sizeof(struct ClusterExtent));
+            assert(extents != NULL);
+        }
+        // extents are not aligned in the record
+        memcpy(extents, &body[offset + sizeof(struct SnapshotEntry) + name_size], extents_size);
+
+        if (index == 0) {
+            if ((entry.extent_count == 0) || (extents[0].first_cluster != BPB_RootCluster) ||
+                    (restore_cluster_chain(root_entry, extents, entry.extent_count) != 0)) {
+                break;
+            }
+            root_entry->metadata.size = entry.size;
+            entries[0] = root_entry;
+        } else {
+            struct EntryMetaData metadata;
+            memset(&metadata, 0, sizeof(struct EntryMetaData));
+            metadata.size = entry.size;
+            metadata.DIR_WrtDate = entry.wrt_date;
+            metadata.DIR_WrtTime = entry.wrt_time;
+            metadata.is_dir = entry.is_dir;
+            metadata.name_chars = entry.name_chars;
+            metadata.name_checksum = entry.name_checksum;
+            memcpy(metadata.short_name, entry.short_name, sizeof(metadata.short_name));
+            memcpy(metadata.rev, entry.rev, DB_REV_SIZE);
+            metadata.rev[DB_REV_SIZE - 1] = 0;
+            metadata.name = (utf16_t *)malloc(name_size);
+            assert(metadata.name != NULL);
+            memcpy(metadata.name, &body[offset + sizeof(struct SnapshotEntry)], name_size);
+
+            entries[index] = restore_child_entry(entries[entry.parent], &metadata, entry.file_id,
+                    extents, entry.extent_count);
+            if (entries[index] == NULL) {
+                free(metadata.name);
+                break;
+            }
+        }
+        offset += size;
+    }
+
+    free(extents);
+    free(entries);
+    if ((index != header->entry_count) || (offset != header->body_size)) {
+        printf("[ERROR] Snapshot entry %u is not valid: %s\n", index, snapshot_path);
+        return -1;
+    }
+    set_allocation_start(header->allocation_start);
+    return 0;
+}
+
+int read_snapshot(struct DirEntry *root_entry, char **cursor) {
+    if (snapshot_path == NULL) {
+        return 1;
+    }
+    assert(root_entry->child == NULL);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int fd = open(snapshot_path, O_RDONLY);
+    if (fd < 0) {
+        printf("[DEBUG] Snapshot not found: %s\n", snapshot_path);
+        return 1;
+    }
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || (st.st_size < (off_t)sizeof(struct SnapshotHeader))) {
+        printf("[ERROR] Snapshot is not valid: %s\n", snapshot_path);
+        close(fd);
+        return 1;
+    }
+    uint8_t *data = (uint8_t *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        printf("[ERROR] Snapshot failed to map: %s, error: %s\n", snapshot_path, strerror(errno));
+        return 1;
+    }
+
+    int ret = 1;
+    if (check_snapshot_header(data, st.st_size) == 0) {
+        struct SnapshotHeader *header = (struct SnapshotHeader *)data;
+        uint8_t *body = &data[sizeof(struct SnapshotHeader)];
+        ret = restore_snapshot_entries(header, body, root_entry);
+        if (ret == 0) {
+            *cursor = strdup((char *)body);
+
+            struct timespec end;
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            printf("[DEBUG] Snapshot loaded, entries: %u, time: %.1f ms\n", header->entry_count,
+                    (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+        }
+    }
+    munmap(data, st.st_size);
+    return ret;
+}
@@ -0,0 +1,22 @@
+#ifndef __SNAPSHOT_H
+#define __SNAPSHOT_H
+
+#include <stdint.h>
+
+#include "dbfat.h"
+
+// Snapshot of directory tree, short names, cluster chains and delta cursor, kept in
+// DBBOX_SNAPSHOT_PATH so that restarted daemon serves the same image right away and
+// continues delta from the saved cursor. Snapshots are disabled if it is not set.
+
+void initialize_snapshot();
+
+// caller must hold dbfat write lock
+int write_snapshot(struct DirEntry *root_entry, char *cursor);
+
+// Restores children of root_entry and its cluster chain. Returns 0 and sets cursor on
+// success, 1 if there is no usable snapshot and nothing was changed and -1 if restore
+// failed after the tree was changed.
+int read_snapshot(struct DirEntry *root_entry, char **cursor);
+
+#endif
@@ -0,0 +1,312 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "utf.h"
+
+// UTF-8 <-> UTF-16 transcoding without iconv. Most paths are pure ASCII, so every
+// conversion first tries to copy a run of ASCII characters 16 (SSE2) or 8 (any
+// other platform) characters at a time and only falls back to decoding one code
+// point at a time when it finds a non ASCII character. Invalid input is replaced
+// with UTF_REPLACEMENT_CHAR instead of failing.
+
+#define ASCII_MASK_8  0x8080808080808080ULL
+#define ASCII_MASK_16 0xFF80FF80FF80FF80ULL
+
+/// utf8_ascii_widen()
+///     Converts leading ASCII characters of utf8string, stops at first block that has
+///     non ASCII characters. Returns number of converted characters, utf16buf can be
+///     NULL to only count them.
+size_t utf8_ascii_widen(size_t utf8size, const char *utf8string, utf16_t *utf16buf) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    while (i + 16 <= utf8size) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&utf8string[i]);
+        if (_mm_movemask_epi8(v) != 0) {
+            break;
+        }
+        if (utf16buf != NULL) {
+            _mm_storeu_si128((__m128i *)&utf16buf[i], _mm_unpacklo_epi8(v, zero));
+            _mm_storeu_si128((__m128i *)&utf16buf[i + 8], _mm_unpackhi_epi8(v, zero));
+        }
+        i += 16;
+    }
+#endif
+    while (i + 8 <= utf8size) {
+        uint64_t word;
+        memcpy(&word, &utf8string[i], sizeof(word));
+        if ((word & ASCII_MASK_8) != 0) {
+            break;
+        }
+        if (utf16buf != NULL) {
+            for (int k = 0; k < 8; k++) {
+                utf16buf[i + k] = (uint8_t)utf8string[i + k];
+            }
+        }
+        i += 8;
+    }
+    return i;
+}
+
+/// utf16_ascii_narrow()
+///     Same as utf8_ascii_widen but in the other direction
+size_t utf16_ascii_narrow(size_t utf16chars, const utf16_t *utf16string, char *utf8buf) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i mask = _mm_set1_epi16((short)0xFF80);
+    const __m128i zero = _mm_setzero_si128();
+    while (i + 16 <= utf16chars) {
+        __m128i lo = _mm_loadu_si128((const __m128i *)&utf16string[i]);
+        __m128i hi = _mm_loadu_si128((const __m128i *)&utf16string[i + 8]);
+        __m128i non_ascii = _mm_and_si128(_mm_or_si128(lo, hi), mask);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(non_ascii, zero)) != 0xFFFF) {
+            break;
+        }
+        if (utf8buf != NULL) {
+            _mm_storeu_si128((__m128i *)&utf8buf[i], _mm_packus_epi16(lo, hi));
+        }
+        i += 16;
+    }
+#endif
+    while (i + 4 <= utf16chars) {
+        uint64_t word;
+        memcpy(&word, &utf16string[i], sizeof(word));
+        if ((word & ASCII_MASK_16) != 0) {
+            break;
+        }
+        if (utf8buf != NULL) {
+            for (int k = 0; k < 4; k++) {
+                utf8buf[i + k] = (char)utf16string[i + k];
+            }
+        }
+        i += 4;
+    }
+    return i;
+}
+
+/// utf8_decode()
+///     Decodes one code point at *index and moves *index past it
+uint32_t utf8_decode(size_t utf8size, const char *utf8string, size_t *index) {
+    const uint8_t *s = (const uint8_t *)&utf8string[*index];
+    size_t left = utf8size - *index;
+    uint32_t code_point;
+    uint32_t min_code_point;
+    size_t len;
+
+    if (s[0] < 0x80) {
+        *index += 1;
+        return s[0];
+    } else if ((s[0] & 0xE0) == 0xC0) {
+        len = 2;
+        code_point = s[0] & 0x1F;
+        min_code_point = 0x80;
+    } else if ((s[0] & 0xF0) == 0xE0) {
+        len = 3;
+        code_point = s[0] & 0x0F;
+        min_code_point = 0x800;
+    } else if ((s[0] & 0xF8) == 0xF0) {
+        len = 4;
+        code_point = s[0] & 0x07;
+        min_code_point = 0x10000;
+    } else {
+        *index += 1;
+        return UTF_REPLACEMENT_CHAR;
+    }
+
+    if (len > left) {
+        *index += 1;
+        return UTF_REPLACEMENT_CHAR;
+    }
+    for (size_t k = 1; k < len; k++) {
+        if ((s[k] & 0xC0) != 0x80) {
+            *index += 1;
+            return UTF_REPLACEMENT_CHAR;
+        }
+        code_point = (code_point << 6) | (s[k] & 0x3F);
+    }
+    if ((code_point < min_code_point) || (code_point > 0x10FFFF) ||
+            ((code_point >= 0xD800) && (code_point <= 0xDFFF))) {
+        *index += 1;
+        return UTF_REPLACEMENT_CHAR;
+    }
+    *index += len;
+    return code_point;
+}
+
+/// utf16_decode()
+///     Decodes one code point at *index and moves *index past it
+uint32_t utf16_decode(size_t utf16chars, const utf16_t *utf16string, size_t *index) {
+    uint32_t c = utf16string[*index];
+    *index += 1;
+    if ((c < 0xD800) || (c > 0xDFFF)) {
+        return c;
+    }
+    if ((c <= 0xDBFF) && (*index < utf16chars) &&
+            (utf16string[*index] >= 0xDC00) && (utf16string[*index] <= 0xDFFF)) {
+        uint32_t low = utf16string[*index];
+        *index += 1;
+        return 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+    }
+    // unpaired surrogate
+    return UTF_REPLACEMENT_CHAR;
+}
+
+size_t utf8_encoded_size(uint32_t code_point) {
+    if (code_point < 0x80) {
+        return 1;
+    } else if (code_point < 0x800) {
+        return 2;
+    } else if (code_point < 0x10000) {
+        return 3;
+    } else {
+        return 4;
+    }
+}
+
+size_t utf8_to_utf16_chars(size_t utf8size, const char *utf8string) {
+    size_t i = 0;
+    size_t chars = 0;
+    while (i < utf8size) {
+        size_t ascii = utf8_ascii_widen(utf8size - i, &utf8string[i], NULL);
+        i += ascii;
+        chars += ascii;
+        if (i < utf8size) {
+            chars += (utf8_decode(utf8size, utf8string, &i) >= 0x10000) ? 2 : 1;
+        }
+    }
+    return chars;
+}
+
+size_t utf16_to_utf8_size(size_t utf16chars, const utf16_t *utf16string) {
+    size_t i = 0;
+    size_t size = 0;
+    while (i < utf16chars) {
+        size_t ascii = utf16_ascii_narrow(utf16chars - i, &utf16string[i], NULL);
+        i += ascii;
+        size += ascii;
+        if (i < utf16chars) {
+            size += utf8_encoded_size(utf16_decode(utf16chars, utf16string, &i));
+        }
+    }
+    return size;
+}
+
+size_t utf8_to_utf16_buf(size_t utf8size, const char *utf8string, utf16_t *utf16buf) {
+    size_t i = 0;
+    size_t chars = 0;
+    while (i < utf8size) {
+        size_t ascii = utf8_ascii_widen(utf8size - i, &utf8string[i], &utf16buf[chars]);
+        i += ascii;
+        chars += ascii;
+        if (i >= utf8size) {
+            break;
+        }
+
+        uint32_t code_point = utf8_decode(utf8size, utf8string, &i);
+        if (code_point >= 0x10000) {
+            code_point -= 0x10000;
+            utf16buf[chars] = 0xD800 + (code_point >> 10);
+            utf16buf[chars + 1] = 0xDC00 + (code_point & 0x3FF);
+            chars += 2;
+        } else {
+            utf16buf[chars] = code_point;
+            chars += 1;
+        }
+    }
+    return chars;
+}
+
+size_t utf16_to_utf8_buf(size_t utf16chars, const utf16_t *utf16string, char *utf8buf) {
+    size_t i = 0;
+    size_t size = 0;
+    while (i < utf16chars) {
+        size_t ascii = utf16_ascii_narrow(utf16chars - i, &utf16string[i], &utf8buf[size]);
+        i += ascii;
+        size += ascii;
+        if (i >= utf16chars) {
+            break;
+        }
+
+        uint32_t code_point = utf16_decode(utf16chars, utf16string, &i);
+        uint8_t *out = (uint8_t *)&utf8buf[size];
+        if (code_point < 0x80) {
+            out[0] = code_point;
+            size += 1;
+        } else if (code_point < 0x800) {
+            out[0] = 0xC0 | (code_point >> 6);
+            out[1] = 0x80 | (code_point & 0x3F);
+            size += 2;
+        } else if (code_point < 0x10000) {
+            out[0] = 0xE0 | (code_point >> 12);
+            out[1] = 0x80 | ((code_point >> 6) & 0x3F);
+            out[2] = 0x80 | (code_point & 0x3F);
+            size += 3;
+        } else {
+            out[0] = 0xF0 | (code_point >> 18);
+            out[1] = 0x80 | ((code_point >> 12) & 0x3F);
+            out[2] = 0x80 | ((code_point >> 6) & 0x3F);
+            out[3] = 0x80 | (code_point & 0x3F);
+            size += 4;
+        }
+    }
+    return size;
+}
+
+void utf8_to_utf16(size_t utf8size, char *utf8string, size_t *utf16chars, utf16_t **utf16string) {
+    *utf16chars = utf8_to_utf16_chars(utf8size, utf8string);
+    *utf16string = (utf16_t *)malloc(((*utf16chars) + 1) * sizeof(utf16_t));
+    assert(*utf16string != NULL);
+    size_t chars = utf8_to_utf16_buf(utf8size, utf8string, *utf16string);
+    assert(chars == *utf16chars);
+}
+
+void utf16_to_utf8(size_t utf16chars, utf16_t *utf16string, size_t *utf8size, char **utf8string) {
+    *utf8size = utf16_to_utf8_size(utf16chars, utf16string) + 1;
+    *utf8string = (char *)malloc(*utf8size);
+    assert(*utf8string != NULL);
+    size_t size = utf16_to_utf8_buf(utf16chars, utf16string, *utf8string);
+    assert(size + 1 == *utf8size);
+    (*utf8string)[size] = 0;
+}
+
+/// utf16_fold_case()
+///     Simple case folding of a UTF-16 code unit to lower case. Covers Latin, Greek,
+///     Cyrillic and fullwidth Latin letters, other characters are returned unchanged.
+utf16_t utf16_fold_case(utf16_t c) {
+    if (c < 0x80) {
+        return ((c >= 'A') && (c <= 'Z')) ? (c + 0x20) : c;
+    } else if (c < 0x100) {
+        // Latin-1 Supplement, except multiplication sign
+        return ((c >= 0xC0) && (c <= 0xDE) && (c != 0xD7)) ? (c + 0x20) : c;
+    } else if (c < 0x180) {
+        // Latin Extended-A, pairs of upper and lower case letters
+        if ((c == 0x130) || (c == 0x131) || (c == 0x138) || (c == 0x149) || (c == 0x17F)) {
+            return c;
+        } else if (c == 0x178) {
+            return 0xFF;
+        } else if (((c >= 0x139) && (c <= 0x148)) || (c >= 0x179)) {
+            return (c & 1) ? (c + 1) : c;
+        } else {
+            return (c & 1) ? c : (c + 1);
+        }
+    } else if ((c >= 0x391) && (c <= 0x3AB) && (c != 0x3A2)) {
+        // Greek
+        return c + 0x20;
+    } else if ((c >= 0x400) && (c <= 0x40F)) {
+        // Cyrillic with diacritics
+        return c + 0x50;
+    } else if ((c >= 0x410) && (c <= 0x42F)) {
+        // basic Cyrillic
+        return c + 0x20;
+    } else if ((c >= 0xFF21) && (c <= 0xFF3A)) {
+        // fullwidth Latin
+        return c + 0x20;
+    }
+    return c;
+}
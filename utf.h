@@ -0,0 +1,26 @@
+#ifndef __UTF_H
+#define __UTF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint16_t utf16_t;
+
+#define UTF_REPLACEMENT_CHAR 0xFFFD
+
+// Exact size conversions, output is malloc-ed. utf8size returned by utf16_to_utf8
+// includes terminating 0 byte.
+void utf8_to_utf16(size_t utf8size, char *utf8string, size_t *utf16chars, utf16_t **utf16string);
+void utf16_to_utf8(size_t utf16chars, utf16_t *utf16string, size_t *utf8size, char **utf8string);
+
+// Conversions into caller buffer, return number of utf16 chars or utf8 bytes written.
+// utf16 buffer must fit utf8size chars, utf8 buffer must fit 3 * utf16chars bytes.
+size_t utf8_to_utf16_buf(size_t utf8size, const char *utf8string, utf16_t *utf16buf);
+size_t utf16_to_utf8_buf(size_t utf16chars, const utf16_t *utf16string, char *utf8buf);
+
+size_t utf8_to_utf16_chars(size_t utf8size, const char *utf8string);
+size_t utf16_to_utf8_size(size_t utf16chars, const utf16_t *utf16string);
+
+utf16_t utf16_fold_case(utf16_t c);
+
+#endif